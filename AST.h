@@ -3,142 +3,211 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "global.h"
 #include "AST.h"
+#include "Arena.h"
+#include "Bytecode.h"
 #include "Type.h"
 #include "CodeGen.h"
+#include "ParameterLayout.h"
+#include "Symbol.h"
+#include "UniformAnalysis.h"
 
 #include <stdio.h>
 
 namespace shmoptix {
 
+// Nodes are allocated in the Arena of their shader, see Parser, and hold
+// their children as plain pointers.
 class AST : public ErrorHandler {
 public:
-	AST() : Builder(getBuilder()) {}
+	AST() { ++getNodeCount(); }
 	virtual ~AST() {}
 public:
+	// Number of nodes created so far on this thread, for the compile
+	// statistics.
+	static size_t& getNodeCount() {
+		static thread_local size_t count = 0;
+		return count;
+	}
+
 	virtual void print() = 0;
-	virtual llvm::Value* codegen() = 0;
+	virtual llvm::Value* codegen(LLVMCodeGen& codeGen) = 0;
+
+	// Bytecode for the interpreter tier, returns the result register.
+	virtual uint16_t emitBytecode(Bytecode& bytecode) {
+		return bytecode.unsupported();
+	}
+
+	// Uniform/varying analysis: returns, and remembers, whether the value
+	// can differ between the points of a grid. Conservatively varying.
+	virtual bool analyze(UniformAnalysis& analysis) { return varying = true; }
+	bool isVarying() { return varying; }
+
+	void setLocation(Location l) { location = l; }
+	Location getLocation() { return location; }
 protected:
-	llvm::IRBuilder<>& Builder;
+	bool varying = true;
+	Location location;
 };
 
 class ExprAST : public AST {
 public:
 	virtual ~ExprAST() {}
+public:
+	// Code for this expression. In grid code, uniform expressions worth
+	// computing are evaluated once before the point loop and broadcast.
+	llvm::Value* generate(LLVMCodeGen& codeGen) {
+		auto& builder = codeGen.getBuilder();
+		codeGen.setLocation(builder, location);
+		if (!varying && isHoistable() && codeGen.getLanes() > 1) {
+			return codeGen.hoist(builder, [&] { return codegen(codeGen); });
+		}
+		return codegen(codeGen);
+	}
+	virtual bool isHoistable() { return false; }
 };
 
 class VariableExprAST : public ExprAST {
 public:
-	VariableExprAST(const std::string name) : name(name) {}
+	VariableExprAST(Symbol name) : name(name) {}
 public:
 	void print() {
 		llvm::outs() << "VariableExprAST " << name << newline;
 	}
-	llvm::Value* codegen() { 
-		auto value = CodeGen.lookupNamedValue(name);
+	bool analyze(UniformAnalysis& analysis) {
+		return varying = analysis.isVarying(name);
+	}
+	llvm::Value* codegen(LLVMCodeGen& codeGen) {
+		auto value = codeGen.lookupNamedValue(name);
 		if (!value) {
-			error("Unknown variable: " + name);
+			error("Unknown variable: " + name.str());
 		}
 		return value;
 	}
+	uint16_t emitBytecode(Bytecode& bytecode) {
+		return bytecode.getVariable(name.str());
+	}
+	Symbol getName() { return name; }
 private:
-	std::string name;
+	Symbol name;
 };
 
 class AssignmentExprAST : public ExprAST {
 public:
-	AssignmentExprAST(std::unique_ptr<ExprAST> lhs, std::unique_ptr<ExprAST> rhs) : lhs(std::move(lhs)), rhs(std::move(rhs)) {}
+	AssignmentExprAST(ExprAST* lhs, ExprAST* rhs) : lhs(lhs), rhs(rhs) {}
 public:
 	void print() {
 		llvm::outs() << "AssignmentExpressionAST" << newline;
 		lhs->print();
 		rhs->print();
 	}
-	llvm::Value* codegen() {
-		auto l = lhs->codegen();
+	bool analyze(UniformAnalysis& analysis) {
+		auto r = rhs->analyze(analysis);
+		if (auto variable = dynamic_cast<VariableExprAST*>(lhs)) {
+			analysis.setVarying(variable->getName());
+		}
+		auto l = lhs->analyze(analysis);
+		return varying = l || r;
+	}
+	llvm::Value* codegen(LLVMCodeGen& codeGen) {
+		auto& builder = codeGen.getBuilder();
+		auto l = lhs->generate(codeGen);
 		assert(l != nullptr && "Value codegen: lhs returned nullptr!");
-		auto r = rhs->codegen();
+		auto r = rhs->generate(codeGen);
 		assert(r != nullptr && "Value codegen: rhs returned nullptr!");
 
-		llvm::Value* ret = nullptr;
-
-		if (l->getType() == CodeGen.pointerToColorType && r->getType() == CodeGen.pointerToColorType) {
-			auto load = Builder.CreateAlignedLoad(r, 16);
-			//Builder.CreateStore(load, l);
-			Builder.CreateAlignedStore(load, l, 16);
-		}
-		else if (l->getType() == CodeGen.floatType && r->getType() == CodeGen.floatType) {
-			llvm::outs() << "TODO assign float/float" << newline;
-		}
-		else if (l->getType() == CodeGen.pointerToFloatType && r->getType() == CodeGen.floatType) {
-			auto alloc = Builder.CreateAlloca(CodeGen.floatType);
-			Builder.CreateStore(r, alloc);
-			auto load = Builder.CreateLoad(alloc);
-			ret = Builder.CreateStore(load, l);
-		}
-		else if (l->getType() == CodeGen.pointerToColorType && r->getType() == CodeGen.colorType) {
-			Builder.CreateStore(r, l);
-		}
-		else if (l->getType() == CodeGen.pointerToColorType && r->getType() == CodeGen.floatType) {
-
-			// promote float to color
-			auto undef = llvm::UndefValue::get(CodeGen.colorType);
-			uint64_t idx = 0;
-			auto insert = Builder.CreateInsertElement(undef, r, idx);
-			auto zeroInt = llvm::Constant::getNullValue(CodeGen.int4Type);
-			auto shuffle = Builder.CreateShuffleVector(insert, undef, zeroInt);
-
-			ret = Builder.CreateStore(shuffle, l);
-	}
-		else {
-			llvm::outs() << "assign: unknown" << newline;
-			llvm::outs().flush();
+		// Float parameters are values, not variables.
+		if (!l->getType()->isPointerTy() || !codeGen.store(builder, r, l)) {
 			l->getType()->dump();
 			r->getType()->dump();
-			llvm::outs().flush();
+			error("Invalid assignment");
 		}
-		llvm::outs().flush();
+		return l;
+	}
 
-		return ret;
+	uint16_t emitBytecode(Bytecode& bytecode) {
+		auto variable = dynamic_cast<VariableExprAST*>(lhs);
+		if (!variable) {
+			error("Can only assign to variables");
+		}
+		auto r = rhs->emitBytecode(bytecode);
+		bytecode.assign(variable->getName().str(), r);
+		return bytecode.getVariable(variable->getName().str());
 	}
 
 private:
-	std::unique_ptr<ExprAST> lhs;
-	std::unique_ptr<ExprAST> rhs;
+	ExprAST* lhs;
+	ExprAST* rhs;
 };
 
 
 class FunctionCallAST : public ExprAST {
 public:
 	//FunctionCallAST(const std::string& name, const std::string argument) : name(name), argument(argument) {}
-	FunctionCallAST(const std::string& name, const std::string& argument) : name(name), argument(argument) {}
+	FunctionCallAST(Symbol name, llvm::ArrayRef<Symbol> arguments) : name(name), arguments(arguments) {}
 public:
 	void print() {
 		//llvm::outs() << "FunctionCallAST " << name << space << argument << newline;
-		llvm::outs() << "FunctionCallAST " << name << space << argument << newline;
+		llvm::outs() << "FunctionCallAST " << name;
+		for (auto& argument : arguments) {
+			llvm::outs() << space << argument;
+		}
+		llvm::outs() << newline;
+	}
+	bool analyze(UniformAnalysis& analysis) {
+		varying = isLit() && analysis.isVarying(names::P);
+		for (auto& argument : arguments) {
+			varying = varying || analysis.isVarying(argument);
+		}
+		return varying;
 	}
-	llvm::Value* codegen() {
+	bool isHoistable() { return true; }
+	// Whether the builtin evaluates the lights at the shading position.
+	bool isLit() {
+		auto builtin = std::find_if(builtins.begin(), builtins.end(), [&](const Builtin& b) { return b.name == name.getString(); });
+		return builtin != builtins.end() && builtin->lit;
+	}
+	llvm::Value* codegen(LLVMCodeGen& codeGen) {
 		
+		auto& builder = codeGen.getBuilder();
 		std::vector<llvm::Value*> args;
-		auto llvmCall = CodeGen.lookupNamedValue(name);
-		auto arg = CodeGen.lookupNamedValue(argument);
-		args.push_back(arg);
-		auto call = Builder.CreateCall(llvmCall, args);
+		auto llvmCall = codeGen.lookupNamedValue(name);
+		if (!llvmCall) {
+			error("Unknown function: " + name.str());
+		}
+		args.push_back(codeGen.getShadingContext());
+		if (isLit()) {
+			args.push_back(codeGen.lookupNamedValue(names::P));
+		}
+		for (auto& argument : arguments) {
+			auto arg = codeGen.lookupNamedValue(argument);
+			if (!arg) {
+				error("Unknown variable: " + argument.str());
+			}
+			// Floats are passed by value, colors by pointer.
+			if (arg->getType() == codeGen.pointerToFloatType) {
+				arg = codeGen.load(builder, arg);
+			}
+			args.push_back(arg);
+		}
+		auto call = builder.CreateCall(llvmCall, args);
 		return call;
 #if 0
 
-		auto zero = Builder.getInt32(0);
+		auto zero = builder.getInt32(0);
 		std::vector<llvm::Value*> idx0{ zero };
-		auto gep = Builder.CreateInBoundsGEP(arg, idx0);
-		auto test1 = Builder.CreateAlloca(CodeGen.pointerToColorType);
-		auto test2 = Builder.CreateStore(gep, test1);
+		auto gep = builder.CreateInBoundsGEP(arg, idx0);
+		auto test1 = builder.CreateAlloca(codeGen.pointerToColorType);
+		auto test2 = builder.CreateStore(gep, test1);
 
 		auto argType = arg->getType();
-		auto llvmCall = CodeGen.lookupNamedValue(name);
+		auto llvmCall = codeGen.lookupNamedValue(name);
 		auto callType = llvmCall->getType();
 		auto pointerType = llvm::cast<llvm::PointerType>(callType);
 		auto functionType = llvm::cast<llvm::FunctionType>(pointerType->getElementType());
@@ -169,87 +238,106 @@ public:
 #endif
 #if 0
 		if (argType != paramType) {
-			error("Types do not match for function call \"" + name + "\"");
+			error("Types do not match for function call \"" + name.str() + "\"");
 		}
 
-		auto call = Builder.CreateCall(llvmCall, args);
+		auto call = builder.CreateCall(llvmCall, args);
 
 		return call;
 #endif
 	}
+	uint16_t emitBytecode(Bytecode& bytecode) {
+		std::vector<uint16_t> registers;
+		for (auto& argument : arguments) {
+			registers.push_back(bytecode.getVariable(argument.str()));
+		}
+		return bytecode.call(name.str(), registers);
+	}
 private:
-	std::string name;
-	std::string argument;
+	Symbol name;
+	// In the arena
+	llvm::ArrayRef<Symbol> arguments;
 };
 
+// lhs op rhs, op one of FAdd, FSub, FMul and FDiv.
 class BinaryExprAST : public ExprAST {
 public:
-	BinaryExprAST(std::unique_ptr<ExprAST> lhs, std::unique_ptr<ExprAST> rhs) : lhs(std::move(lhs)), rhs(std::move(rhs)) {}
+	BinaryExprAST(llvm::Instruction::BinaryOps op, ExprAST* lhs, ExprAST* rhs) : op(op), lhs(lhs), rhs(rhs) {}
 public:
 	void print() {
-		llvm::outs() << "BinaryExprAST" << newline;
+		llvm::outs() << "BinaryExprAST " << llvm::Instruction::getOpcodeName(op) << newline;
 		lhs->print();
 		rhs->print();
 	}
-	llvm::Value* codegen() {
-		auto l = lhs->codegen();
-		auto r = rhs->codegen();
-
-		if (l->getType() == CodeGen.floatType && r->getType() == CodeGen.pointerToColorType) {
-
-			// promote float to color
-			auto undef = llvm::UndefValue::get(CodeGen.colorType);
-			uint64_t idx = 0;
-			auto insert = Builder.CreateInsertElement(undef, l, idx);
-			auto zeroVec = llvm::Constant::getNullValue(CodeGen.int4Type);
-			auto shuffle = Builder.CreateShuffleVector(insert, undef, zeroVec);
-	
-			auto load = Builder.CreateLoad(r);
-			auto mul = Builder.CreateBinOp(llvm::Instruction::BinaryOps::FMul, shuffle, load);
-			return mul;
-		}
-		else if (l->getType() == CodeGen.pointerToColorType && r->getType() == CodeGen.floatType) {
-
-			// promote float to color
-			auto undef = llvm::UndefValue::get(CodeGen.colorType);
-			uint64_t idx = 0;
-			auto insert = Builder.CreateInsertElement(undef, r, idx);
-			auto zeroVec = llvm::Constant::getNullValue(CodeGen.int4Type);
-			auto shuffle = Builder.CreateShuffleVector(insert, undef, zeroVec);
-	
-			auto load = Builder.CreateLoad(l);
-			auto mul = Builder.CreateBinOp(llvm::Instruction::BinaryOps::FMul, load, shuffle);
-			return mul;
-		}
-		else if (l->getType() == CodeGen.floatType && r->getType() == CodeGen.colorType) {
-
-			// promote float to color
-			auto undef = llvm::UndefValue::get(CodeGen.colorType);
-			uint64_t idx = 0;
-			auto insert = Builder.CreateInsertElement(undef, l, idx);
-			auto zeroVec = llvm::Constant::getNullValue(CodeGen.int4Type);
-			auto shuffle = Builder.CreateShuffleVector(insert, undef, zeroVec);
-			auto mul = Builder.CreateBinOp(llvm::Instruction::BinaryOps::FMul, shuffle, r);
-			return mul;
-		}
-		else if (l->getType() == CodeGen.pointerToColorType && r->getType() == CodeGen.colorType) {
-
-			auto load = Builder.CreateLoad(l);
-			auto mul = Builder.CreateBinOp(llvm::Instruction::BinaryOps::FMul, load, r);
-			return mul;
-		}
-		else {
+	bool analyze(UniformAnalysis& analysis) {
+		auto l = lhs->analyze(analysis);
+		auto r = rhs->analyze(analysis);
+		return varying = l || r;
+	}
+	bool isHoistable() { return true; }
+	llvm::Value* codegen(LLVMCodeGen& codeGen) {
+		auto& builder = codeGen.getBuilder();
+		auto l = lhs->generate(codeGen);
+		auto r = rhs->generate(codeGen);
+
+		// Variables are loaded, a float and a color are promoted to a
+		// color.
+		l = codeGen.load(builder, l);
+		r = codeGen.load(builder, r);
+		if (l->getType() == codeGen.floatType && r->getType() == codeGen.colorType) {
+			l = codeGen.promoteToColor(builder, l);
+		}
+		if (l->getType() == codeGen.colorType && r->getType() == codeGen.floatType) {
+			r = codeGen.promoteToColor(builder, r);
+		}
+		if (l->getType() != r->getType() || (l->getType() != codeGen.floatType && l->getType() != codeGen.colorType)) {
 			l->getType()->dump();
 			r->getType()->dump();
 			error("Unimplemented binary expression");
 			return nullptr;
 		}
+		return builder.CreateBinOp(op, l, r);
+	}
+	uint16_t emitBytecode(Bytecode& bytecode) {
+		auto l = lhs->emitBytecode(bytecode);
+		auto r = rhs->emitBytecode(bytecode);
+		return bytecode.arithmetic(op, l, r);
+	}
+private:
+	llvm::Instruction::BinaryOps op;
+	ExprAST* lhs;
+	ExprAST* rhs;
+};
 
+// Comparison of two floats, a bool per lane in grid code. Not hoisted,
+// only its operands: branches need the comparison per lane.
+class CompareExprAST : public ExprAST {
+public:
+	CompareExprAST(llvm::CmpInst::Predicate predicate, ExprAST* lhs, ExprAST* rhs) : predicate(predicate), lhs(lhs), rhs(rhs) {}
+public:
+	void print() {
+		llvm::outs() << "CompareExprAST " << llvm::CmpInst::getPredicateName(predicate) << newline;
+		lhs->print();
+		rhs->print();
+	}
+	bool analyze(UniformAnalysis& analysis) {
+		auto l = lhs->analyze(analysis);
+		auto r = rhs->analyze(analysis);
+		return varying = l || r;
+	}
+	llvm::Value* codegen(LLVMCodeGen& codeGen) {
+		auto& builder = codeGen.getBuilder();
+		auto l = codeGen.load(builder, lhs->generate(codeGen));
+		auto r = codeGen.load(builder, rhs->generate(codeGen));
+		if (l->getType() != codeGen.floatType || r->getType() != codeGen.floatType) {
+			error("Can only compare floats");
+		}
+		return builder.CreateFCmp(predicate, l, r);
 	}
 private:
-	// Assume multiplication for now
-	std::unique_ptr<ExprAST> lhs;
-	std::unique_ptr<ExprAST> rhs;
+	llvm::CmpInst::Predicate predicate;
+	ExprAST* lhs;
+	ExprAST* rhs;
 };
 
 class NumExprAST : public ExprAST {
@@ -257,100 +345,527 @@ public:
 	NumExprAST(double v) : value(v) {}
 public:
 	void print() { llvm::outs() << "NumExpr: " << value << newline; }
-	llvm::Value* codegen() {
-		return llvm::ConstantFP::get(Context, llvm::APFloat(value));
+	bool analyze(UniformAnalysis& analysis) { return varying = false; }
+	llvm::Value* codegen(LLVMCodeGen& codeGen) {
+		return llvm::ConstantFP::get(codeGen.floatType, value);
+	}
+	uint16_t emitBytecode(Bytecode& bytecode) {
+		return bytecode.constant(value);
 	}
 private:
 	double value;
 };
 
+// Constant values of shader parameters, one float for a float parameter
+// and one (broadcast) or four for a color.
+typedef std::map<std::string, std::vector<float>> ParameterValues;
+
 class ArgumentAST : public ExprAST {
 public:
-	ArgumentAST(Type type, std::string name) : type(type), name(name) {}
+	// Shader parameters are uniform unless declared varying. Output
+	// parameters are varying.
+	ArgumentAST(Type type, Symbol name, bool isVarying = false, bool isOutput = false) : type(type), name(name), output(isOutput) { varying = isVarying || isOutput; }
 public:
 	void addValue(double v) { value = v; }
+	// Make a uniform parameter varying, e.g. for per point values.
+	void setVarying() { varying = true; }
 	Type getType() { return type; }
-	std::string getName() { return name; }
+	Symbol getName() { return name; }
 	double getValue() { return value; }
+	bool isOutput() { return output; }
 
 	void print() {
-		llvm::outs() << "Argument " << type << space << name << space << value << newline;
+		llvm::outs() << "Argument " << (output ? "output " : "") << (varying ? "varying " : "uniform ") << type << space << name << space << value << newline;
 	}
 
-	llvm::Argument* codegen() {
+	llvm::Argument* codegen(LLVMCodeGen& codeGen) {
 		return nullptr;
 	}
 private:
 	Type type;
-	std::string name;
-	double value;
+	Symbol name;
+	double value = 0;
+	bool output;
 };
 
+// A local variable, optionally initialized. Locals are always varying, so
+// expressions reading them stay in the point loop.
 class DeclarationAST : public AST {
 public:
-	DeclarationAST(const std::string& name, llvm::Value* value) : name(name), value(value) {}
+	DeclarationAST(Type type, Symbol name, ExprAST* initializer = nullptr) : type(type), name(name), initializer(initializer) {}
 	virtual ~DeclarationAST() {}
 public:
-	void print() {}
-	llvm::Value* codegen() {
+	void print() {
+		llvm::outs() << "DeclarationAST " << type << space << name << newline;
+		if (initializer) {
+			initializer->print();
+		}
+	}
+	bool analyze(UniformAnalysis& analysis) {
+		if (initializer) {
+			initializer->analyze(analysis);
+		}
+		analysis.setVarying(name);
+		return varying = true;
+	}
+	llvm::Value* codegen(LLVMCodeGen& codeGen) {
+		auto value = initializer ? initializer->generate(codeGen) : nullptr;
+		auto variable = codeGen.createLocal(type == Type::Color ? codeGen.colorType : codeGen.floatType, name.str());
+		if (value && !codeGen.store(codeGen.getBuilder(), value, variable)) {
+			error("Invalid initializer for " + name.str());
+		}
+		codeGen.insertNameValue(name, variable);
+		return variable;
+	}
+	uint16_t emitBytecode(Bytecode& bytecode) {
+		auto value = initializer ? initializer->emitBytecode(bytecode) : 0;
+		auto variable = bytecode.declare(name.str(), type == Type::Color ? 4 : 1);
+		if (initializer) {
+			bytecode.assign(name.str(), value);
+		}
+		return variable;
+	}
+public:
+	Type type;
+	Symbol name;
+	ExprAST* initializer;
+};
+
+// { statements }, a scope of its own.
+class BlockAST : public AST {
+public:
+	BlockAST(llvm::ArrayRef<AST*> statements) : statements(statements) {}
+public:
+	void print() {
+		llvm::outs() << "BlockAST" << newline;
+		for (auto statement : statements) {
+			statement->print();
+		}
+	}
+	bool analyze(UniformAnalysis& analysis) {
+		for (auto statement : statements) {
+			statement->analyze(analysis);
+		}
+		return varying = true;
+	}
+	llvm::Value* codegen(LLVMCodeGen& codeGen) {
+		codeGen.enterScope();
+		for (auto statement : statements) {
+			codeGen.setLocation(codeGen.getBuilder(), statement->getLocation());
+			statement->codegen(codeGen);
+		}
+		codeGen.exitScope();
 		return nullptr;
 	}
+	uint16_t emitBytecode(Bytecode& bytecode) {
+		for (auto statement : statements) {
+			statement->emitBytecode(bytecode);
+		}
+		return 0;
+	}
+private:
+	// In the arena
+	llvm::ArrayRef<AST*> statements;
+};
+
+// In grid code, a varying condition splits the lanes: both sides run, each
+// with the lanes that take it in the execution mask, and a side no lane
+// takes is skipped. A uniform condition branches for the whole grid.
+class IfAST : public AST {
 public:
-	std::string name;
-	llvm::Value* value;
+	IfAST(ExprAST* condition, AST* then, AST* otherwise) : condition(condition), then(then), otherwise(otherwise) {}
+public:
+	void print() {
+		llvm::outs() << "IfAST" << newline;
+		condition->print();
+		then->print();
+		if (otherwise) {
+			otherwise->print();
+		}
+	}
+	bool analyze(UniformAnalysis& analysis) {
+		varying = condition->analyze(analysis);
+		then->analyze(analysis);
+		if (otherwise) {
+			otherwise->analyze(analysis);
+		}
+		return varying;
+	}
+	llvm::Value* codegen(LLVMCodeGen& codeGen) {
+		auto& builder = codeGen.getBuilder();
+		auto function = builder.GetInsertBlock()->getParent();
+		auto thenBlock = llvm::BasicBlock::Create(codeGen.getContext(), "then", function);
+		auto elseBlock = llvm::BasicBlock::Create(codeGen.getContext(), "else", function);
+		auto merge = llvm::BasicBlock::Create(codeGen.getContext(), "endif", function);
+
+		auto c = condition->generate(codeGen);
+		auto outer = codeGen.getExecutionMask();
+		bool masked = codeGen.getLanes() > 1 && condition->isVarying();
+		llvm::Value* thenMask = outer;
+		llvm::Value* elseMask = outer;
+		if (masked) {
+			thenMask = codeGen.maskCondition(builder, c);
+			elseMask = codeGen.maskCondition(builder, builder.CreateNot(c));
+			c = codeGen.any(builder, thenMask);
+		}
+		else if (codeGen.getLanes() > 1) {
+			c = builder.CreateExtractElement(c, uint64_t(0));
+		}
+		builder.CreateCondBr(c, thenBlock, elseBlock);
+
+		builder.SetInsertPoint(thenBlock);
+		codeGen.setExecutionMask(thenMask);
+		then->codegen(codeGen);
+		builder.CreateBr(masked ? elseBlock : merge);
+
+		// With a mask the lanes that took the other side come next.
+		builder.SetInsertPoint(elseBlock);
+		if (otherwise) {
+			if (masked) {
+				auto body = llvm::BasicBlock::Create(codeGen.getContext(), "else.body", function);
+				builder.CreateCondBr(codeGen.any(builder, elseMask), body, merge);
+				builder.SetInsertPoint(body);
+			}
+			codeGen.setExecutionMask(elseMask);
+			otherwise->codegen(codeGen);
+		}
+		builder.CreateBr(merge);
+
+		builder.SetInsertPoint(merge);
+		codeGen.setExecutionMask(outer);
+		return nullptr;
+	}
+private:
+	ExprAST* condition;
+	AST* then;
+	AST* otherwise;
+};
+
+// while (condition) body, and for loops with their step. In grid code a
+// lane leaves the execution mask once its condition fails, and the loop
+// runs until no lane is left.
+class LoopAST : public AST {
+public:
+	LoopAST(ExprAST* condition, AST* body, AST* step = nullptr) : condition(condition), body(body), step(step) {}
+public:
+	void print() {
+		llvm::outs() << "LoopAST" << newline;
+		condition->print();
+		body->print();
+		if (step) {
+			step->print();
+		}
+	}
+	bool analyze(UniformAnalysis& analysis) {
+		varying = condition->analyze(analysis);
+		body->analyze(analysis);
+		if (step) {
+			step->analyze(analysis);
+		}
+		return varying;
+	}
+	llvm::Value* codegen(LLVMCodeGen& codeGen) {
+		auto& builder = codeGen.getBuilder();
+		auto function = builder.GetInsertBlock()->getParent();
+		auto header = llvm::BasicBlock::Create(codeGen.getContext(), "loop.header", function);
+		auto bodyBlock = llvm::BasicBlock::Create(codeGen.getContext(), "loop.body", function);
+		auto exit = llvm::BasicBlock::Create(codeGen.getContext(), "loop.exit", function);
+
+		// The lanes still looping, carried from one iteration to the next.
+		auto outer = codeGen.getExecutionMask();
+		bool masked = codeGen.getLanes() > 1 && condition->isVarying();
+		llvm::AllocaInst* mask = nullptr;
+		if (masked) {
+			mask = codeGen.createLocal(codeGen.maskType, "mask");
+			builder.CreateStore(outer ? outer : llvm::Constant::getAllOnesValue(codeGen.maskType), mask);
+		}
+		builder.CreateBr(header);
+
+		builder.SetInsertPoint(header);
+		if (masked) {
+			codeGen.setExecutionMask(builder.CreateLoad(mask));
+		}
+		auto c = condition->generate(codeGen);
+		if (masked) {
+			auto active = codeGen.maskCondition(builder, c);
+			builder.CreateStore(active, mask);
+			codeGen.setExecutionMask(active);
+			c = codeGen.any(builder, active);
+		}
+		else if (codeGen.getLanes() > 1) {
+			c = builder.CreateExtractElement(c, uint64_t(0));
+		}
+		builder.CreateCondBr(c, bodyBlock, exit);
+
+		builder.SetInsertPoint(bodyBlock);
+		body->codegen(codeGen);
+		if (step) {
+			codeGen.setLocation(builder, step->getLocation());
+			step->codegen(codeGen);
+		}
+		builder.CreateBr(header);
+
+		builder.SetInsertPoint(exit);
+		codeGen.setExecutionMask(outer);
+		return nullptr;
+	}
+private:
+	ExprAST* condition;
+	AST* body;
+	AST* step;
+};
+
+// illuminance (axis) body: runs body for every light of the shading
+// context, with L the normalized direction and Cl the color of the light.
+// Points facing away from a light, dot(axis, L) <= 0, skip it; in grid
+// code they leave the execution mask and a light no lane faces is
+// skipped. Lights are the same for all points, so the loop itself is
+// uniform.
+class IlluminanceAST : public AST {
+public:
+	IlluminanceAST(Symbol axis, AST* body) : axis(axis), body(body) {}
+public:
+	void print() {
+		llvm::outs() << "IlluminanceAST " << axis << newline;
+		body->print();
+	}
+	bool analyze(UniformAnalysis& analysis) {
+		analysis.setVarying(names::L);
+		analysis.setVarying(names::Cl);
+		body->analyze(analysis);
+		return varying = true;
+	}
+	llvm::Value* codegen(LLVMCodeGen& codeGen) {
+		auto& builder = codeGen.getBuilder();
+		auto function = builder.GetInsertBlock()->getParent();
+		auto context = codeGen.getShadingContext();
+		auto axisValue = codeGen.lookupNamedValue(axis);
+		if (!axisValue || axisValue->getType() != codeGen.pointerToColorType) {
+			error("illuminance needs a color variable: " + axis.str());
+		}
+		auto dot = codeGen.lookupNamedValue(names::dot);
+		auto P = codeGen.lookupNamedValue(names::P);
+
+		// L and Cl of a light at every point, from the builtin library
+		auto lanes = codeGen.getLanes();
+		auto illuminateType = llvm::FunctionType::get(codeGen.voidType, { codeGen.pointerToShadingContextType, codeGen.intType,
+			codeGen.pointerToScalarFloatType, codeGen.pointerToScalarFloatType, codeGen.pointerToScalarFloatType }, false);
+		auto illuminate = codeGen.getModule().getOrInsertFunction(lanes > 1 ? "illuminate_grid" + std::to_string(lanes) : "illuminate",
+			illuminateType, llvm::AttributeSet());
+
+		auto L = codeGen.createLocal(codeGen.colorType, "L");
+		auto Cl = codeGen.createLocal(codeGen.colorType, "Cl");
+		auto index = codeGen.createLocal(codeGen.intType, "light");
+		builder.CreateStore(builder.getInt32(0), index);
+		auto count = builder.CreateLoad(builder.CreateStructGEP(codeGen.shadingContextType, context, 4), "lightCount");
+
+		auto header = llvm::BasicBlock::Create(codeGen.getContext(), "light.header", function);
+		auto lightBlock = llvm::BasicBlock::Create(codeGen.getContext(), "light", function);
+		auto lit = llvm::BasicBlock::Create(codeGen.getContext(), "light.lit", function);
+		auto next = llvm::BasicBlock::Create(codeGen.getContext(), "light.next", function);
+		auto exit = llvm::BasicBlock::Create(codeGen.getContext(), "light.exit", function);
+		builder.CreateBr(header);
+
+		builder.SetInsertPoint(header);
+		auto i = builder.CreateLoad(index);
+		builder.CreateCondBr(builder.CreateICmpSLT(i, count), lightBlock, exit);
+
+		builder.SetInsertPoint(lightBlock);
+		builder.CreateCall(illuminate, { context, i, builder.CreateBitCast(P, codeGen.pointerToScalarFloatType),
+			builder.CreateBitCast(L, codeGen.pointerToScalarFloatType), builder.CreateBitCast(Cl, codeGen.pointerToScalarFloatType) });
+
+		auto facing = builder.CreateFCmpOGT(builder.CreateCall(dot, { context, axisValue, L }), llvm::ConstantFP::get(codeGen.floatType, 0.));
+		auto outer = codeGen.getExecutionMask();
+		auto mask = outer;
+		if (lanes > 1) {
+			mask = codeGen.maskCondition(builder, facing);
+			facing = codeGen.any(builder, mask);
+		}
+		builder.CreateCondBr(facing, lit, next);
+
+		builder.SetInsertPoint(lit);
+		codeGen.setExecutionMask(mask);
+		codeGen.enterScope();
+		codeGen.insertNameValue(names::L, L);
+		codeGen.insertNameValue(names::Cl, Cl);
+		body->codegen(codeGen);
+		codeGen.exitScope();
+		codeGen.setExecutionMask(outer);
+		builder.CreateBr(next);
+
+		builder.SetInsertPoint(next);
+		builder.CreateStore(builder.CreateAdd(i, builder.getInt32(1)), index);
+		builder.CreateBr(header);
+
+		builder.SetInsertPoint(exit);
+		return nullptr;
+	}
+private:
+	Symbol axis;
+	AST* body;
 };
 
 class ShaderPrototypeAST : public ErrorHandler {
 public:
 
-	ShaderPrototypeAST(std::string shaderName, std::unique_ptr<std::vector<std::unique_ptr<ArgumentAST>>> arguments) : name(shaderName), arguments(std::move(arguments)) {}
+	ShaderPrototypeAST(std::string shaderName, llvm::ArrayRef<ArgumentAST*> arguments, llvm::ArrayRef<ArgumentAST*> outputs = {})
+		: name(shaderName), arguments(arguments), outputs(outputs) {}
 
 public:
 
 	void print() {
 		llvm::outs() << "ShaderPrototypeAST " << name << newline;
-		for (const auto& argument : *arguments) {
+		for (auto argument : arguments) {
 			argument->print();
 		}
+		for (auto output : outputs) {
+			output->print();
+		}
 	}
 
-	llvm::Function* codegen() {
+	llvm::Function* codegen(LLVMCodeGen& codeGen, const std::string& entryName) {
 
-		std::vector<llvm::Type*> argumentTypes;
-		for (auto& argument : *arguments) {
+		std::vector<llvm::Type*> argumentTypes{ codeGen.pointerToShadingContextType };
+		for (auto argument : arguments) {
 			switch (argument->getType()) {
 			case Type::Float:
-				argumentTypes.push_back(CodeGen.floatType);
+				argumentTypes.push_back(codeGen.floatType);
 				break;
 			case Type::Color:
-				argumentTypes.push_back(CodeGen.pointerToColorType);
+				argumentTypes.push_back(codeGen.pointerToColorType);
 				break;
 			default:
 				error("Unknown Type in Argument codegen!");
 			}
 		}
-		auto functionType = llvm::FunctionType::get(llvm::Type::getVoidTy(Context), argumentTypes, false);
-		auto function = llvm::cast<llvm::Function>(module->getOrInsertFunction(name, functionType, llvm::AttributeSet()));
+		auto functionType = llvm::FunctionType::get(llvm::Type::getVoidTy(codeGen.getContext()), argumentTypes, false);
+		auto function = llvm::cast<llvm::Function>(codeGen.getModule().getOrInsertFunction(entryName, functionType, llvm::AttributeSet()));
 
-		auto argIt = arguments->begin();
+		auto argIt = arguments.begin();
 		auto llvmIt = function->arg_begin();
+		llvmIt->setName("context");
+		++llvmIt;
 
-		for (int i = 0; i < arguments->size(); ++i) {
-			llvmIt->setName((*argIt)->getName());
+		for (int i = 0; i < arguments.size(); ++i) {
+			llvmIt->setName((*argIt)->getName().getString());
 			++argIt; ++llvmIt;
 		}
 		return function;
 	}
 
+	// Grid entry point: the shading context, then every argument, uniform
+	// ones as a single value (colors by pointer) and varying ones as a
+	// structure of arrays buffer like the globals P, N and Ci that follow,
+	// then the range of points to shade and the channel stride.
+	llvm::Function* codegenGrid(LLVMCodeGen& codeGen, const std::string& entryName) {
+
+		std::vector<llvm::Type*> argumentTypes{ codeGen.pointerToShadingContextType };
+		for (auto argument : arguments) {
+			if (argument->isVarying()) {
+				argumentTypes.push_back(codeGen.pointerToScalarFloatType);
+			}
+			else if (argument->getType() == Type::Color) {
+				argumentTypes.push_back(llvm::PointerType::getUnqual(codeGen.float4Type));
+			}
+			else {
+				argumentTypes.push_back(codeGen.scalarFloatType);
+			}
+		}
+		argumentTypes.insert(argumentTypes.end(), 3, codeGen.pointerToScalarFloatType);
+		argumentTypes.insert(argumentTypes.end(), 3, codeGen.intType);
+		auto functionType = llvm::FunctionType::get(llvm::Type::getVoidTy(codeGen.getContext()), argumentTypes, false);
+		auto function = llvm::cast<llvm::Function>(codeGen.getModule().getOrInsertFunction(entryName + "_grid", functionType, llvm::AttributeSet()));
+
+		auto llvmIt = function->arg_begin();
+		llvmIt->setName("context");
+		++llvmIt;
+		for (auto argument : arguments) {
+			llvmIt->setName(argument->getName().getString());
+			++llvmIt;
+		}
+		for (auto global : { "P", "N", "Ci", "begin", "end", "stride" }) {
+			llvmIt->setName(global);
+			++llvmIt;
+		}
+		for (unsigned i = 2; i <= arguments.size() + 4; ++i) {
+			if (argumentTypes[i - 1]->isPointerTy()) {
+				function->setDoesNotAlias(i);
+			}
+		}
+		return function;
+	}
+
+	llvm::ArrayRef<ArgumentAST*> getArguments() {
+		return arguments;
+	}
+
+	// Output parameters are not part of the entry points: they are locals
+	// of the body, set to their defaults, that a shader network passes on
+	// to later layers, see ShaderNetworkAST.
+	llvm::ArrayRef<ArgumentAST*> getOutputs() {
+		return outputs;
+	}
+
+	ArgumentAST* getArgument(Symbol name) {
+		for (auto argument : arguments) {
+			if (argument->getName() == name) {
+				return argument;
+			}
+		}
+		return nullptr;
+	}
+
+	ArgumentAST* getOutput(Symbol name) {
+		for (auto output : outputs) {
+			if (output->getName() == name) {
+				return output;
+			}
+		}
+		return nullptr;
+	}
+
+	void codegenOutputs(LLVMCodeGen& codeGen) {
+		for (auto output : outputs) {
+			auto type = output->getType();
+			auto variable = codeGen.createLocal(type == Type::Color ? codeGen.colorType : codeGen.floatType, output->getName().str());
+			codeGen.store(codeGen.getBuilder(), codeGen.createConstant(type, { float(output->getValue()) }), variable);
+			codeGen.insertNameValue(output->getName(), variable);
+		}
+	}
+
+	void emitOutputs(Bytecode& bytecode) {
+		for (auto output : outputs) {
+			auto value = bytecode.constant(float(output->getValue()));
+			bytecode.declare(output->getName().str(), output->getType() == Type::Color ? 4 : 1);
+			bytecode.assign(output->getName().str(), value);
+		}
+	}
+
+	ParameterLayout getParameterLayout() {
+		ParameterLayout layout;
+		for (auto argument : arguments) {
+			layout.add(argument->getName().str(), argument->getType(), argument->isVarying(), float(argument->getValue()));
+		}
+		return layout;
+	}
+
+	const std::string& getName() {
+		return name;
+	}
+
 private:
 
 	std::string name;
-	std::unique_ptr<std::vector<std::unique_ptr<ArgumentAST>>> arguments;
+	// In the arena of the shader
+	llvm::ArrayRef<ArgumentAST*> arguments;
+	llvm::ArrayRef<ArgumentAST*> outputs;
 };
 
 class SurfaceShaderAST : public AST {
 public:
-	SurfaceShaderAST(std::unique_ptr<ShaderPrototypeAST> prototype, std::unique_ptr<AST> body) : prototype(std::move(prototype)), body(std::move(body)) {}
+	// The shader owns the arena of its nodes.
+	SurfaceShaderAST(std::unique_ptr<Arena> arena, std::unique_ptr<ShaderPrototypeAST> prototype, AST* body)
+		: arena(std::move(arena)), prototype(std::move(prototype)), body(body) {}
 public:
 
 	void print() {
@@ -359,26 +874,485 @@ public:
 		body->print();
 	}
 
-	llvm::Function* codegen() {
+	const std::string& getName() {
+		return prototype->getName();
+	}
+
+	llvm::ArrayRef<ArgumentAST*> getArguments() {
+		return prototype->getArguments();
+	}
+
+	ShaderPrototypeAST& getPrototype() {
+		return *prototype;
+	}
+
+	AST* getBody() {
+		return body;
+	}
+
+	void setArena(std::unique_ptr<Arena> nodes) {
+		arena = std::move(nodes);
+	}
+
+	// Only the shader Parser::parse returns owns an arena.
+	size_t getArenaBytes() {
+		return arena ? arena->getBytes() : 0;
+	}
+
+	llvm::Function* codegen(LLVMCodeGen& codeGen) {
+		return codegen(codeGen, ParameterValues{});
+	}
+
+	bool analyze(UniformAnalysis& analysis) {
+		for (auto argument : prototype->getArguments()) {
+			if (argument->isVarying()) {
+				analysis.setVarying(argument->getName());
+			}
+		}
+		for (auto output : prototype->getOutputs()) {
+			analysis.setVarying(output->getName());
+		}
+		if (body) {
+			while (body->analyze(analysis), analysis.hasChanged()) {
+			}
+		}
+		return varying = true;
+	}
+
+	// Parameters found in values are baked in as constants, giving a
+	// specialized variant with the same signature under entryName.
+	llvm::Function* codegen(LLVMCodeGen& codeGen, const ParameterValues& values, const std::string& entryName = "") {
+
+		auto& builder = codeGen.getBuilder();
+		llvm::Function* function = prototype->codegen(codeGen, entryName.empty() ? prototype->getName() : entryName);
+		llvm::BasicBlock* BB = llvm::BasicBlock::Create(codeGen.getContext(), "entry", function);
+		builder.SetInsertPoint(BB);
+		codeGen.beginFunction(builder, function, location);
+		codeGen.enterScope();
+		auto llvmArgument = function->arg_begin();
+		for (auto argument : prototype->getArguments()) {
+			++llvmArgument;
+			auto value = values.find(argument->getName().str());
+			if (value != values.end()) {
+				codeGen.insertNameValue(argument->getName(), codeGen.createConstant(argument->getType(), value->second));
+			}
+			else {
+				codeGen.insertNameValue(argument->getName(), &*llvmArgument);
+			}
+		}
+		codeGen.installShadingContext(builder, &*function->arg_begin());
+		prototype->codegenOutputs(codeGen);
+		if (body) {
+			codeGen.setLocation(builder, body->getLocation());
+			body->codegen(codeGen);
+		}
+		builder.CreateRetVoid();
+		codeGen.endFunction(builder);
+		codeGen.exitScope();
+		llvm::verifyFunction(*function);
+
+		return function;
+	}
+
+	// The grid entry point as bytecode for the interpreter, reading the
+	// parameters from a block laid out by getParameterLayout, like
+	// <name>_grid_block, and the globals from the grid by name.
+	void compileBytecode(Bytecode& bytecode) {
+		for (auto& parameter : getParameterLayout().getParameters()) {
+			bytecode.addParameter(parameter.name, parameter.type, parameter.varying, parameter.offset);
+		}
+		bytecode.addInput("P", Type::Color, true);
+		bytecode.addInput("N", Type::Color, true);
+		bytecode.addInput("Ci", Type::Color, true);
+		prototype->emitOutputs(bytecode);
+		if (body) {
+			body->emitBytecode(bytecode);
+		}
+		bytecode.addOutput("Ci");
+	}
+
+	// Emit <name>_grid, which shades points [begin, end) lanes at a time. The
+	// body is generated with the wide type cache, so floats become
+	// <lanes x float> and colors <4*lanes x float>. Uniform expressions are
+	// computed once in the entry block, before the loop.
+	llvm::Function* codegenGrid(LLVMCodeGen& codeGen, unsigned lanes, const ParameterValues& values = {}, const std::string& entryName = "") {
+
+		auto& builder = codeGen.getBuilder();
+
+		UniformAnalysis analysis{ names::P, names::N, names::Ci };
+		analyze(analysis);
+
+		// Uniform code sees the module level symbols and the single values
+		// of the uniform parameters, grid code their broadcasts.
+		auto uniforms = codeGen.getNamedValues();
+		codeGen.enterScope();
+		codeGen.setLanes(lanes);
 
-		llvm::Function* function = prototype->codegen();
-		llvm::BasicBlock* BB = llvm::BasicBlock::Create(Context, "entry", function);
-		Builder.SetInsertPoint(BB);
+		llvm::Function* function = prototype->codegenGrid(codeGen, entryName.empty() ? prototype->getName() : entryName);
+		auto entry = llvm::BasicBlock::Create(codeGen.getContext(), "entry", function);
+		auto loop = llvm::BasicBlock::Create(codeGen.getContext(), "loop", function);
+		auto block = llvm::BasicBlock::Create(codeGen.getContext(), "block", function);
+		auto exit = llvm::BasicBlock::Create(codeGen.getContext(), "exit", function);
+
+		auto arguments = prototype->getArguments();
+		std::vector<llvm::Value*> buffers;
 		for (auto& argument : function->args()) {
-			CodeGen.insertNameValue(argument.getName(), &argument);
+			buffers.push_back(&argument);
+		}
+		auto context = buffers[0];
+		buffers.erase(buffers.begin());
+		auto P = buffers[arguments.size()];
+		auto N = buffers[arguments.size() + 1];
+		auto Ci = buffers[arguments.size() + 2];
+		auto begin = buffers[arguments.size() + 3];
+		auto end = buffers[arguments.size() + 4];
+		auto stride = buffers[arguments.size() + 5];
+
+		builder.SetInsertPoint(entry);
+		codeGen.beginFunction(builder, function, location);
+		codeGen.installShadingContext(builder, context);
+		std::vector<llvm::Value*> colors, broadcasts(arguments.size());
+		for (auto argument : arguments) {
+			colors.push_back(argument->getType() == Type::Color ? builder.CreateAlloca(codeGen.colorType, nullptr, argument->getName().getString()) : nullptr);
 		}
+
+		// Uniform parameters: the single value for hoisted expressions and a
+		// broadcast of it for per point code.
+		for (size_t i = 0; i < arguments.size(); ++i) {
+			auto name = arguments[i]->getName();
+			auto type = arguments[i]->getType();
+			auto value = values.find(name.str());
+			if (value != values.end()) {
+				codeGen.setLanes(1);
+				uniforms.insert(name, codeGen.createConstant(type, value->second));
+				codeGen.setLanes(lanes);
+				codeGen.insertNameValue(name, codeGen.createConstant(type, value->second));
+			}
+			else if (!arguments[i]->isVarying()) {
+				uniforms.insert(name, buffers[i]);
+				if (colors[i]) {
+					broadcasts[i] = codeGen.widen(builder, builder.CreateLoad(buffers[i]));
+					codeGen.insertNameValue(name, colors[i]);
+				}
+				else {
+					codeGen.insertNameValue(name, codeGen.widen(builder, buffers[i]));
+				}
+			}
+		}
+		auto PVariable = builder.CreateAlloca(codeGen.vector4Type, nullptr, "P");
+		auto NVariable = builder.CreateAlloca(codeGen.vector4Type, nullptr, "N");
+		auto CiVariable = builder.CreateAlloca(codeGen.colorType, nullptr, "Ci");
+		for (auto variable : { PVariable, NVariable, CiVariable }) {
+			variable->setAlignment(codeGen.getGridAlignment());
+		}
+		builder.CreateBr(loop);
+		codeGen.setUniformScope(entry, std::move(uniforms));
+
+		builder.SetInsertPoint(loop);
+		auto index = builder.CreatePHI(codeGen.intType, 2, "index");
+		index->addIncoming(begin, entry);
+		builder.CreateCondBr(builder.CreateICmpSLT(index, end), block, exit);
+
+		builder.SetInsertPoint(block);
+		for (size_t i = 0; i < arguments.size(); ++i) {
+			auto name = arguments[i]->getName();
+			// Every point starts from the parameter, the body may assign it
+			if (broadcasts[i]) {
+				builder.CreateStore(broadcasts[i], colors[i]);
+			}
+			if (values.count(name.str()) || !arguments[i]->isVarying()) {
+				continue;
+			}
+			if (colors[i]) {
+				builder.CreateStore(codeGen.loadVarying(builder, buffers[i], stride, index, 4), colors[i]);
+				codeGen.insertNameValue(name, colors[i]);
+			}
+			else {
+				codeGen.insertNameValue(name, codeGen.loadVarying(builder, buffers[i], stride, index, 1));
+			}
+		}
+		builder.CreateStore(codeGen.loadVarying(builder, P, stride, index, 4), PVariable);
+		builder.CreateStore(codeGen.loadVarying(builder, N, stride, index, 4), NVariable);
+		builder.CreateStore(codeGen.loadVarying(builder, Ci, stride, index, 4), CiVariable);
+		codeGen.insertNameValue(names::P, PVariable);
+		codeGen.insertNameValue(names::N, NVariable);
+		codeGen.insertNameValue(names::Ci, CiVariable);
+		codeGen.installGridBuiltins(builder);
+		prototype->codegenOutputs(codeGen);
 		if (body) {
-			body->codegen();
+			codeGen.setLocation(builder, body->getLocation());
+			body->codegen(codeGen);
 		}
-		Builder.CreateRetVoid();
+		codeGen.setLocation(builder, location);
+		codeGen.storeVarying(builder, builder.CreateLoad(CiVariable), Ci, stride, index, 4);
+		auto next = builder.CreateAdd(index, builder.getInt32(lanes), "next");
+		index->addIncoming(next, builder.GetInsertBlock());
+		builder.CreateBr(loop);
+
+		builder.SetInsertPoint(exit);
+		builder.CreateRetVoid();
+		codeGen.endFunction(builder);
 		llvm::verifyFunction(*function);
 
+		codeGen.setLanes(1);
+		codeGen.exitScope();
 		return function;
 	}
+
+	ParameterLayout getParameterLayout() {
+		return prototype->getParameterLayout();
+	}
+
+	// Entry points that read the parameters from a caller owned block
+	// laid out by getParameterLayout, so one signature serves every
+	// shader:
+	//
+	//   void <name>_block(ShadingContext*, const char* block, int index, int stride)
+	//   void <name>_grid_block(ShadingContext*, const char* block, float* P, float* N, float* Ci, int begin, int end, int stride)
+	//
+	// and the block of default values <name>_defaults. The scalar entry
+	// point gathers point index from the planes of varying parameters.
+	// Uniform colors are copied out, the block is never written.
+	// Calls the other entry points, emit those first.
+	void codegenBlock(LLVMCodeGen& codeGen, const std::string& entryName = "") {
+
+		auto& builder = codeGen.getBuilder();
+		auto& name = entryName.empty() ? prototype->getName() : entryName;
+		auto layout = getParameterLayout();
+		auto pointerToInt8Type = builder.getInt8PtrTy();
+		auto voidType = llvm::Type::getVoidTy(codeGen.getContext());
+		builder.SetCurrentDebugLocation(llvm::DebugLoc());
+
+		auto createEntry = [&](llvm::Function* callee, const std::string& functionName, std::vector<llvm::Type*> globalTypes, bool scalar) {
+			std::vector<llvm::Type*> argumentTypes{ codeGen.pointerToShadingContextType, pointerToInt8Type };
+			argumentTypes.insert(argumentTypes.end(), globalTypes.begin(), globalTypes.end());
+			auto function = llvm::Function::Create(llvm::FunctionType::get(voidType, argumentTypes, false), llvm::Function::ExternalLinkage, functionName, &codeGen.getModule());
+			builder.SetInsertPoint(llvm::BasicBlock::Create(codeGen.getContext(), "entry", function));
+
+			auto calleeType = callee->getFunctionType();
+			auto argument = function->arg_begin();
+			std::vector<llvm::Value*> arguments{ &*argument++ };
+			auto block = &*argument++;
+			block->setName("block");
+			llvm::Value* index = nullptr;
+			llvm::Value* stride = nullptr;
+			if (scalar) {
+				index = &*argument++;
+				index->setName("index");
+				stride = &*argument++;
+				stride->setName("stride");
+			}
+			for (size_t i = 0; i < layout.getParameters().size(); ++i) {
+				auto& parameter = layout.getParameters()[i];
+				auto type = calleeType->getParamType(i + 1);
+				auto address = builder.CreateConstGEP1_32(block, parameter.offset);
+				if (parameter.varying) {
+					auto planes = builder.CreateLoad(builder.CreatePointerCast(address, llvm::PointerType::getUnqual(codeGen.pointerToScalarFloatType)), parameter.name);
+					if (!scalar) {
+						arguments.push_back(builder.CreatePointerCast(planes, type));
+					}
+					else if (parameter.type == Type::Color) {
+						llvm::Value* color = llvm::UndefValue::get(codeGen.float4Type);
+						for (unsigned c = 0; c < 4; ++c) {
+							auto offset = builder.CreateAdd(builder.CreateMul(builder.getInt32(c), stride), index);
+							color = builder.CreateInsertElement(color, builder.CreateLoad(builder.CreateGEP(planes, offset)), builder.getInt32(c));
+						}
+						auto variable = builder.CreateAlloca(codeGen.float4Type, nullptr, parameter.name);
+						builder.CreateStore(color, variable);
+						arguments.push_back(builder.CreatePointerCast(variable, type));
+					}
+					else {
+						arguments.push_back(builder.CreateLoad(builder.CreateGEP(planes, index)));
+					}
+				}
+				else if (type->isPointerTy()) {
+					auto variable = builder.CreateAlloca(codeGen.float4Type, nullptr, parameter.name);
+					builder.CreateStore(builder.CreateLoad(builder.CreatePointerCast(address, llvm::PointerType::getUnqual(codeGen.float4Type))), variable);
+					arguments.push_back(builder.CreatePointerCast(variable, type));
+				}
+				else {
+					arguments.push_back(builder.CreateLoad(builder.CreatePointerCast(address, llvm::PointerType::getUnqual(type)), parameter.name));
+				}
+			}
+			for (; argument != function->arg_end(); ++argument) {
+				arguments.push_back(&*argument);
+			}
+			builder.CreateCall(callee, arguments);
+			builder.CreateRetVoid();
+			llvm::verifyFunction(*function);
+		};
+		auto& module = codeGen.getModule();
+		createEntry(module.getFunction(name), name + "_block", { codeGen.intType, codeGen.intType }, true);
+		createEntry(module.getFunction(name + "_grid"), name + "_grid_block", { codeGen.pointerToScalarFloatType, codeGen.pointerToScalarFloatType,
+			codeGen.pointerToScalarFloatType, codeGen.intType, codeGen.intType, codeGen.intType }, false);
+
+		std::vector<uint8_t> defaults(layout.getSize());
+		layout.initialize(defaults.data());
+		auto initializer = llvm::ConstantDataArray::get(codeGen.getContext(), defaults);
+		auto variable = new llvm::GlobalVariable(module, initializer->getType(), true, llvm::GlobalValue::ExternalLinkage, initializer, name + "_defaults");
+		variable->setAlignment(ParameterLayout::blockAlignment);
+	}
 private:
+	std::unique_ptr<Arena> arena;
 	std::unique_ptr<ShaderPrototypeAST> prototype;
-	std::unique_ptr<AST> body;
+	AST* body;
 };
 
-}
+// A layer of a shader network, an instance of one of the surface shaders
+// of the source.
+struct ShaderLayer {
+	Symbol name;
+	SurfaceShaderAST* shader;
+};
+
+// Output of layer from, Ci or an output parameter, feeding parameter of
+// the later layer to.
+struct ShaderConnection {
+	uint32_t from;
+	Symbol output;
+	uint32_t to;
+	Symbol parameter;
+};
+
+// The body of a shader network, whose layers shade every point one after
+// the other, the last one setting Ci. The layers are generated inline into
+// the entry points of the network, so outputs pass from layer to layer in
+// registers instead of through grid buffers and calls, and the optimizer
+// drops the code of outputs nothing reads. Layers that don't feed the last
+// one are left out. Each layer has its own Ci, a copy of the network's,
+// and parameters that are not connected are parameters of the network, so
+// layers share those of the same name.
+class ShaderNetworkAST : public AST {
+public:
+	ShaderNetworkAST(llvm::ArrayRef<ShaderLayer> layers, llvm::ArrayRef<ShaderConnection> connections) : layers(layers), connections(connections) {}
+public:
+	void print() {
+		llvm::outs() << "ShaderNetworkAST" << newline;
+		for (auto& layer : layers) {
+			llvm::outs() << "Layer " << layer.name << space << layer.shader->getName() << newline;
+		}
+		for (auto& connection : connections) {
+			llvm::outs() << "Connection " << layers[connection.from].name << "." << connection.output << space
+				<< layers[connection.to].name << "." << connection.parameter << newline;
+		}
+	}
+
+	// Whether each layer feeds the last one. Connections only go to later
+	// layers, so one pass from the last layer back finds them all.
+	std::vector<bool> getUsedLayers() {
+		std::vector<bool> used(layers.size());
+		used.back() = true;
+		for (auto i = layers.size(); i-- > 0;) {
+			for (auto& connection : connections) {
+				if (connection.to == i && used[i]) {
+					used[connection.from] = true;
+				}
+			}
+		}
+		return used;
+	}
 
+	bool analyze(UniformAnalysis& analysis) {
+		auto used = getUsedLayers();
+		for (size_t i = 0; i < layers.size(); ++i) {
+			if (!used[i]) {
+				continue;
+			}
+			for (auto& connection : connections) {
+				if (connection.to == i) {
+					analysis.setVarying(connection.parameter);
+				}
+			}
+			for (auto output : layers[i].shader->getPrototype().getOutputs()) {
+				analysis.setVarying(output->getName());
+			}
+			if (auto body = layers[i].shader->getBody()) {
+				body->analyze(analysis);
+			}
+		}
+		return varying = true;
+	}
+
+	llvm::Value* codegen(LLVMCodeGen& codeGen) {
+		auto& builder = codeGen.getBuilder();
+		auto Ci = names::Ci;
+		auto used = getUsedLayers();
+		std::vector<llvm::DenseMap<Symbol, llvm::Value*>> outputs(layers.size());
+		for (size_t i = 0; i < layers.size(); ++i) {
+			if (!used[i]) {
+				continue;
+			}
+			auto& prototype = layers[i].shader->getPrototype();
+			codeGen.enterScope();
+			for (auto& connection : connections) {
+				if (connection.to != i) {
+					continue;
+				}
+				auto type = prototype.getArgument(connection.parameter)->getType();
+				auto variable = codeGen.createLocal(type == Type::Color ? codeGen.colorType : codeGen.floatType, connection.parameter.str());
+				if (!codeGen.store(builder, outputs[connection.from].lookup(connection.output), variable)) {
+					error("Can't connect " + layers[connection.from].name.str() + "." + connection.output.str() + " to " + connection.parameter.str());
+				}
+				codeGen.insertNameValue(connection.parameter, variable);
+			}
+			if (i + 1 < layers.size()) {
+				auto variable = codeGen.createLocal(codeGen.colorType, "Ci");
+				codeGen.store(builder, codeGen.lookupNamedValue(Ci), variable);
+				codeGen.insertNameValue(Ci, variable);
+			}
+			prototype.codegenOutputs(codeGen);
+			if (auto body = layers[i].shader->getBody()) {
+				codeGen.setLocation(builder, body->getLocation());
+				body->codegen(codeGen);
+			}
+			for (auto output : prototype.getOutputs()) {
+				outputs[i][output->getName()] = codeGen.lookupNamedValue(output->getName());
+			}
+			outputs[i][Ci] = codeGen.lookupNamedValue(Ci);
+			codeGen.exitScope();
+		}
+		return nullptr;
+	}
+
+	uint16_t emitBytecode(Bytecode& bytecode) {
+		auto used = getUsedLayers();
+		std::vector<std::map<std::string, uint16_t>> outputs(layers.size());
+		for (size_t i = 0; i < layers.size(); ++i) {
+			if (!used[i]) {
+				continue;
+			}
+			auto& prototype = layers[i].shader->getPrototype();
+			bytecode.enterScope();
+			for (auto& connection : connections) {
+				if (connection.to != i) {
+					continue;
+				}
+				auto value = outputs[connection.from].at(connection.output.str());
+				auto type = prototype.getArgument(connection.parameter)->getType();
+				bytecode.declare(connection.parameter.str(), type == Type::Color ? 4 : 1);
+				bytecode.assign(connection.parameter.str(), value);
+			}
+			if (i + 1 < layers.size()) {
+				auto value = bytecode.getVariable("Ci");
+				bytecode.declare("Ci", 4);
+				bytecode.assign("Ci", value);
+			}
+			prototype.emitOutputs(bytecode);
+			if (auto body = layers[i].shader->getBody()) {
+				body->emitBytecode(bytecode);
+			}
+			for (auto output : prototype.getOutputs()) {
+				outputs[i][output->getName().str()] = bytecode.getVariable(output->getName().str());
+			}
+			outputs[i]["Ci"] = bytecode.getVariable("Ci");
+			bytecode.exitScope();
+		}
+		return 0;
+	}
+private:
+	// In the arena of the network
+	llvm::ArrayRef<ShaderLayer> layers;
+	llvm::ArrayRef<ShaderConnection> connections;
+};
+
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/Allocator.h"
+
+namespace shmoptix {
+
+// Bump allocator for the AST of one parse, owned by the shader and freed
+// with it in one go. Nodes are never destroyed one by one, so they only
+// hold arena pointers, arena arrays, symbols and plain values.
+class Arena {
+public:
+	template <typename T, typename... Arguments>
+	T* create(Arguments&&... arguments) {
+		return new (allocator.Allocate(sizeof(T), alignof(T))) T(std::forward<Arguments>(arguments)...);
+	}
+
+	template <typename T>
+	llvm::ArrayRef<T> copy(llvm::ArrayRef<T> values) {
+		auto data = allocator.Allocate<T>(values.size());
+		std::uninitialized_copy(values.begin(), values.end(), data);
+		return llvm::ArrayRef<T>(data, values.size());
+	}
+
+	// An object nodes refer to that needs its destructor, e.g. a shader
+	// of a network, destroyed with the arena.
+	template <typename T>
+	T* own(std::unique_ptr<T> object) {
+		auto result = object.get();
+		owned.push_back(std::shared_ptr<T>(std::move(object)));
+		return result;
+	}
+
+	size_t getBytes() const { return allocator.getTotalMemory(); }
+private:
+	llvm::BumpPtrAllocator allocator;
+	std::vector<std::shared_ptr<void>> owned;
+};
+
+}
@@ -0,0 +1,320 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "AST.h"
+#include "BuiltinLibrary.h"
+#include "Compiler.h"
+#include "ErrorHandler.h"
+#include "ExecutionEnvironment.h"
+#include "Grid.h"
+#include "ParameterLayout.h"
+#include "ThreadPool.h"
+#include "global.h"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace shmoptix {
+
+#if !defined(_WIN32)
+
+// Binary point files of the offline driver, in host byte order. Input:
+//
+//   PointFileHeader, parameterCount PointFileParameters, padding to 64
+//   bytes, then count records of floatsPerPoint floats:
+//   P.x P.y P.z N.x N.y N.z u v and the per point parameters at their
+//   offsets.
+//
+// Output: ShadedFileHeader, padding to 64 bytes, then count records of
+// Ci.r Ci.g Ci.b Oi.r Oi.g Oi.b.
+struct PointFileHeader {
+	char magic[8];
+	uint64_t count;
+	uint32_t floatsPerPoint;
+	uint32_t parameterCount;
+};
+
+struct PointFileParameter {
+	char name[32];
+	// 1 for a float, 3 for a color
+	uint32_t channels;
+	// In floats from the start of a record
+	uint32_t offset;
+};
+
+struct ShadedFileHeader {
+	char magic[8];
+	uint64_t count;
+};
+
+// A whole file mapped into memory, read only or created read write.
+class MappedFile : public ErrorHandler {
+public:
+	MappedFile(const std::string& fileName) {
+		auto fd = open(fileName.c_str(), O_RDONLY);
+		struct stat status;
+		if (fd < 0 || fstat(fd, &status) != 0) {
+			error("Couldn't open " + fileName);
+		}
+		size = status.st_size;
+		map(fd, PROT_READ, fileName);
+	}
+
+	MappedFile(const std::string& fileName, size_t size) : size(size) {
+		auto fd = open(fileName.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0666);
+		if (fd < 0 || ftruncate(fd, size) != 0) {
+			error("Couldn't create " + fileName);
+		}
+		map(fd, PROT_READ | PROT_WRITE, fileName);
+	}
+
+	~MappedFile() {
+		if (data) {
+			munmap(data, size);
+		}
+	}
+public:
+	char* getData() { return data; }
+	size_t getSize() { return size; }
+
+	// Read [begin, end) ahead.
+	void prefetch(size_t begin, size_t end) {
+		advise(begin, end, MADV_WILLNEED);
+	}
+
+	// Done with [begin, end): start writing it back and drop it from the
+	// mapping, so a file larger than memory streams through.
+	void release(size_t begin, size_t end) {
+		begin = begin / pageSize() * pageSize();
+		end = std::min(end, size);
+		if (begin < end) {
+			msync(data + begin, end - begin, MS_ASYNC);
+			madvise(data + begin, end - begin, MADV_DONTNEED);
+		}
+	}
+private:
+	static size_t pageSize() {
+		return sysconf(_SC_PAGESIZE);
+	}
+
+	void advise(size_t begin, size_t end, int advice) {
+		begin = begin / pageSize() * pageSize();
+		end = std::min(end, size);
+		if (begin < end) {
+			madvise(data + begin, end - begin, advice);
+		}
+	}
+
+	void map(int fd, int protection, const std::string& fileName) {
+		auto address = size ? mmap(nullptr, size, protection, MAP_SHARED, fd, 0) : nullptr;
+		close(fd);
+		if (address == MAP_FAILED) {
+			error("Couldn't map " + fileName);
+		}
+		data = static_cast<char*>(address);
+		advise(0, size, MADV_SEQUENTIAL);
+	}
+private:
+	size_t size = 0;
+	char* data = nullptr;
+};
+
+// Offline shading of point files, for baking and for comparing with the
+// renderer. The shader is compiled with the parameters the file has per
+// point made varying and shaded through its _grid_block entry point, see
+// SurfaceShaderAST::codegenBlock. Other parameters keep their defaults.
+//
+// Input and output are mapped and streamed a window at a time: the chunks
+// of a window, each small enough for the points of one thread to stay in
+// cache, are transposed into grids and shaded on all cores, then the
+// window is written back and dropped, so files far larger than memory are
+// read and written sequentially. P also bounds the chunk for culling
+// lights. The language has no u, v or Oi yet: u and v are read past, and
+// Oi is written opaque.
+class BatchShader : public ErrorHandler {
+public:
+	BatchShader(ExecutionEnvironment& executionEnvironment, BuiltinLibrary& builtins, unsigned lanes, unsigned optLevel)
+		: executionEnvironment(executionEnvironment), builtins(builtins), lanes(lanes), optLevel(optLevel) {}
+public:
+	void shade(const std::string& shaderFileName, const std::string& inputFileName, const std::string& outputFileName,
+		ThreadPool& pool, size_t chunk = 4096, size_t window = 1 << 20) {
+
+		MappedFile input(inputFileName);
+		auto& header = *reinterpret_cast<PointFileHeader*>(input.getData());
+		if (input.getSize() < sizeof(PointFileHeader) || memcmp(header.magic, pointMagic, sizeof(header.magic)) != 0) {
+			error(inputFileName + " is not a shmoptix point file");
+		}
+		auto parameters = reinterpret_cast<PointFileParameter*>(input.getData() + sizeof(PointFileHeader));
+		auto recordsOffset = align(sizeof(PointFileHeader) + header.parameterCount * sizeof(PointFileParameter));
+		auto recordBytes = header.floatsPerPoint * sizeof(float);
+		// Compared by division, so a corrupt count can't overflow past the
+		// check.
+		if (header.floatsPerPoint < 8 || input.getSize() < recordsOffset || header.count > (input.getSize() - recordsOffset) / recordBytes) {
+			error(inputFileName + " is truncated");
+		}
+
+		auto file = llvm::MemoryBuffer::getFile(shaderFileName);
+		if (!file) {
+			error("Couldn't open " + shaderFileName);
+		}
+		Compiler compiler(shaderFileName, builtins, optLevel);
+		auto shader = compiler.parse((*file)->getBuffer());
+
+		// Where each argument comes from: an offset in the record, or the
+		// default value
+		std::vector<const PointFileParameter*> varying;
+		for (size_t i = 0; i < shader->getArguments().size(); ++i) {
+			auto argument = shader->getArguments()[i];
+			auto parameter = std::find_if(parameters, parameters + header.parameterCount, [&](const PointFileParameter& p) {
+				return argument->getName().getString() == llvm::StringRef(p.name, strnlen(p.name, sizeof(p.name)));
+			});
+			if (parameter != parameters + header.parameterCount) {
+				if (parameter->channels != (argument->getType() == Type::Color ? 3u : 1u) || parameter->offset + parameter->channels > header.floatsPerPoint) {
+					error("Parameter " + argument->getName().str() + " of " + inputFileName + " doesn't match the shader");
+				}
+				argument->setVarying();
+				varying.push_back(&*parameter);
+			}
+			else {
+				varying.push_back(nullptr);
+			}
+		}
+		compiler.codegen(*shader, lanes);
+		compiler.link();
+		compiler.optimize();
+		executionEnvironment.addObject(compiler.emitObject());
+		auto function = executionEnvironment.getGridFunction(shader->getName());
+		auto layout = shader->getParameterLayout();
+		auto defaults = layout.allocate();
+
+		auto outputOffset = align(sizeof(ShadedFileHeader));
+		MappedFile output(outputFileName, outputOffset + header.count * 6 * sizeof(float));
+		auto& outputHeader = *reinterpret_cast<ShadedFileHeader*>(output.getData());
+		memcpy(outputHeader.magic, shadedMagic, sizeof(outputHeader.magic));
+		outputHeader.count = header.count;
+
+		auto records = reinterpret_cast<const float*>(input.getData() + recordsOffset);
+		auto results = reinterpret_cast<float*>(output.getData() + outputOffset);
+		chunk = (chunk + lanes - 1) / lanes * lanes;
+		window = std::max(window / chunk, size_t(1)) * chunk;
+
+		auto start = std::chrono::steady_clock::now();
+		for (size_t first = 0; first < header.count; first += window) {
+			auto last = std::min<size_t>(first + window, header.count);
+			input.prefetch(recordsOffset + last * recordBytes, recordsOffset + (last + window) * recordBytes);
+			pool.parallelFor(last - first, chunk, [&](size_t begin, size_t end) {
+				shadeChunk(function, layout, defaults, varying, records + (first + begin) * header.floatsPerPoint,
+					header.floatsPerPoint, results + (first + begin) * 6, end - begin);
+			});
+			input.release(recordsOffset + first * recordBytes, recordsOffset + last * recordBytes);
+			output.release(outputOffset + first * 6 * sizeof(float), outputOffset + last * 6 * sizeof(float));
+		}
+		std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+
+		auto bytes = double(header.count) * (recordBytes + 6 * sizeof(float));
+		llvm::outs() << "Shaded " << header.count << " points with " << shader->getName() << llvm::format(" in %.3f s, %.0f points/s, %.1f MB/s",
+			seconds.count(), header.count / seconds.count(), bytes / seconds.count() / (1 << 20)) << newline;
+	}
+
+	// A point file of count points with the normal turning around the
+	// sphere and per point Kd and Cs, for testing.
+	static void writeTestPoints(const std::string& fileName, size_t count) {
+		const PointFileParameter parameters[] = { { "Kd", 1, 8 }, { "Cs", 3, 9 } };
+		const uint32_t floatsPerPoint = 12;
+		auto recordsOffset = align(sizeof(PointFileHeader) + sizeof(parameters));
+		MappedFile file(fileName, recordsOffset + count * floatsPerPoint * sizeof(float));
+		auto& header = *reinterpret_cast<PointFileHeader*>(file.getData());
+		memcpy(header.magic, pointMagic, sizeof(header.magic));
+		header.count = count;
+		header.floatsPerPoint = floatsPerPoint;
+		header.parameterCount = 2;
+		memcpy(file.getData() + sizeof(PointFileHeader), parameters, sizeof(parameters));
+
+		auto record = reinterpret_cast<float*>(file.getData() + recordsOffset);
+		for (size_t i = 0; i < count; ++i, record += floatsPerPoint) {
+			float t = float(i) / std::max<size_t>(count, 1);
+			float angle = t * 6.2831853f;
+			float values[floatsPerPoint]{ t, 0.f, 0.f, cosf(angle), sinf(angle), 0.5f, t, 1.f - t, 0.5f + t, t, 0.5f, 1.f - t };
+			std::copy(values, values + floatsPerPoint, record);
+		}
+	}
+private:
+	static constexpr const char* pointMagic = "SHMPTS1";
+	static constexpr const char* shadedMagic = "SHMCI1\0";
+
+	static size_t align(size_t offset) {
+		return (offset + 63) / 64 * 64;
+	}
+
+	// Transpose count records into the planes of a grid, shade it with the
+	// lights that reach its points and write Ci and Oi back.
+	void shadeChunk(ExecutionEnvironment::GridBlockFunction function, const ParameterLayout& layout,
+		std::vector<ParameterLayout::Storage> block, const std::vector<const PointFileParameter*>& varying,
+		const float* records, size_t floatsPerPoint, float* results, size_t count) {
+
+		Grid grid(count, lanes);
+		auto stride = grid.getStride();
+		auto P = grid.add("P", 4);
+		auto N = grid.add("N", 4);
+		auto Ci = grid.add("Ci", 4);
+		for (size_t i = 0; i < varying.size(); ++i) {
+			if (!varying[i]) {
+				continue;
+			}
+			auto planes = grid.add(std::string(varying[i]->name, strnlen(varying[i]->name, sizeof(varying[i]->name))), varying[i]->channels == 3 ? 4 : 1);
+			for (size_t p = 0; p < count; ++p) {
+				for (unsigned c = 0; c < varying[i]->channels; ++c) {
+					planes[c * stride + p] = records[p * floatsPerPoint + varying[i]->offset + c];
+				}
+			}
+			layout.setPlanes(block.data(), layout.getParameters()[i].name, planes);
+		}
+		Bounds bounds;
+		for (size_t p = 0; p < count; ++p) {
+			auto record = records + p * floatsPerPoint;
+			bounds.extend(record[0], record[1], record[2]);
+			for (unsigned c = 0; c < 3; ++c) {
+				P[c * stride + p] = record[c];
+				N[c * stride + p] = record[3 + c];
+			}
+			P[3 * stride + p] = 1.f;
+		}
+		grid.setBounds(bounds);
+
+		std::vector<float> lights;
+		auto context = executionEnvironment.createShadingContext(grid, lights);
+		executionEnvironment.runGrid(function, grid, context, block.data(), 0, stride);
+
+		for (size_t p = 0; p < count; ++p) {
+			auto result = results + p * 6;
+			for (unsigned c = 0; c < 3; ++c) {
+				result[c] = Ci[c * stride + p];
+				result[3 + c] = 1.f;
+			}
+		}
+	}
+private:
+	ExecutionEnvironment& executionEnvironment;
+	BuiltinLibrary& builtins;
+	unsigned lanes;
+	unsigned optLevel;
+};
+
+#endif
+
+}
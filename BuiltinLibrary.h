@@ -0,0 +1,82 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Transforms/IPO/Internalize.h"
+
+#include "ErrorHandler.h"
+#include "global.h"
+
+#ifndef SHMOPTIX_BUILTINS
+#define SHMOPTIX_BUILTINS "builtins.bc"
+#endif
+
+namespace shmoptix {
+
+// The builtin library, builtins/Builtins.cc compiled to bitcode by the
+// build. It is linked into each shader module before optimization, so the
+// builtins inline into the shader and vectorize with it instead of being
+// opaque calls into the host.
+class BuiltinLibrary : public ErrorHandler {
+public:
+	BuiltinLibrary(const std::string& path = SHMOPTIX_BUILTINS) {
+		auto file = llvm::MemoryBuffer::getFile(path);
+		if (!file) {
+			error("Couldn't open builtin library " + path);
+		}
+		buffer = std::move(*file);
+	}
+public:
+	// Link the builtins the module calls. Linked definitions become
+	// internal so they disappear once they are inlined.
+	void link(llvm::Module& module) {
+
+		auto library = load(module.getContext());
+
+		auto internalize = [](llvm::Module& module, const llvm::StringSet<>& linked) {
+			llvm::internalizeModule(module, [&](const llvm::GlobalValue& value) {
+				return !value.hasName() || !linked.count(value.getName());
+			});
+		};
+		if (llvm::Linker::linkModules(module, std::move(library), llvm::Linker::Flags::LinkOnlyNeeded, internalize)) {
+			error("Couldn't link builtin library");
+		}
+	}
+
+	// The whole library as a module of its own, e.g. to compile it once
+	// for the interpreter.
+	std::unique_ptr<llvm::Module> load(llvm::LLVMContext& context) {
+		llvm::SMDiagnostic diagnostic;
+		auto library = llvm::parseIR(buffer->getMemBufferRef(), diagnostic, context);
+		if (!library) {
+			diagnostic.print("shmoptix", llvm::errs());
+			error("Couldn't parse builtin library");
+		}
+		return library;
+	}
+
+	// Part of the object cache key, so a rebuilt library invalidates
+	// cached shaders.
+	std::string getHash() {
+		llvm::MD5 hash;
+		hash.update(buffer->getBuffer());
+		llvm::MD5::MD5Result result;
+		hash.final(result);
+		llvm::SmallString<32> string;
+		llvm::MD5::stringifyResult(result, string);
+		return string.str().str();
+	}
+private:
+	std::unique_ptr<llvm::MemoryBuffer> buffer;
+};
+
+}
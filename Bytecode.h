@@ -0,0 +1,335 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "CodeGen.h"
+#include "ErrorHandler.h"
+#include "Grid.h"
+#include "Type.h"
+#include "global.h"
+
+namespace shmoptix {
+
+struct ShadingContext;
+
+// A shader body as a compact register bytecode, the first tier of tiered
+// execution: building it takes microseconds and needs no LLVM, so a shader
+// can shade as soon as it is parsed. It runs lanes points at a time.
+// Registers hold lanes floats per channel in the layout of the grid
+// builtins, channel c of lane i at [c * lanes + i], so the builtins are
+// called directly from the compiled builtin library.
+class Bytecode : public ErrorHandler {
+public:
+	// Address of a compiled builtin, e.g. diffuse_grid8.
+	typedef std::function<uint64_t(const std::string&)> Resolver;
+
+	Bytecode(unsigned lanes, Resolver resolve) : lanes(lanes), resolve(resolve) {}
+public:
+	// Globals, read from the grid by name. Inputs are variables, so the
+	// shader can assign them.
+	void addInput(const std::string& name, Type type, bool varying) {
+		auto channels = type == Type::Color ? 4u : 1u;
+		auto result = declare(name, channels);
+		inputs.push_back({ name, fromGrid, varying });
+		emit({ varying ? Op::Varying : Op::Uniform, channels, result, { uint16_t(inputs.size() - 1) } });
+	}
+
+	// Shader parameters, read from the parameter block passed to run at
+	// offset, like <name>_grid_block does, see ParameterLayout.
+	void addParameter(const std::string& name, Type type, bool varying, size_t offset) {
+		auto channels = type == Type::Color ? 4u : 1u;
+		auto result = declare(name, channels);
+		inputs.push_back({ name, offset, varying });
+		emit({ varying ? Op::Varying : Op::Uniform, channels, result, { uint16_t(inputs.size() - 1) } });
+	}
+
+	// Written back to the grid after each block of points.
+	void addOutput(const std::string& name) {
+		auto variable = getVariable(name);
+		inputs.push_back({ name, fromGrid, true });
+		emit({ Op::Store, getChannels(variable), variable, { uint16_t(inputs.size() - 1) } });
+	}
+
+	uint16_t declare(const std::string& name, unsigned channels) {
+		auto result = allocate(channels);
+		variables[name] = result;
+		return result;
+	}
+
+	// Variables declared in a scope, e.g. a layer of a shader network, are
+	// dropped at its exit, shadowed ones come back.
+	void enterScope() {
+		scopes.push_back(variables);
+	}
+
+	void exitScope() {
+		variables = std::move(scopes.back());
+		scopes.pop_back();
+	}
+
+	uint16_t getVariable(const std::string& name) {
+		auto it = variables.find(name);
+		if (it == variables.end()) {
+			// Possibly declared in code the interpreter skipped
+			if (!supported) {
+				return unsupported();
+			}
+			error("Unknown variable: " + name);
+		}
+		return it->second;
+	}
+
+	uint16_t constant(float value) {
+		auto result = allocate(1);
+		Instruction instruction{ Op::Constant, 1, result };
+		instruction.value = value;
+		emit(instruction);
+		return result;
+	}
+
+	// A float and a color are promoted to a color.
+	uint16_t arithmetic(llvm::Instruction::BinaryOps op, uint16_t a, uint16_t b) {
+		auto result = allocate(std::max(getChannels(a), getChannels(b)));
+		switch (op) {
+		case llvm::Instruction::FAdd: emit({ Op::Add, getChannels(result), result, { a, b } }); break;
+		case llvm::Instruction::FSub: emit({ Op::Subtract, getChannels(result), result, { a, b } }); break;
+		case llvm::Instruction::FMul: emit({ Op::Multiply, getChannels(result), result, { a, b } }); break;
+		case llvm::Instruction::FDiv: emit({ Op::Divide, getChannels(result), result, { a, b } }); break;
+		default: return unsupported();
+		}
+		return result;
+	}
+
+	void assign(const std::string& name, uint16_t value) {
+		auto variable = getVariable(name);
+		if (supported && getChannels(variable) < getChannels(value)) {
+			error("Can't assign a color to float " + name);
+		}
+		emit({ Op::Move, getChannels(variable), variable, { value } });
+	}
+
+	uint16_t call(const std::string& name, const std::vector<uint16_t>& arguments) {
+		auto builtin = std::find_if(builtins.begin(), builtins.end(), [&](const Builtin& b) { return b.name == name; });
+		if (builtin == builtins.end()) {
+			error("Unknown function: " + name);
+		}
+		if (arguments.size() != builtin->parameters.size()) {
+			error("Wrong number of arguments for " + name);
+		}
+		auto address = resolve(name + "_grid" + std::to_string(lanes));
+		if (!address) {
+			error("Builtin " + name + " is not compiled");
+		}
+		// Builtins that evaluate the lights take P first
+		auto operands = arguments;
+		if (builtin->lit) {
+			operands.insert(operands.begin(), getVariable("P"));
+		}
+		auto result = allocate(builtin->result == Type::Color ? 4 : 1);
+		Instruction instruction{ Op::Call, getChannels(result), result };
+		std::copy(operands.begin(), operands.end(), instruction.operands);
+		instruction.arguments = operands.size();
+		instruction.address = address;
+		emit(instruction);
+		return result;
+	}
+
+	// For code the interpreter can't run, e.g. control flow. The bytecode
+	// is then only good for isSupported, and the shader has to start out
+	// compiled. Returns a scratch register, so emitting can go on.
+	uint16_t unsupported() {
+		supported = false;
+		if (channels.empty()) {
+			offsets.push_back(0);
+			channels.push_back(4);
+		}
+		return 0;
+	}
+
+	bool isSupported() { return supported; }
+
+	// Shade points [begin, end) of the grid, begin a multiple of lanes,
+	// with the parameters of block, e.g. a GridBlock.
+	void run(ShadingContext* context, Grid& grid, const void* block, size_t begin, size_t end) {
+
+		// A varying global the grid only has as a uniform is broadcast.
+		std::vector<float*> buffers;
+		std::vector<bool> planes;
+		for (auto& input : inputs) {
+			if (input.offset != fromGrid) {
+				auto address = static_cast<const char*>(block) + input.offset;
+				float* buffer = nullptr;
+				if (input.varying) {
+					memcpy(&buffer, address, sizeof(buffer));
+				}
+				else {
+					buffer = reinterpret_cast<float*>(const_cast<char*>(address));
+				}
+				planes.push_back(input.varying);
+				buffers.push_back(buffer);
+				continue;
+			}
+			auto buffer = grid.get(input.name);
+			planes.push_back(buffer != nullptr);
+			buffers.push_back(buffer ? buffer : grid.getUniform(input.name));
+			if (!buffers.back()) {
+				error("Grid has no " + input.name);
+			}
+		}
+		for (auto& instruction : code) {
+			if (instruction.op == Op::Store && !planes[instruction.operands[0]]) {
+				error("Grid has no varying " + inputs[instruction.operands[0]].name);
+			}
+		}
+		auto stride = grid.getStride();
+		alignas(64) float registers[maxRegisters * 4 * 16];
+		auto reg = [&](uint16_t r) { return registers + offsets[r]; };
+
+		for (auto index = begin; index < end; index += lanes) {
+			for (auto& instruction : code) {
+				auto result = reg(instruction.result);
+				auto n = instruction.channels * lanes;
+				switch (instruction.op) {
+				case Op::Uniform:
+				case Op::Varying: {
+					auto input = instruction.operands[0];
+					if (instruction.op == Op::Uniform || !planes[input]) {
+						for (unsigned i = 0; i < n; ++i) {
+							result[i] = buffers[input][i / lanes];
+						}
+						break;
+					}
+					auto plane = buffers[input] + index;
+					for (unsigned c = 0; c < instruction.channels; ++c) {
+						std::copy(plane + c * stride, plane + c * stride + lanes, result + c * lanes);
+					}
+					break;
+				}
+				case Op::Store: {
+					auto plane = buffers[instruction.operands[0]] + index;
+					for (unsigned c = 0; c < instruction.channels; ++c) {
+						std::copy(result + c * lanes, result + (c + 1) * lanes, plane + c * stride);
+					}
+					break;
+				}
+				case Op::Constant:
+					std::fill(result, result + n, instruction.value);
+					break;
+				case Op::Add:
+					arithmetic(instruction, result, reg, [](float a, float b) { return a + b; });
+					break;
+				case Op::Subtract:
+					arithmetic(instruction, result, reg, [](float a, float b) { return a - b; });
+					break;
+				case Op::Multiply:
+					arithmetic(instruction, result, reg, [](float a, float b) { return a * b; });
+					break;
+				case Op::Divide:
+					arithmetic(instruction, result, reg, [](float a, float b) { return a / b; });
+					break;
+				case Op::Move: {
+					auto value = reg(instruction.operands[0]);
+					auto mask = getChannels(instruction.operands[0]) == 1 ? lanes - 1 : ~0u;
+					for (unsigned i = 0; i < n; ++i) {
+						result[i] = value[i & mask];
+					}
+					break;
+				}
+				case Op::Call:
+					call(instruction, context, result, reg);
+					break;
+				}
+			}
+		}
+	}
+
+	size_t getInstructionCount() { return code.size(); }
+private:
+	enum class Op : uint8_t { Uniform, Varying, Store, Constant, Add, Subtract, Multiply, Divide, Move, Call };
+
+	struct Instruction {
+		Op op;
+		unsigned channels;
+		uint16_t result;
+		uint16_t operands[4];
+		unsigned arguments = 0;
+		float value = 0;
+		uint64_t address = 0;
+	};
+
+	static const unsigned maxRegisters = 64;
+
+	template <typename Registers, typename Function>
+	void arithmetic(const Instruction& instruction, float* result, Registers reg, Function function) {
+		auto a = reg(instruction.operands[0]);
+		auto b = reg(instruction.operands[1]);
+		auto aMask = getChannels(instruction.operands[0]) == 1 ? lanes - 1 : ~0u;
+		auto bMask = getChannels(instruction.operands[1]) == 1 ? lanes - 1 : ~0u;
+		for (unsigned i = 0; i < instruction.channels * lanes; ++i) {
+			result[i] = function(a[i & aMask], b[i & bMask]);
+		}
+	}
+
+	template <typename Registers>
+	void call(const Instruction& instruction, ShadingContext* context, float* result, Registers reg) {
+		auto& a = instruction.operands;
+		switch (instruction.arguments) {
+		case 0:
+			reinterpret_cast<void(*)(ShadingContext*, float*)>(instruction.address)(context, result);
+			break;
+		case 1:
+			reinterpret_cast<void(*)(ShadingContext*, float*, float*)>(instruction.address)(context, result, reg(a[0]));
+			break;
+		case 2:
+			reinterpret_cast<void(*)(ShadingContext*, float*, float*, float*)>(instruction.address)(context, result, reg(a[0]), reg(a[1]));
+			break;
+		case 3:
+			reinterpret_cast<void(*)(ShadingContext*, float*, float*, float*, float*)>(instruction.address)(context, result, reg(a[0]), reg(a[1]), reg(a[2]));
+			break;
+		case 4:
+			reinterpret_cast<void(*)(ShadingContext*, float*, float*, float*, float*, float*)>(instruction.address)(context, result, reg(a[0]), reg(a[1]), reg(a[2]), reg(a[3]));
+			break;
+		}
+	}
+
+	uint16_t allocate(unsigned count) {
+		if (channels.size() == maxRegisters) {
+			return unsupported();
+		}
+		// Every register has room for a color, so they stay lane aligned
+		offsets.push_back(channels.size() * 4 * lanes);
+		channels.push_back(count);
+		return channels.size() - 1;
+	}
+
+	unsigned getChannels(uint16_t r) { return channels[r]; }
+
+	void emit(const Instruction& instruction) {
+		code.push_back(instruction);
+	}
+private:
+	unsigned lanes;
+	Resolver resolve;
+	std::vector<Instruction> code;
+	std::vector<unsigned> channels;
+	std::vector<size_t> offsets;
+	// Inputs read from the grid have no offset in the parameter block
+	static const size_t fromGrid = SIZE_MAX;
+	struct Input {
+		std::string name;
+		size_t offset;
+		bool varying;
+	};
+	std::vector<Input> inputs;
+	std::map<std::string, uint16_t> variables;
+	std::vector<std::map<std::string, uint16_t>> scopes;
+	bool supported = true;
+};
+
+}
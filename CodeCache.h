@@ -0,0 +1,101 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Epoch.h"
+#include "ExecutionEnvironment.h"
+#include "global.h"
+
+namespace shmoptix {
+
+// Compiled code kept within a memory budget. Each entry is code of its
+// own, see ExecutionEnvironment::addReplaceableObject, accounted with the
+// code and data bytes MCJIT allocated for it. Inserting past the budget
+// evicts the least recently used entries; their code is freed once no
+// reader is in a Guard that could still call it. Owners recompile or
+// reload evicted entries from disk when they are needed again.
+class CodeCache {
+public:
+	// Hold while calling code found with lookup.
+	typedef EpochReclaimer::Guard Guard;
+
+	CodeCache(uint64_t budget) : budget(budget) {}
+public:
+	// Address of symbol in the code of key, or zero if it isn't cached.
+	// Marks the entry as used.
+	uint64_t lookup(const std::string& key, const std::string& symbol) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = entries.find(key);
+		if (it == entries.end()) {
+			++misses;
+			return 0;
+		}
+		++hits;
+		lru.splice(lru.begin(), lru, it->second);
+		return it->second->code->engine->getFunctionAddress(symbol);
+	}
+
+	// Returns the keys evicted to make room. The new entry itself is kept
+	// even if it alone is over budget.
+	std::vector<std::string> insert(const std::string& key, std::unique_ptr<ReplaceableCode> code) {
+		std::lock_guard<std::mutex> lock(mutex);
+		codeBytes += code->codeBytes;
+		dataBytes += code->dataBytes;
+		lru.push_front(Entry{ key, std::move(code) });
+		entries[key] = lru.begin();
+
+		std::vector<std::string> evicted;
+		while (codeBytes + dataBytes > budget && lru.size() > 1) {
+			auto& entry = lru.back();
+			codeBytes -= entry.code->codeBytes;
+			dataBytes -= entry.code->dataBytes;
+			evicted.push_back(entry.key);
+			entries.erase(entry.key);
+			epochs.retire(std::move(entry.code));
+			lru.pop_back();
+			++evictions;
+		}
+		return evicted;
+	}
+
+	EpochReclaimer& getEpochs() { return epochs; }
+
+	uint64_t getBytes() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return codeBytes + dataBytes;
+	}
+
+	void printStatistics(llvm::raw_ostream& out) {
+		std::lock_guard<std::mutex> lock(mutex);
+		out << "Code cache: " << lru.size() << " shaders, " << codeBytes << " code bytes, " << dataBytes << " data bytes of "
+			<< budget << llvm::format(" (%.0f%%)", budget ? 100. * (codeBytes + dataBytes) / budget : 0.) << ", "
+			<< hits << " hits, " << misses << " misses, " << evictions << " evicted, "
+			<< epochs.getRetiredCount() << " waiting to be freed" << newline;
+	}
+private:
+	struct Entry {
+		std::string key;
+		std::unique_ptr<ReplaceableCode> code;
+	};
+private:
+	uint64_t budget;
+	std::mutex mutex;
+	std::list<Entry> lru;
+	std::unordered_map<std::string, std::list<Entry>::iterator> entries;
+	EpochReclaimer epochs;
+	uint64_t codeBytes = 0;
+	uint64_t dataBytes = 0;
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+	uint64_t evictions = 0;
+};
+
+}
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <array>
+#include <memory>
 
+#include "llvm/ADT/StringMap.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/GlobalVariable.h"
@@ -12,14 +14,47 @@
 #include "llvm/IR/Value.h"
 #include "llvm/IR/Verifier.h"
 
+#include "DebugInfo.h"
+#include "ErrorHandler.h"
+#include "Symbol.h"
+#include "Target.h"
 #include "global.h"
+#include "Type.h"
 
 namespace shmoptix {
 
-class LLVMCodeGen {
+// Number of points a grid function shades per loop iteration, picked from
+// the widest vector unit of the target, the host's by default.
+unsigned defaultGridLanes() {
+	return getDefaultTarget().getLanes();
+}
+
+// Builtin functions provided by the bitcode library in builtins/. Every
+// builtin also takes the ShadingContext as hidden first argument, and those
+// that loop over the lights the shading position P after it; colors and
+// vectors are passed by pointer, floats by value.
+struct Builtin {
+	std::string name;
+	Type result;
+	std::vector<Type> parameters;
+	bool lit = false;
+};
+
+const std::vector<Builtin> builtins{
+	{ "ambient", Type::Color, {} },
+	{ "diffuse", Type::Color, { Type::Color }, true },
+	{ "dot", Type::Float, { Type::Color, Type::Color } },
+	{ "faceforward", Type::Color, { Type::Color, Type::Color } },
+	{ "length", Type::Float, { Type::Color } },
+	{ "normalize", Type::Color, { Type::Color } },
+	{ "specular", Type::Color, { Type::Color, Type::Color, Type::Float }, true },
+};
+
+class LLVMCodeGen : public ErrorHandler {
 public:
 
-	LLVMCodeGen(llvm::LLVMContext& context, llvm::Module& module) {
+	LLVMCodeGen(llvm::LLVMContext& context, llvm::Module& module) : context(context), module(&module), irBuilder(context) {
+		setLanes(1);
 		installGlobalVariables();
 	}
 
@@ -27,46 +62,417 @@ public:
 
 public:
 
+	llvm::LLVMContext& getContext() {
+		return context;
+	}
+
+	llvm::Module& getModule() {
+		return *module;
+	}
+
+	llvm::IRBuilder<>& getBuilder() {
+		return irBuilder;
+	}
+
 	void installGlobalVariables() {
-		alignas(16) llvm::Value* Ci = new llvm::GlobalVariable(*module, colorType, false, llvm::GlobalValue::ExternalLinkage, nullptr, "Ci");
-		namedValues["Ci"] = Ci;
-		namedValues["N"] = new llvm::GlobalVariable(*module, vector4Type, false, llvm::GlobalValue::ExternalLinkage, nullptr, "N");
+		for (auto& builtin : builtins) {
+			std::vector<llvm::Type*> argumentTypes{ pointerToShadingContextType };
+			if (builtin.lit) {
+				argumentTypes.push_back(pointerToColorType);
+			}
+			for (auto type : builtin.parameters) {
+				argumentTypes.push_back(type == Type::Color ? pointerToColorType : floatType);
+			}
+			auto resultType = builtin.result == Type::Color ? colorType : floatType;
+			auto functionType = llvm::FunctionType::get(resultType, argumentTypes, false);
+			namedValues.insert(Symbol(builtin.name), llvm::Function::Create(functionType, llvm::GlobalValue::ExternalLinkage, builtin.name, module));
+		}
+	}
+
+	// Emit DWARF line info for the current module, until
+	// finalizeDebugInfo().
+	void enableDebugInfo(const std::string& fileName) {
+		debugInfo = std::make_unique<DebugInfo>(*module, fileName);
+	}
+
+	void finalizeDebugInfo() {
+		if (debugInfo) {
+			debugInfo->finalize();
+			debugInfo.reset();
+		}
+	}
+
+	void beginFunction(llvm::IRBuilder<>& builder, llvm::Function* function, Location location) {
+		if (debugInfo) {
+			debugInfo->beginFunction(builder, function, location);
+		}
+	}
+
+	void endFunction(llvm::IRBuilder<>& builder) {
+		if (debugInfo) {
+			debugInfo->endFunction(builder);
+		}
+	}
+
+	void setLocation(llvm::IRBuilder<>& builder, Location location) {
+		if (debugInfo) {
+			debugInfo->setLocation(builder, location);
+		}
+	}
 
-		std::vector<llvm::Type*> diffuseArgumentTypes;
-		diffuseArgumentTypes.push_back(pointerToVector4Type);
-		//auto diffuseType = llvm::FunctionType::get(floatType, diffuseArgumentTypes, false);
-		auto diffuseType = llvm::FunctionType::get(colorType, diffuseArgumentTypes, false);
-		auto diffuse = llvm::Function::Create(diffuseType, llvm::GlobalValue::ExternalLinkage, "diffuse", module.get());
-		namedValues["diffuse"] = diffuse;
+	void installGridBuiltins(llvm::IRBuilder<>& builder) {
+		for (auto& builtin : builtins) {
+			namedValues.insert(Symbol(builtin.name), createGridBuiltin(builder, builtin));
+		}
 	}
 
-	void insertNameValue(const std::string& name, llvm::Value* value) {
-		namedValues[name] = value;
+	// Shader globals live in the ShadingContext passed as first argument
+	// to every entry point and builtin, see ExecutionEnvironment.h.
+	void installShadingContext(llvm::IRBuilder<>& builder, llvm::Value* context) {
+		shadingContext = context;
+		if (lanes == 1) {
+			namedValues.insert(names::Ci, builder.CreateStructGEP(shadingContextType, context, 0, "Ci"));
+			namedValues.insert(names::N, builder.CreateStructGEP(shadingContextType, context, 1, "N"));
+			namedValues.insert(names::P, builder.CreateStructGEP(shadingContextType, context, 2, "P"));
+		}
 	}
 
-	auto lookupNamedValue(const std::string& name) {
-		return namedValues[name];
+	llvm::Value* getShadingContext() {
+		return shadingContext;
 	}
 
+	// Symbols defined in a scope are dropped at its exit, shadowed ones
+	// come back. Builtins are defined outside any scope.
+	void enterScope() {
+		namedValues.enterScope();
+	}
+
+	void exitScope() {
+		namedValues.exitScope();
+	}
+
+	void insertNameValue(Symbol name, llvm::Value* value) {
+		namedValues.insert(name, value);
+	}
+
+	llvm::Value* lookupNamedValue(Symbol name) {
+		return namedValues.lookup(name);
+	}
+
+	const SymbolTable<llvm::Value*>& getNamedValues() {
+		return namedValues;
+	}
+
+	// Switch the type cache between single point (lanes == 1) and grid
+	// code. In grid code a float holds one value per lane and a color is
+	// laid out channel by channel: rrrr...gggg...bbbb...aaaa...
+	void setLanes(unsigned n) {
+		lanes = n;
+		auto scalar = llvm::TypeBuilder<llvm::types::ieee_float, true>::get(context);
+		floatType = lanes == 1 ? scalar : llvm::VectorType::get(scalar, lanes);
+		pointerToFloatType = llvm::PointerType::getUnqual(floatType);
+		colorType = llvm::VectorType::get(scalar, 4 * lanes);
+		pointerToColorType = llvm::PointerType::getUnqual(colorType);
+		vector4Type = colorType;
+		pointerToVector4Type = pointerToColorType;
+		normalType = colorType;
+		int4Type = llvm::VectorType::get(intType, 4);
+		auto bit = llvm::Type::getInt1Ty(context);
+		maskType = lanes == 1 ? static_cast<llvm::Type*>(bit) : llvm::VectorType::get(bit, lanes);
+	}
+
+	unsigned getLanes() {
+		return lanes;
+	}
+
+	llvm::Constant* getMask(const std::vector<uint32_t>& indices) {
+		return llvm::ConstantDataVector::get(context, indices);
+	}
+
+	// Broadcast a float to all channels of a color.
+	llvm::Value* promoteToColor(llvm::IRBuilder<>& builder, llvm::Value* value) {
+		if (lanes == 1) {
+			auto undef = llvm::UndefValue::get(colorType);
+			uint64_t idx = 0;
+			auto insert = builder.CreateInsertElement(undef, value, idx);
+			auto zeroVec = llvm::Constant::getNullValue(int4Type);
+			return builder.CreateShuffleVector(insert, undef, zeroVec);
+		}
+		std::vector<uint32_t> indices;
+		for (unsigned i = 0; i < 4 * lanes; ++i) {
+			indices.push_back(i % lanes);
+		}
+		return builder.CreateShuffleVector(value, llvm::UndefValue::get(floatType), getMask(indices));
+	}
+
+	llvm::Value* getChannel(llvm::IRBuilder<>& builder, llvm::Value* color, unsigned channel) {
+		std::vector<uint32_t> indices;
+		for (unsigned i = 0; i < lanes; ++i) {
+			indices.push_back(channel * lanes + i);
+		}
+		return builder.CreateShuffleVector(color, llvm::UndefValue::get(colorType), getMask(indices));
+	}
+
+	llvm::Value* concat(llvm::IRBuilder<>& builder, llvm::Value* a, llvm::Value* b) {
+		auto n = llvm::cast<llvm::VectorType>(a->getType())->getNumElements();
+		std::vector<uint32_t> indices;
+		for (unsigned i = 0; i < 2 * n; ++i) {
+			indices.push_back(i);
+		}
+		return builder.CreateShuffleVector(a, b, getMask(indices));
+	}
+
+	// Grid buffers are structure of arrays: channel c of point i lives at
+	// base[c * stride + i]. Buffers are 64 byte aligned and stride and i are
+	// multiples of lanes, so every lane load is aligned.
+	unsigned getGridAlignment() {
+		return std::min(64u, 4 * lanes);
+	}
+
+	llvm::Value* getPlane(llvm::IRBuilder<>& builder, llvm::Value* base, llvm::Value* stride, llvm::Value* index, unsigned channel) {
+		auto offset = builder.CreateAdd(builder.CreateMul(stride, builder.getInt32(channel)), index);
+		auto element = builder.CreateInBoundsGEP(base, offset);
+		return builder.CreateBitCast(element, pointerToFloatType);
+	}
+
+	llvm::Value* loadVarying(llvm::IRBuilder<>& builder, llvm::Value* base, llvm::Value* stride, llvm::Value* index, unsigned channels) {
+		std::vector<llvm::Value*> planes;
+		for (unsigned c = 0; c < channels; ++c) {
+			planes.push_back(builder.CreateAlignedLoad(getPlane(builder, base, stride, index, c), getGridAlignment()));
+		}
+		if (channels == 1) {
+			return planes[0];
+		}
+		return concat(builder, concat(builder, planes[0], planes[1]), concat(builder, planes[2], planes[3]));
+	}
+
+	void storeVarying(llvm::IRBuilder<>& builder, llvm::Value* value, llvm::Value* base, llvm::Value* stride, llvm::Value* index, unsigned channels) {
+		for (unsigned c = 0; c < channels; ++c) {
+			auto plane = channels == 1 ? value : getChannel(builder, value, c);
+			builder.CreateAlignedStore(plane, getPlane(builder, base, stride, index, c), getGridAlignment());
+		}
+	}
+
+	// Grid code evaluates uniform expressions once, in the uniform block
+	// before the point loop, with single point types and uniforms as the
+	// symbol table.
+	void setUniformScope(llvm::BasicBlock* block, SymbolTable<llvm::Value*> values) {
+		uniformBlock = block;
+		uniformValues = std::move(values);
+	}
+
+	template <typename Generate>
+	llvm::Value* hoist(llvm::IRBuilder<>& builder, Generate generate) {
+		auto block = builder.GetInsertBlock();
+		auto location = builder.getCurrentDebugLocation();
+		auto gridLanes = lanes;
+		builder.SetInsertPoint(uniformBlock->getTerminator());
+		builder.SetCurrentDebugLocation(location);
+		std::swap(namedValues, uniformValues);
+		setLanes(1);
+		auto value = generate();
+		setLanes(gridLanes);
+		std::swap(namedValues, uniformValues);
+		value = widen(builder, value);
+		builder.SetInsertPoint(block);
+		builder.SetCurrentDebugLocation(location);
+		return value;
+	}
+
+	// Broadcast a single point value to all lanes.
+	llvm::Value* widen(llvm::IRBuilder<>& builder, llvm::Value* value) {
+		if (value->getType() == scalarFloatType) {
+			return builder.CreateVectorSplat(lanes, value);
+		}
+		if (value->getType() == float4Type) {
+			std::vector<uint32_t> indices;
+			for (unsigned i = 0; i < 4 * lanes; ++i) {
+				indices.push_back(i / lanes);
+			}
+			return builder.CreateShuffleVector(value, llvm::UndefValue::get(float4Type), getMask(indices));
+		}
+		error("Can't widen a value of this type to the grid lanes");
+		return nullptr;
+	}
+
+	// Local variables live in the entry block, so grid code allocates them
+	// once instead of on every loop iteration.
+	llvm::AllocaInst* createLocal(llvm::Type* type, const std::string& name) {
+		auto& entry = irBuilder.GetInsertBlock()->getParent()->getEntryBlock();
+		llvm::IRBuilder<> builder(&entry, entry.begin());
+		auto local = builder.CreateAlloca(type, nullptr, name);
+		local->setAlignment(getVariableAlignment());
+		return local;
+	}
+
+	// Of locals, globals and color parameters.
+	unsigned getVariableAlignment() {
+		return std::max(16u, getGridAlignment());
+	}
+
+	// Variables are pointers, expressions use their value.
+	llvm::Value* load(llvm::IRBuilder<>& builder, llvm::Value* value) {
+		if (value->getType() == pointerToFloatType || value->getType() == pointerToColorType) {
+			return builder.CreateAlignedLoad(value, getVariableAlignment());
+		}
+		return value;
+	}
+
+	// Assign value to the variable at pointer, a float assigned to a color
+	// is promoted. Under an execution mask only the active lanes change.
+	// False if the types don't match.
+	bool store(llvm::IRBuilder<>& builder, llvm::Value* value, llvm::Value* pointer) {
+		value = load(builder, value);
+		if (pointer->getType() == pointerToColorType && value->getType() == floatType) {
+			value = promoteToColor(builder, value);
+		}
+		if (pointer->getType() != llvm::PointerType::getUnqual(value->getType())) {
+			return false;
+		}
+		if (executionMask) {
+			auto mask = value->getType() == colorType ? widenMask(builder, executionMask) : executionMask;
+			value = builder.CreateSelect(mask, value, builder.CreateAlignedLoad(pointer, getVariableAlignment()));
+		}
+		builder.CreateAlignedStore(value, pointer, getVariableAlignment());
+		return true;
+	}
+
+	// Grid code under varying control flow runs with an execution mask,
+	// one bit per lane, and stores only to the active lanes, see store.
+	// Null when all lanes are active and in single point code.
+	llvm::Value* getExecutionMask() {
+		return executionMask;
+	}
+
+	void setExecutionMask(llvm::Value* mask) {
+		executionMask = mask;
+	}
+
+	// The active lanes for which condition holds.
+	llvm::Value* maskCondition(llvm::IRBuilder<>& builder, llvm::Value* condition) {
+		return executionMask ? builder.CreateAnd(executionMask, condition) : condition;
+	}
+
+	// Whether any lane of mask is active, to skip code no lane runs.
+	llvm::Value* any(llvm::IRBuilder<>& builder, llvm::Value* mask) {
+		auto bits = builder.CreateBitCast(mask, builder.getIntNTy(lanes));
+		return builder.CreateICmpNE(bits, builder.getIntN(lanes, 0), "any");
+	}
+
+	// The mask of a float for the channels of a color.
+	llvm::Value* widenMask(llvm::IRBuilder<>& builder, llvm::Value* mask) {
+		std::vector<uint32_t> indices;
+		for (unsigned i = 0; i < 4 * lanes; ++i) {
+			indices.push_back(i % lanes);
+		}
+		return builder.CreateShuffleVector(mask, llvm::UndefValue::get(maskType), getMask(indices));
+	}
+
+	// A shader parameter baked into a specialized variant. Colors become
+	// internal constant globals, so the loads of the parameter fold.
+	llvm::Value* createConstant(Type type, const std::vector<float>& values) {
+		if (type == Type::Float) {
+			return llvm::ConstantFP::get(floatType, values.at(0));
+		}
+		std::vector<float> elements;
+		for (unsigned c = 0; c < 4; ++c) {
+			for (unsigned i = 0; i < lanes; ++i) {
+				elements.push_back(values.at(c % values.size()));
+			}
+		}
+		auto initializer = llvm::ConstantDataVector::get(context, elements);
+		auto constant = new llvm::GlobalVariable(*module, colorType, true, llvm::GlobalValue::InternalLinkage, initializer, "constant");
+		constant->setAlignment(std::max(16u, getGridAlignment()));
+		return constant;
+	}
+
+	// Wrap <name>_grid<lanes> from the builtin library, which works on
+	// plain float arrays, so it can be called with grid values. After
+	// inlining the temporaries are promoted back to vector registers.
+	llvm::Function* createGridBuiltin(llvm::IRBuilder<>& builder, const Builtin& builtin) {
+
+		auto name = builtin.name + "_grid" + std::to_string(lanes);
+		if (auto existing = module->getFunction(name + ".wrapper")) {
+			return existing;
+		}
+
+		std::vector<llvm::Type*> libraryTypes(builtin.parameters.size() + (builtin.lit ? 3 : 2), pointerToScalarFloatType);
+		libraryTypes[0] = pointerToShadingContextType;
+		auto libraryType = llvm::FunctionType::get(voidType, libraryTypes, false);
+		auto library = llvm::cast<llvm::Function>(module->getOrInsertFunction(name, libraryType, llvm::AttributeSet()));
+
+		std::vector<llvm::Type*> argumentTypes{ pointerToShadingContextType };
+		if (builtin.lit) {
+			argumentTypes.push_back(pointerToColorType);
+		}
+		for (auto type : builtin.parameters) {
+			argumentTypes.push_back(type == Type::Color ? pointerToColorType : floatType);
+		}
+		auto resultType = builtin.result == Type::Color ? colorType : floatType;
+		auto type = llvm::FunctionType::get(resultType, argumentTypes, false);
+		auto function = llvm::Function::Create(type, llvm::GlobalValue::InternalLinkage, name + ".wrapper", module);
+		function->addFnAttr(llvm::Attribute::AlwaysInline);
+
+		auto savedBlock = builder.GetInsertBlock();
+		auto savedLocation = builder.getCurrentDebugLocation();
+		builder.SetCurrentDebugLocation(llvm::DebugLoc());
+		builder.SetInsertPoint(llvm::BasicBlock::Create(context, "entry", function));
+
+		auto result = builder.CreateAlloca(resultType);
+		result->setAlignment(getGridAlignment());
+		std::vector<llvm::Value*> arguments{ &*function->arg_begin(), builder.CreateBitCast(result, pointerToScalarFloatType) };
+		for (auto it = std::next(function->arg_begin()); it != function->arg_end(); ++it) {
+			llvm::Value* argument = &*it;
+			if (!argument->getType()->isPointerTy()) {
+				auto temporary = builder.CreateAlloca(floatType);
+				temporary->setAlignment(getGridAlignment());
+				builder.CreateStore(argument, temporary);
+				argument = temporary;
+			}
+			arguments.push_back(builder.CreateBitCast(argument, pointerToScalarFloatType));
+		}
+		builder.CreateCall(library, arguments);
+		builder.CreateRet(builder.CreateAlignedLoad(result, getGridAlignment()));
+
+		builder.SetInsertPoint(savedBlock);
+		builder.SetCurrentDebugLocation(savedLocation);
+		return function;
+	}
+
+private:
+	llvm::LLVMContext& context;
+	llvm::Module* module;
+	llvm::IRBuilder<> irBuilder;
+
 public:
 	// Type cache
-	llvm::Type* floatType = llvm::TypeBuilder<llvm::types::ieee_float, true>::get(Context);
-	llvm::Type* pointerToFloatType = llvm::PointerType::getUnqual(floatType);
-	llvm::Type* colorType = llvm::VectorType::get(floatType, 4);
-	llvm::Type* pointerToColorType = llvm::PointerType::getUnqual(colorType);
-	llvm::Type* vector4Type = llvm::VectorType::get(floatType, 4);
-	llvm::Type* pointerToVector4Type = llvm::PointerType::getUnqual(vector4Type);
-	llvm::Type* normalType = llvm::VectorType::get(floatType, 4);
-	llvm::Type* intType = llvm::TypeBuilder<llvm::types::i<32>, true>::get(Context);
-	llvm::Type* int4Type = llvm::VectorType::get(intType, 4);
-	llvm::Type* voidType = llvm::Type::getVoidTy(Context);
+	llvm::Type* floatType;
+	llvm::Type* pointerToFloatType;
+	llvm::Type* colorType;
+	llvm::Type* pointerToColorType;
+	llvm::Type* vector4Type;
+	llvm::Type* pointerToVector4Type;
+	llvm::Type* normalType;
+	llvm::Type* intType = llvm::TypeBuilder<llvm::types::i<32>, true>::get(context);
+	llvm::Type* int4Type;
+	llvm::Type* maskType;
+	llvm::Type* voidType = llvm::Type::getVoidTy(context);
+	llvm::Type* scalarFloatType = llvm::TypeBuilder<llvm::types::ieee_float, true>::get(context);
+	llvm::Type* pointerToScalarFloatType = llvm::PointerType::getUnqual(scalarFloatType);
+	llvm::Type* float4Type = llvm::VectorType::get(scalarFloatType, 4);
+	llvm::StructType* shadingContextType = llvm::StructType::create(context,
+		{ float4Type, float4Type, float4Type, pointerToScalarFloatType, intType }, "ShadingContext");
+	llvm::Type* pointerToShadingContextType = llvm::PointerType::getUnqual(shadingContextType);
 
 private:
 	// Symbol table
-	std::map<std::string, llvm::Value*> namedValues;
+	SymbolTable<llvm::Value*> namedValues;
+	unsigned lanes = 1;
+	llvm::Value* shadingContext = nullptr;
+	std::unique_ptr<DebugInfo> debugInfo;
+	llvm::BasicBlock* uniformBlock = nullptr;
+	SymbolTable<llvm::Value*> uniformValues;
+	llvm::Value* executionMask = nullptr;
 };
 
-static LLVMCodeGen CodeGen(Context, *module);
-
 }
-
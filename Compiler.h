@@ -0,0 +1,176 @@
+#pragma once
+
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "AST.h"
+#include "BuiltinLibrary.h"
+#include "CodeGen.h"
+#include "ErrorHandler.h"
+#include "Lexer.h"
+#include "Optimizer.h"
+#include "Parser.h"
+#include "Statistics.h"
+#include "Target.h"
+#include "global.h"
+
+namespace shmoptix {
+
+// A module together with the context that owns its types and constants.
+struct ShaderModule {
+	std::unique_ptr<llvm::LLVMContext> context;
+	std::unique_ptr<llvm::Module> module;
+};
+
+// Compiles shaders into one module of its own LLVMContext, with its own
+// IRBuilder and symbol table. Compilers share nothing but the read only
+// builtin library, so any number of them can run on different threads.
+// The result is an object file, which an ExecutionEnvironment loads with
+// addObject, or for the lazy backend the linked module, see takeModule.
+class Compiler : public ErrorHandler {
+public:
+	// With pic the object is for a shared library, see Optimizer. Code is
+	// for target, unless codegen is given targets of its own.
+	Compiler(const std::string& name, BuiltinLibrary& builtins, unsigned optLevel = 2, bool pic = false,
+		const CodeTarget& target = getDefaultTarget())
+		: context(std::make_unique<llvm::LLVMContext>()), module(std::make_unique<llvm::Module>(name, *context)),
+		  codeGen(*context, *module), builtins(builtins), optimizer(optLevel, pic, target), statistics(name) {}
+	~Compiler() {}
+public:
+	std::unique_ptr<SurfaceShaderAST> parse(llvm::StringRef source) {
+
+		Lexer lexer;
+		Parser parser(lexer);
+		auto nodes = AST::getNodeCount();
+		statistics.begin("parse");
+		auto shader = parser.parse(source);
+		statistics.end();
+		statistics.split("parse", "lex", lexer.getSeconds());
+		if (!shader) {
+			error("No shader in " + module->getModuleIdentifier());
+		}
+		statistics.setShader(shader->getName());
+		statistics.setCounter("tokens", lexer.getTokenCount());
+		statistics.setCounter("AST nodes", AST::getNodeCount() - nodes);
+		statistics.setCounter("AST bytes", shader->getArenaBytes());
+		return shader;
+	}
+
+	// Emit DWARF line info for fileName with the next codegen.
+	void enableDebugInfo(const std::string& fileName) {
+		codeGen.enableDebugInfo(fileName);
+	}
+
+	// The scalar, grid and parameter block entry points of shader, see
+	// SurfaceShaderAST::codegen for values and entryName.
+	void codegen(SurfaceShaderAST& shader, unsigned lanes, const ParameterValues& values = {}, const std::string& entryName = "") {
+
+		statistics.begin("codegen");
+		shader.codegen(codeGen, values, entryName);
+		shader.codegenGrid(codeGen, lanes, values, entryName);
+		shader.codegenBlock(codeGen, entryName);
+		codeGen.finalizeDebugInfo();
+		statistics.end();
+		statistics.setCounter("IR instructions", getInstructionCount(*module));
+	}
+
+	// A variant of the entry points for each of targets, named with
+	// CodeTarget::getEntryName and with grid code as wide as the target's
+	// vector unit. Construct the compiler with the first, the baseline
+	// the rest of the module is compiled for.
+	void codegen(SurfaceShaderAST& shader, const std::vector<CodeTarget>& targets) {
+
+		statistics.begin("codegen");
+		for (auto& target : targets) {
+			std::set<llvm::Function*> existing;
+			for (auto& function : *module) {
+				existing.insert(&function);
+			}
+			auto entryName = target.getEntryName(shader.getName());
+			shader.codegen(codeGen, {}, entryName);
+			shader.codegenGrid(codeGen, target.getLanes(), {}, entryName);
+			shader.codegenBlock(codeGen, entryName);
+			for (auto& function : *module) {
+				if (!function.isDeclaration() && !existing.count(&function)) {
+					target.apply(function);
+				}
+			}
+		}
+		codeGen.finalizeDebugInfo();
+		statistics.end();
+		statistics.setCounter("IR instructions", getInstructionCount(*module));
+	}
+
+	void link() {
+
+		statistics.begin("link builtins");
+		builtins.link(*module);
+
+		statistics.begin("verify");
+		if (llvm::verifyModule(*module, &llvm::errs())) {
+			error("Error verifying " + module->getModuleIdentifier());
+		}
+		statistics.end();
+	}
+
+	void optimize() {
+
+		statistics.begin("optimize");
+		optimizer.run(*module);
+		statistics.end();
+		statistics.setCounter("optimized IR instructions", getInstructionCount(*module));
+	}
+
+	std::unique_ptr<llvm::MemoryBuffer> emitObject() {
+
+		statistics.begin("emit object");
+		auto object = optimizer.emitObject(*module);
+		statistics.end();
+		statistics.setCounter("object bytes", object->getBufferSize());
+		return object;
+	}
+
+	// Source to object in one go.
+	std::unique_ptr<llvm::MemoryBuffer> compile(llvm::StringRef source, unsigned lanes, std::string& shaderName) {
+		ParameterLayout layout;
+		return compile(source, lanes, shaderName, layout);
+	}
+
+	// The same, with the layout of the parameter blocks of the shader.
+	std::unique_ptr<llvm::MemoryBuffer> compile(llvm::StringRef source, unsigned lanes, std::string& shaderName, ParameterLayout& layout) {
+
+		auto shader = parse(source);
+		shaderName = shader->getName();
+		layout = shader->getParameterLayout();
+		codegen(*shader, lanes);
+		link();
+		optimize();
+		return emitObject();
+	}
+
+	// The module and its context, for a backend that optimizes and
+	// compiles it later. The compiler can't be used afterwards.
+	ShaderModule takeModule() {
+		return ShaderModule{ std::move(context), std::move(module) };
+	}
+
+	llvm::Module& getModule() { return *module; }
+	Statistics& getStatistics() { return statistics; }
+private:
+	std::unique_ptr<llvm::LLVMContext> context;
+	std::unique_ptr<llvm::Module> module;
+	LLVMCodeGen codeGen;
+	BuiltinLibrary& builtins;
+	Optimizer optimizer;
+	Statistics statistics;
+};
+
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <string>
+
+#include "llvm/IR/DIBuilder.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/DebugLoc.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Dwarf.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+
+#include "global.h"
+
+namespace shmoptix {
+
+// DWARF line tables for one shader module, mapping the generated code back
+// to lines and columns of the .sl source so debuggers and profilers can
+// show shader source.
+class DebugInfo {
+public:
+	DebugInfo(llvm::Module& module, const std::string& fileName) : builder(module) {
+
+		llvm::SmallString<128> path(fileName);
+		llvm::sys::fs::make_absolute(path);
+		auto directory = llvm::sys::path::parent_path(path);
+		auto name = llvm::sys::path::filename(path);
+
+		file = builder.createFile(name, directory);
+		unit = builder.createCompileUnit(llvm::dwarf::DW_LANG_C, name, directory, compilerVersion, true, "", 0);
+		module.addModuleFlag(llvm::Module::Warning, "Debug Info Version", llvm::DEBUG_METADATA_VERSION);
+		module.addModuleFlag(llvm::Module::Warning, "Dwarf Version", 4);
+	}
+public:
+	void beginFunction(llvm::IRBuilder<>& irBuilder, llvm::Function* function, Location location) {
+		auto type = builder.createSubroutineType(builder.getOrCreateTypeArray({}));
+		scope = builder.createFunction(file, function->getName(), function->getName(), file, location.line, type,
+			function->hasInternalLinkage(), true, location.line);
+		function->setSubprogram(scope);
+		setLocation(irBuilder, location);
+	}
+
+	void endFunction(llvm::IRBuilder<>& irBuilder) {
+		scope = nullptr;
+		irBuilder.SetCurrentDebugLocation(llvm::DebugLoc());
+	}
+
+	void setLocation(llvm::IRBuilder<>& irBuilder, Location location) {
+		if (scope && location.line) {
+			irBuilder.SetCurrentDebugLocation(llvm::DebugLoc::get(location.line, location.column, scope));
+		}
+	}
+
+	void finalize() {
+		builder.finalize();
+	}
+private:
+	llvm::DIBuilder builder;
+	llvm::DIFile* file;
+	llvm::DICompileUnit* unit;
+	llvm::DISubprogram* scope = nullptr;
+};
+
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace shmoptix {
+
+// Epoch based reclamation for objects read without a lock. A reader pins
+// the current epoch while it uses an object, see Guard. A writer first
+// unpublishes an object, so new readers can't reach it, then retires it;
+// it is destroyed once every reader pinned at or before its retirement is
+// gone. Readers never wait on writers and only ever touch one atomic slot.
+class EpochReclaimer {
+public:
+	class Guard {
+	public:
+		Guard(EpochReclaimer& reclaimer) : reclaimer(reclaimer), slot(reclaimer.enter()) {}
+		~Guard() { reclaimer.leave(slot); }
+		Guard(const Guard&) = delete;
+		Guard& operator=(const Guard&) = delete;
+	private:
+		EpochReclaimer& reclaimer;
+		size_t slot;
+	};
+
+	EpochReclaimer() {
+		for (auto& slot : slots) {
+			slot.store(idle);
+		}
+	}
+public:
+	template <typename T>
+	void retire(std::unique_ptr<T> object) {
+		std::lock_guard<std::mutex> lock(mutex);
+		retired.emplace_back(epoch.fetch_add(1), std::shared_ptr<void>(std::move(object)));
+		reclaim(lock);
+	}
+
+	// Destroy what no reader can still use, also done by every retire.
+	void reclaim() {
+		std::lock_guard<std::mutex> lock(mutex);
+		reclaim(lock);
+	}
+
+	size_t getRetiredCount() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return retired.size();
+	}
+private:
+	static const uint64_t idle = std::numeric_limits<uint64_t>::max();
+
+	// A pinned epoch may be older than the current one, which only keeps
+	// objects around longer.
+	size_t enter() {
+		auto current = epoch.load();
+		for (;;) {
+			for (size_t i = 0; i < slots.size(); ++i) {
+				auto expected = idle;
+				if (slots[i].compare_exchange_strong(expected, current)) {
+					return i;
+				}
+			}
+			std::this_thread::yield();
+		}
+	}
+
+	void leave(size_t slot) {
+		slots[slot].store(idle);
+	}
+
+	void reclaim(std::lock_guard<std::mutex>&) {
+		auto oldest = idle;
+		for (auto& slot : slots) {
+			oldest = std::min(oldest, slot.load());
+		}
+		retired.erase(std::remove_if(retired.begin(), retired.end(), [oldest](const std::pair<uint64_t, std::shared_ptr<void>>& object) {
+			return object.first < oldest;
+		}), retired.end());
+	}
+private:
+	std::atomic<uint64_t> epoch{ 0 };
+	std::array<std::atomic<uint64_t>, 128> slots;
+	std::mutex mutex;
+	std::vector<std::pair<uint64_t, std::shared_ptr<void>>> retired;
+};
+
+}
@@ -1,18 +1,40 @@
 #pragma once 
 
 #include <cstdlib>
+#include <stdexcept>
 #include <string>
 #include "global.h"
 
 namespace shmoptix {
 
+	// Thrown instead of ending the process inside RecoverableErrors.
+	struct CompileError : std::runtime_error {
+		CompileError(const std::string& message) : std::runtime_error(message) {}
+	};
+
 	class ErrorHandler {
+	public:
+		// While one is alive, errors on its thread throw CompileError
+		// instead of ending the process, e.g. so a failed reload keeps
+		// the running version of a shader, see HotReloadShaders.
+		class RecoverableErrors {
+		public:
+			RecoverableErrors() { ++getDepth(); }
+			~RecoverableErrors() { --getDepth(); }
+		};
 	protected:
 		void error(std::string message) {
+			if (getDepth() > 0) {
+				throw CompileError(message);
+			}
 			llvm::outs() << message << newline;
 			exit(EXIT_FAILURE);
 		}
+	private:
+		static unsigned& getDepth() {
+			static thread_local unsigned depth = 0;
+			return depth;
+		}
 	};
 
 }
-
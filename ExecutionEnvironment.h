@@ -1,17 +1,30 @@
 #pragma once
 
+#include <atomic>
 #include <functional>
+#include <mutex>
+#include <set>
+#include <vector>
 
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/MCJIT.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/MemoryBuffer.h"
 
 #include "CodeGen.h"
 #include "Color.h"
+#include "Grid.h"
+#include "LazyJIT.h"
+#include "LightList.h"
+#include "Optimizer.h"
+#include "PerfListener.h"
+#include "ThreadPool.h"
 #include "global.h"
 
 namespace shmoptix {
 
-	Vector4 L{ 1.f, 0.f, 0.f }; // dummy light vector
-
 	float dot(Vector4 a, Vector4 b) {
 		return a.value[0] * b.value[0] + a.value[1] * b.value[1] + a.value[2] * b.value[2];
 	}
@@ -23,57 +36,407 @@ namespace shmoptix {
 		return vector / length(vector);
 	}
 
-	Color Cl{ 1.f }; // light color
+	// Per invocation state of a shader, passed as first argument to the
+	// generated entry points and builtins. Nothing a shader touches is
+	// process global, so one compiled shader can run on many threads.
+	// Layout must match CodeGen.shadingContextType and builtins/Builtins.cc.
+	struct ShadingContext {
+		Color Ci;
+		Vector4 N;
+		Vector4 P;
+		// Packed by LightList::pack
+		const float* lights = nullptr;
+		int32_t lightCount = 0;
+	};
+
+	// Adds up the size of the code sections of the objects MCJIT loads,
+	// less those of the objects it frees.
+	class CodeSizeListener : public llvm::JITEventListener {
+	public:
+		void NotifyObjectEmitted(const llvm::object::ObjectFile& object, const llvm::RuntimeDyld::LoadedObjectInfo& info) override {
+			bytes += getTextSize(object);
+		}
+
+		void NotifyFreeingObject(const llvm::object::ObjectFile& object) override {
+			bytes -= getTextSize(object);
+		}
 
-	Color diffuse(Vector4* N) {
+		static uint64_t getTextSize(const llvm::object::ObjectFile& object) {
+			uint64_t size = 0;
+			for (auto& section : object.sections()) {
+				if (section.isText()) {
+					size += section.getSize();
+				}
+			}
+			return size;
+		}
 
-		Color C{1.f};
+		uint64_t getBytes() { return bytes; }
+	private:
+		std::atomic<uint64_t> bytes{ 0 };
+	};
 
-		// Just one light instead of illuminance loop
-		C += Cl * dot(normalize(L), *N);
+	// Counts the bytes MCJIT allocates for the code and data sections of
+	// the objects it loads.
+	class CountingMemoryManager : public llvm::SectionMemoryManager {
+	public:
+		CountingMemoryManager(uint64_t& codeBytes, uint64_t& dataBytes) : codeBytes(codeBytes), dataBytes(dataBytes) {}
 
-		//return 3.f * v->value[0];
-		return C;
-	}
+		uint8_t* allocateCodeSection(uintptr_t size, unsigned alignment, unsigned sectionID, llvm::StringRef sectionName) override {
+			codeBytes += size;
+			return SectionMemoryManager::allocateCodeSection(size, alignment, sectionID, sectionName);
+		}
+
+		uint8_t* allocateDataSection(uintptr_t size, unsigned alignment, unsigned sectionID, llvm::StringRef sectionName, bool readOnly) override {
+			dataBytes += size;
+			return SectionMemoryManager::allocateDataSection(size, alignment, sectionID, sectionName, readOnly);
+		}
+	private:
+		uint64_t& codeBytes;
+		uint64_t& dataBytes;
+	};
+
+	// See ExecutionEnvironment::addReplaceableObject.
+	struct ReplaceableCode {
+		std::unique_ptr<llvm::LLVMContext> context;
+		std::unique_ptr<llvm::ExecutionEngine> engine;
+		uint64_t codeBytes = 0;
+		uint64_t dataBytes = 0;
+
+		uint64_t getBytes() { return codeBytes + dataBytes; }
+	};
 
 	class ExecutionEnvironment {
 	public:
-		ExecutionEnvironment(std::unique_ptr<llvm::Module> module) {
+		// The parameter block entry points emitted by SurfaceShaderAST, see
+		// ParameterLayout.
+		typedef void(*BlockFunction)(ShadingContext*, const void*, int32_t, int32_t);
+		typedef void(*GridBlockFunction)(ShadingContext*, const void*, float*, float*, float*, int32_t, int32_t, int32_t);
 
-			std::string errorString;
-			engine = llvm::EngineBuilder(std::move(module)).setErrorStr(&errorString).create();
-			if (!engine) {
-				llvm::outs() << "Failed to create engine: " << errorString << newline;
+		// Shaders come in as objects from Compiler or the object cache, see
+		// addObject. With lazy, shaders can also be added as modules that
+		// compile on their first call, see LazyJIT.h. With profile, they are
+		// announced to perf, see PerfListener.h.
+		ExecutionEnvironment(unsigned optLevel = 2, bool profile = false, bool lazy = false) : optLevel(optLevel) {
+
+			if (lazy) {
+				lazyJIT = std::make_unique<LazyJIT>(optLevel);
+			}
+			else {
+				engine = createEngine(context);
+			}
+
+			addLight(Vector4{ 1.f, 0.f, 0.f }, Color{ 1.f });
+			addListener(&codeSize);
+#if defined(__linux__)
+			if (profile) {
+				perfListener = std::make_unique<PerfListener>();
+				addListener(perfListener.get());
+			}
+#endif
+		}
+
+	public:
+		bool isLazy() {
+			return lazyJIT != nullptr;
+		}
+
+		uint64_t getFunctionAddress(const std::string& name) {
+			uint64_t address;
+			if (lazyJIT) {
+				std::lock_guard<std::mutex> lock(lazyMutex);
+				address = lazyJIT->getFunctionAddress(name);
+			}
+			else {
+				address = engine->getFunctionAddress(name);
+			}
+			if (!address) {
+				llvm::outs() << "Unknown function: " << name << newline;
 				exit(EXIT_FAILURE);
 			}
+			return address;
+		}
+
+		// The block of default parameter values of shader name, see
+		// SurfaceShaderAST::codegenBlock.
+		const void* getDefaults(const std::string& name) {
+			uint64_t address;
+			if (lazyJIT) {
+				std::lock_guard<std::mutex> lock(lazyMutex);
+				address = lazyJIT->getFunctionAddress(name + "_defaults");
+			}
+			else {
+				address = engine->getGlobalValueAddress(name + "_defaults");
+			}
+			if (!address) {
+				llvm::outs() << "Unknown parameter defaults: " << name << newline;
+				exit(EXIT_FAILURE);
+			}
+			return reinterpret_cast<const void*>(address);
+		}
 
-			engine->addGlobalMapping(leading_underscore + "Ci", (uint64_t)Ci.get());
-			//engine->addGlobalMapping(leading_underscore + "N", (uint64_t)N.get());
-			engine->addGlobalMapping(leading_underscore + "N", (uint64_t)&N);
-			engine->addGlobalMapping(leading_underscore + "diffuse", (uint64_t)diffuse);
+		// Make the entry points of shader name those of its variant for
+		// target, see Compiler::codegen with targets. Needs MCJIT.
+		void dispatch(const std::string& name, const CodeTarget& target) {
+			if (lazyJIT) {
+				llvm::outs() << "Dispatching needs the MCJIT backend" << newline;
+				exit(EXIT_FAILURE);
+			}
+			auto prefix = engine->getDataLayout().getGlobalPrefix();
+			for (auto suffix : { "", "_grid", "_block", "_grid_block", "_defaults" }) {
+				auto address = engine->getGlobalValueAddress(target.getEntryName(name) + suffix);
+				if (!address) {
+					llvm::outs() << "Unknown function: " << target.getEntryName(name) << suffix << newline;
+					exit(EXIT_FAILURE);
+				}
+				auto mangledName = (prefix ? std::string(1, prefix) : std::string()) + name + suffix;
+				engine->addGlobalMapping(mangledName, address);
+			}
+		}
+
+		// Compile everything added so far, instead of on the first lookup.
+		void finalize() {
+			if (engine) {
+				engine->finalizeObject();
+			}
+		}
+
+		// Bytes of machine code emitted or loaded from the cache.
+		uint64_t getCodeBytes() {
+			return codeSize.getBytes();
+		}
+
+		// Compiled shader code. Its symbols resolve against the builtin
+		// library linked into it and the host process. Safe to call while
+		// other threads look up functions.
+		void addObject(std::unique_ptr<llvm::MemoryBuffer> buffer) {
+			if (lazyJIT) {
+				std::lock_guard<std::mutex> lock(lazyMutex);
+				lazyJIT->addObject(std::move(buffer));
+				return;
+			}
+			auto object = llvm::object::ObjectFile::createObjectFile(buffer->getMemBufferRef());
+			if (!object) {
+				llvm::outs() << "Invalid shader object " << buffer->getBufferIdentifier() << newline;
+				exit(EXIT_FAILURE);
+			}
+			engine->addObjectFile(llvm::object::OwningBinary<llvm::object::ObjectFile>(std::move(*object), std::move(buffer)));
+		}
+
+		// Compiled shader code in an MCJIT of its own instead of the shared
+		// one, so it is freed with the returned ReplaceableCode, and several
+		// versions of a shader can be loaded at once, see HotReload.h.
+		std::unique_ptr<ReplaceableCode> addReplaceableObject(std::unique_ptr<llvm::MemoryBuffer> buffer) {
+			auto object = llvm::object::ObjectFile::createObjectFile(buffer->getMemBufferRef());
+			if (!object) {
+				llvm::outs() << "Invalid shader object " << buffer->getBufferIdentifier() << newline;
+				exit(EXIT_FAILURE);
+			}
+			auto code = std::make_unique<ReplaceableCode>();
+			code->context = std::make_unique<llvm::LLVMContext>();
+			code->engine = createEngine(*code->context, std::make_unique<CountingMemoryManager>(code->codeBytes, code->dataBytes));
+			code->engine->RegisterJITEventListener(&codeSize);
+#if defined(__linux__)
+			if (perfListener) {
+				code->engine->RegisterJITEventListener(perfListener.get());
+			}
+#endif
+			code->engine->addObjectFile(llvm::object::OwningBinary<llvm::object::ObjectFile>(std::move(*object), std::move(buffer)));
+			code->engine->finalizeObject();
+			return code;
+		}
+
+		// A linked but unoptimized shader module, see Compiler::takeModule.
+		// Needs the lazy backend.
+		void addModule(ShaderModule module) {
+			if (!lazyJIT) {
+				llvm::outs() << "Adding a module needs the lazy backend" << newline;
+				exit(EXIT_FAILURE);
+			}
+			std::lock_guard<std::mutex> lock(lazyMutex);
+			lazyJIT->addModule(std::move(module));
+		}
+
+		// A distant light shining from direction, towards the light.
+		void addLight(Vector4 direction, Color color) {
+			lights.addDistant(direction, color);
+			if (!hierarchy) {
+				packedLights.clear();
+				lights.pack(packedLights);
+			}
+		}
+
+		// Replaces the lights of addLight with those of scene, culled per
+		// grid, see LightHierarchy. Points shaded without a grid see all of
+		// them. Not while shading.
+		void setLights(const LightList& scene, float threshold = 1.f / 1024) {
+			hierarchy = std::make_unique<LightHierarchy>(scene, threshold);
+			packedLights.clear();
+			hierarchy->pack(packedLights);
+		}
+
+		size_t getLightCount() {
+			return hierarchy ? hierarchy->size() : lights.size();
+		}
+
+		ShadingContext createShadingContext() {
+			ShadingContext context;
+			context.lights = packedLights.data();
+			context.lightCount = getLightCount();
+			return context;
+		}
+
+		// For shading grid: with setLights and the bounds of the grid, the
+		// lights that reach it, kept in storage.
+		ShadingContext createShadingContext(Grid& grid, std::vector<float>& storage) {
+			auto bounds = grid.getBounds();
+			if (!hierarchy || !bounds) {
+				return createShadingContext();
+			}
+			storage.clear();
+			ShadingContext context;
+			context.lightCount = hierarchy->gather(*bounds, storage);
+			context.lights = storage.data();
+			return context;
+		}
+
+		// Run the scalar entry point of shader name with its default
+		// parameters.
+		void runFunction(const std::string& name, ShadingContext& context) {
+			runFunction(name, context, getDefaults(name));
+		}
+
+		// Run it with the parameters of block, laid out by the
+		// ParameterLayout of the shader. Varying parameters are read at
+		// point index of their planes, whose channels are stride apart.
+		void runFunction(const std::string& name, ShadingContext& context, const void* block, size_t index = 0, size_t stride = 0) {
+			runFunction(reinterpret_cast<BlockFunction>(getFunctionAddress(name + "_block")), context, block, index, stride);
+		}
+
+		void runFunction(BlockFunction function, ShadingContext& context, const void* block, size_t index = 0, size_t stride = 0) {
+			if (!callFirst(reinterpret_cast<const void*>(function), [&] { function(&context, block, index, stride); })) {
+				function(&context, block, index, stride);
+			}
+		}
+
+		// Shade points [begin, end) of the grid with one call to the grid
+		// entry point of shader name, with the parameters of block, e.g. a
+		// GridBlock.
+		void runGrid(const std::string& name, Grid& grid, const void* block, size_t begin, size_t end) {
+			std::vector<float> gridLights;
+			auto context = createShadingContext(grid, gridLights);
+			auto function = getGridFunction(name);
+			if (!callFirst(reinterpret_cast<const void*>(function), [&] { runGrid(function, grid, context, block, begin, end); })) {
+				runGrid(function, grid, context, block, begin, end);
+			}
+		}
+
+		// Shade the whole grid on all cores. Every thread works on its own
+		// range of points, sharing the read only shading context.
+		void shade(const std::string& name, Grid& grid, const void* block, size_t chunk = 4096) {
+			shade(name, grid, block, threadPool(), chunk);
+		}
+
+		void shade(const std::string& name, Grid& grid, const void* block, ThreadPool& pool, size_t chunk = 4096) {
+
+			auto function = getGridFunction(name);
+			auto context = createShadingContext();
+			// Compile it here with an empty range rather than on one of the
+			// threads.
+			callFirst(reinterpret_cast<const void*>(function), [&] { runGrid(function, grid, context, block, 0, 0); });
+			shade(function, grid, block, pool, chunk);
 		}
 
 	public:
-		void dump() {
-			llvm::outs() << "Ci: " << Ci << newline;
+		// A grid function that is compiled already, e.g. one of
+		// addReplaceableObject.
+		void shade(GridBlockFunction function, Grid& grid, const void* block, ThreadPool& pool, size_t chunk = 4096) {
+			std::vector<float> gridLights;
+			auto context = createShadingContext(grid, gridLights);
+			chunk = (chunk + grid.getLanes() - 1) / grid.getLanes() * grid.getLanes();
+			pool.parallelFor(grid.getCount(), chunk, [&](size_t begin, size_t end) {
+				runGrid(function, grid, context, block, begin, end);
+			});
 		}
 
-		void runFunction(const std::string& name) {
+		void shade(GridBlockFunction function, Grid& grid, const void* block, size_t chunk = 4096) {
+			shade(function, grid, block, threadPool(), chunk);
+		}
 
-			uint64_t address = engine->getFunctionAddress(name);
+		// The grid entry point <name>_grid_block of shader name.
+		GridBlockFunction getGridFunction(const std::string& name) {
+			return reinterpret_cast<GridBlockFunction>(getFunctionAddress(name + "_grid_block"));
+		}
 
-			void(*function)(float, float[4]);
+		void runGrid(GridBlockFunction function, Grid& grid, ShadingContext& context, const void* block, size_t begin, size_t end) {
+			function(&context, block, grid.get("P"), grid.get("N"), grid.get("Ci"), begin, end, grid.getStride());
+		}
 
-			function = reinterpret_cast<decltype(function)>(address);
-			float Kd = 3.f;
-			alignas(16) float Cs[4]{ 23.f, 26.f, 29.f, 32.f };
+	private:
+		// The first call through a lazy stub compiles the function, which
+		// must not happen on several threads at once, so it is made with
+		// call under the lock. Later calls need no lock. Whether call was
+		// made.
+		bool callFirst(const void* function, const std::function<void()>& call) {
+			if (!lazyJIT) {
+				return false;
+			}
+			std::lock_guard<std::mutex> lock(lazyMutex);
+			if (!called.insert(function).second) {
+				return false;
+			}
+			call();
+			return true;
+		}
+
+		void addListener(llvm::JITEventListener* listener) {
+			if (lazyJIT) {
+				lazyJIT->addListener(listener);
+			}
+			else {
+				engine->RegisterJITEventListener(listener);
+			}
+		}
+
+		// MCJIT on an empty module, shader code is added as objects.
+		std::unique_ptr<llvm::ExecutionEngine> createEngine(llvm::LLVMContext& context, std::unique_ptr<llvm::RTDyldMemoryManager> memoryManager = nullptr) {
+			std::string errorString;
+			llvm::EngineBuilder builder(std::make_unique<llvm::Module>("shmoptix", context));
+			builder.setErrorStr(&errorString)
+				.setMCPU(getDefaultTarget().cpu)
+				.setMAttrs(getDefaultTarget().features)
+				.setOptLevel(getCodeGenOptLevel(optLevel));
+			if (memoryManager) {
+				builder.setMCJITMemoryManager(std::move(memoryManager));
+			}
+			std::unique_ptr<llvm::ExecutionEngine> result(builder.create());
+			if (!result) {
+				llvm::outs() << "Failed to create engine: " << errorString << newline;
+				exit(EXIT_FAILURE);
+			}
+			return result;
+		}
 
-			function(Kd, Cs);
+		ThreadPool& threadPool() {
+			std::call_once(threadPoolOnce, [this] { pool = std::make_unique<ThreadPool>(); });
+			return *pool;
 		}
 
 	private:
-		llvm::ExecutionEngine* engine;
-		Color Ci{ 13.f, 66.f, 33.f };
-		Vector4 N{ 7.f, 77.f, 777.f };
+		unsigned optLevel;
+		CodeSizeListener codeSize;
+#if defined(__linux__)
+		std::unique_ptr<PerfListener> perfListener;
+#endif
+		llvm::LLVMContext context;
+		std::unique_ptr<llvm::ExecutionEngine> engine;
+		std::unique_ptr<LazyJIT> lazyJIT;
+		std::mutex lazyMutex;
+		std::set<const void*> called;
+		LightList lights;
+		std::vector<float> packedLights;
+		std::unique_ptr<LightHierarchy> hierarchy;
+		std::once_flag threadPoolOnce;
+		std::unique_ptr<ThreadPool> pool;
 	};
 }
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Color.h"
+#include "global.h"
+
+namespace shmoptix {
+
+// Axis aligned box around shading points or the reach of lights.
+struct Bounds {
+	float min[3]{ INFINITY, INFINITY, INFINITY };
+	float max[3]{ -INFINITY, -INFINITY, -INFINITY };
+
+	void extend(float x, float y, float z) {
+		const float point[3]{ x, y, z };
+		for (int a = 0; a < 3; ++a) {
+			min[a] = std::min(min[a], point[a]);
+			max[a] = std::max(max[a], point[a]);
+		}
+	}
+
+	void extend(const Bounds& bounds) {
+		for (int a = 0; a < 3; ++a) {
+			min[a] = std::min(min[a], bounds.min[a]);
+			max[a] = std::max(max[a], bounds.max[a]);
+		}
+	}
+
+	bool overlaps(const Bounds& bounds) const {
+		for (int a = 0; a < 3; ++a) {
+			if (min[a] > bounds.max[a] || bounds.min[a] > max[a]) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	float getCenter(int axis) const {
+		return 0.5f * (min[axis] + max[axis]);
+	}
+
+	int getLongestAxis() const {
+		float extent[3]{ max[0] - min[0], max[1] - min[1], max[2] - min[2] };
+		return extent[0] >= extent[1] && extent[0] >= extent[2] ? 0 : extent[1] >= extent[2] ? 1 : 2;
+	}
+};
+
+// Structure of arrays storage for a grid of shading points. Every varying
+// has one plane per channel; channel c of point i is at data[c * stride + i].
+// The stride is rounded up to the lane count so grid functions never need
+// a remainder loop, and planes are 64 byte aligned for full width loads.
+class Grid {
+public:
+	Grid(size_t count, unsigned lanes) : count(count), stride((count + lanes - 1) / lanes * lanes), lanes(lanes) {}
+public:
+	float* add(const std::string& name, unsigned channels) {
+		auto& buffer = buffers[name];
+		buffer.storage.reset(new float[channels * stride + alignment / sizeof(float)]());
+		auto address = reinterpret_cast<uintptr_t>(buffer.storage.get());
+		buffer.data = reinterpret_cast<float*>((address + alignment - 1) & ~uintptr_t(alignment - 1));
+		buffer.channels = channels;
+		return buffer.data;
+	}
+
+	float* get(const std::string& name) {
+		auto it = buffers.find(name);
+		return it == buffers.end() ? nullptr : it->second.data;
+	}
+
+	void set(const std::string& name, size_t i, float value) {
+		get(name)[i] = value;
+	}
+
+	void set(const std::string& name, size_t i, Color color) {
+		auto data = get(name);
+		for (int c = 0; c < 4; ++c) {
+			data[c * stride + i] = color[c];
+		}
+	}
+
+	// Uniform values are shared by all points; colors are passed to grid
+	// functions by pointer, so they are kept 16 byte aligned.
+	void setUniform(const std::string& name, const std::vector<float>& values) {
+		auto& uniform = uniforms[name];
+		std::copy(values.begin(), values.begin() + std::min<size_t>(values.size(), 4), uniform.values);
+	}
+
+	float* getUniform(const std::string& name) {
+		auto it = uniforms.find(name);
+		return it == uniforms.end() ? nullptr : it->second.values;
+	}
+
+	Color getColor(const std::string& name, size_t i) {
+		auto data = get(name);
+		return Color{ data[i], data[stride + i], data[2 * stride + i], data[3 * stride + i] };
+	}
+
+	// Where the points are, if known, for culling lights per grid, see
+	// LightHierarchy.
+	void setBounds(const Bounds& bounds) {
+		this->bounds = bounds;
+		hasBounds = true;
+	}
+
+	const Bounds* getBounds() {
+		return hasBounds ? &bounds : nullptr;
+	}
+
+	size_t getCount() { return count; }
+	size_t getStride() { return stride; }
+	unsigned getLanes() { return lanes; }
+private:
+	struct Buffer {
+		std::unique_ptr<float[]> storage;
+		float* data = nullptr;
+		unsigned channels = 0;
+	};
+	struct Uniform {
+		alignas(16) float values[4]{};
+	};
+	static const size_t alignment = 64;
+
+	size_t count;
+	size_t stride;
+	unsigned lanes;
+	std::map<std::string, Buffer> buffers;
+	std::map<std::string, Uniform> uniforms;
+	Bounds bounds;
+	bool hasBounds = false;
+};
+
+}
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/TimeValue.h"
+
+#include "BuiltinLibrary.h"
+#include "Compiler.h"
+#include "Epoch.h"
+#include "ErrorHandler.h"
+#include "ExecutionEnvironment.h"
+#include "Grid.h"
+#include "ParameterLayout.h"
+#include "ThreadPool.h"
+#include "global.h"
+
+namespace shmoptix {
+
+// Shaders that follow their source files while an interactive render
+// runs. A watcher thread polls the files; a changed one is recompiled on
+// that thread into code of its own, see
+// ExecutionEnvironment::addReplaceableObject, and published with an atomic
+// swap. A grid is shaded with the version that was current when it started,
+// so every grid sees exactly one version and rendering never waits for a
+// compile. Replaced versions are freed by epoch based reclamation once no
+// grid is using them.
+//
+// Shaders are known by the name they had when added and have to be added
+// before shading starts. A file that fails to compile when added ends the
+// process, as every compile error does; one that fails on a reload is
+// reported and keeps its current version until it changes again.
+class HotReloadShaders : public ErrorHandler {
+public:
+	HotReloadShaders(ExecutionEnvironment& executionEnvironment, BuiltinLibrary& builtins, unsigned lanes, unsigned optLevel)
+		: executionEnvironment(executionEnvironment), builtins(builtins), lanes(lanes), optLevel(optLevel) {}
+
+	~HotReloadShaders() {
+		stop();
+		for (auto& shader : shaders) {
+			delete shader.second->current.load();
+		}
+	}
+public:
+	// Compile fileName, returns the name to shade it with.
+	std::string add(const std::string& fileName) {
+		auto shader = std::make_unique<Shader>();
+		shader->fileName = fileName;
+		shader->modified = getModificationTime(fileName);
+		std::string name;
+		shader->current = compile(fileName, 0, name).release();
+		shaders[name] = std::move(shader);
+		return name;
+	}
+
+	void shade(const std::string& name, Grid& grid, ThreadPool& pool, size_t chunk = 4096) {
+
+		auto& shader = getShader(name);
+		EpochReclaimer::Guard guard(epochs);
+		auto version = shader.current.load();
+		std::vector<float> lights;
+		auto context = executionEnvironment.createShadingContext(grid, lights);
+		GridBlock block(version->layout, grid);
+		chunk = (chunk + lanes - 1) / lanes * lanes;
+		pool.parallelFor(grid.getCount(), chunk, [&](size_t begin, size_t end) {
+			executionEnvironment.runGrid(version->function, grid, context, block.get(), begin, end);
+		});
+	}
+
+	// Recompile the shaders whose files changed since they were last
+	// compiled, returns how many.
+	unsigned poll() {
+		unsigned reloaded = 0;
+		for (auto& entry : shaders) {
+			auto& shader = *entry.second;
+			std::unique_ptr<Version> version;
+			std::string name;
+			try {
+				RecoverableErrors recoverable;
+				auto modified = getModificationTime(shader.fileName);
+				if (modified == shader.modified) {
+					continue;
+				}
+				shader.modified = modified;
+				version = compile(shader.fileName, shader.current.load()->generation + 1, name);
+			}
+			catch (const CompileError& error) {
+				llvm::outs() << shader.fileName << ": " << error.what() << ", still shading version " << shader.current.load()->generation << newline;
+				continue;
+			}
+			if (name != entry.first) {
+				llvm::outs() << shader.fileName << " now defines " << name << ", still shading it as " << entry.first << newline;
+			}
+			std::unique_ptr<Version> old(shader.current.exchange(version.release()));
+			epochs.retire(std::move(old));
+			++reloaded;
+		}
+		epochs.reclaim();
+		return reloaded;
+	}
+
+	// Poll on a background thread every interval until stop.
+	void watch(std::chrono::milliseconds interval) {
+		stop();
+		stopping = false;
+		watcher = std::thread([this, interval] {
+			std::unique_lock<std::mutex> lock(mutex);
+			while (!wakeup.wait_for(lock, interval, [this] { return stopping; })) {
+				lock.unlock();
+				poll();
+				lock.lock();
+			}
+		});
+	}
+
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wakeup.notify_all();
+		if (watcher.joinable()) {
+			watcher.join();
+		}
+	}
+
+	// How often the shader was reloaded.
+	unsigned getGeneration(const std::string& name) {
+		EpochReclaimer::Guard guard(epochs);
+		return getShader(name).current.load()->generation;
+	}
+
+	// Replaced versions some grid may still be shading with.
+	size_t getRetiredCount() {
+		return epochs.getRetiredCount();
+	}
+private:
+	struct Version {
+		std::unique_ptr<ReplaceableCode> code;
+		ExecutionEnvironment::GridBlockFunction function;
+		ParameterLayout layout;
+		unsigned generation;
+	};
+
+	struct Shader {
+		std::string fileName;
+		llvm::sys::TimeValue modified;
+		std::atomic<Version*> current{ nullptr };
+	};
+
+	Shader& getShader(const std::string& name) {
+		auto it = shaders.find(name);
+		if (it == shaders.end()) {
+			error("Unknown shader: " + name);
+		}
+		return *it->second;
+	}
+
+	std::unique_ptr<Version> compile(const std::string& fileName, unsigned generation, std::string& name) {
+		auto file = llvm::MemoryBuffer::getFile(fileName);
+		if (!file) {
+			error("Couldn't open " + fileName);
+		}
+		Compiler compiler(fileName, builtins, optLevel);
+		auto version = std::make_unique<Version>();
+		auto object = compiler.compile((*file)->getBuffer(), lanes, name, version->layout);
+		version->code = executionEnvironment.addReplaceableObject(std::move(object));
+		auto address = version->code->engine->getFunctionAddress(name + "_grid_block");
+		if (!address) {
+			error("Unknown function: " + name + "_grid_block");
+		}
+		version->function = reinterpret_cast<ExecutionEnvironment::GridBlockFunction>(address);
+		version->generation = generation;
+		return version;
+	}
+
+	llvm::sys::TimeValue getModificationTime(const std::string& fileName) {
+		llvm::sys::fs::file_status status;
+		if (llvm::sys::fs::status(fileName, status)) {
+			error("Couldn't stat " + fileName);
+		}
+		return status.getLastModificationTime();
+	}
+private:
+	ExecutionEnvironment& executionEnvironment;
+	BuiltinLibrary& builtins;
+	unsigned lanes;
+	unsigned optLevel;
+	std::map<std::string, std::unique_ptr<Shader>> shaders;
+	EpochReclaimer epochs;
+	std::thread watcher;
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	bool stopping = false;
+};
+
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Mangler.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Compiler.h"
+#include "ErrorHandler.h"
+#include "Optimizer.h"
+#include "global.h"
+
+namespace shmoptix {
+
+// ORC stack that compiles a function on its first call through a stub.
+// Modules are added linked but unoptimized; each partition is optimized
+// and compiled when its stub is first called, so a shader library costs
+// what a frame actually runs. A partition is a function together with the
+// functions it reaches, so the builtins a shader calls still inline into
+// it and compile with the shader that first needs them.
+//
+// Not thread safe: additions, lookups and first calls have to be
+// serialized, see ExecutionEnvironment.
+class LazyJIT : public ErrorHandler {
+public:
+	LazyJIT(unsigned optLevel)
+		: targetMachine(llvm::EngineBuilder()
+			.setMCPU(getDefaultTarget().cpu)
+			.setMAttrs(getDefaultTarget().features)
+			.setOptLevel(getCodeGenOptLevel(optLevel))
+			.selectTarget()),
+		  dataLayout(targetMachine->createDataLayout()),
+		  optimizer(optLevel),
+		  objectLayer(NotifyListeners(listeners)),
+		  compileLayer(objectLayer, llvm::orc::SimpleCompiler(*targetMachine)),
+		  optimizeLayer(compileLayer, [this](std::unique_ptr<llvm::Module> module) {
+			  optimizer.run(*module);
+			  return module;
+		  }),
+		  callbacks(llvm::orc::createLocalCompileCallbackManager(targetMachine->getTargetTriple(), 0)),
+		  lazyLayer(optimizeLayer, getPartition, *callbacks,
+			  llvm::orc::createLocalIndirectStubsManagerBuilder(targetMachine->getTargetTriple())) {
+		llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+	}
+public:
+	// Objects loaded by the JIT are announced to listener, as MCJIT does.
+	void addListener(llvm::JITEventListener* listener) {
+		listeners.push_back(listener);
+	}
+
+	void addModule(ShaderModule shaderModule) {
+		auto& module = *shaderModule.module;
+		module.setTargetTriple(targetMachine->getTargetTriple().str());
+		module.setDataLayout(dataLayout);
+		contexts.push_back(std::move(shaderModule.context));
+
+		std::vector<std::unique_ptr<llvm::Module>> modules;
+		modules.push_back(std::move(shaderModule.module));
+		lazyLayer.addModuleSet(std::move(modules), std::make_unique<llvm::SectionMemoryManager>(), createResolver());
+	}
+
+	// An object compiled ahead of time, e.g. from the object cache. It is
+	// linked on the first lookup of one of its symbols.
+	void addObject(std::unique_ptr<llvm::MemoryBuffer> buffer) {
+		auto object = llvm::object::ObjectFile::createObjectFile(buffer->getMemBufferRef());
+		if (!object) {
+			error("Invalid shader object " + buffer->getBufferIdentifier().str());
+		}
+		std::vector<std::unique_ptr<llvm::object::OwningBinary<llvm::object::ObjectFile>>> objects;
+		objects.push_back(std::make_unique<llvm::object::OwningBinary<llvm::object::ObjectFile>>(std::move(*object), std::move(buffer)));
+		objectLayer.addObjectSet(std::move(objects), std::make_unique<llvm::SectionMemoryManager>(), createResolver());
+	}
+
+	// Address of the stub of a lazily compiled function, or of the
+	// function itself once it is compiled. Zero if unknown.
+	uint64_t getFunctionAddress(const std::string& name) {
+		std::string mangled;
+		llvm::raw_string_ostream out(mangled);
+		llvm::Mangler::getNameWithPrefix(out, name, dataLayout);
+		out.flush();
+		if (auto symbol = lazyLayer.findSymbol(mangled, true)) {
+			return symbol.getAddress();
+		}
+		if (auto symbol = objectLayer.findSymbol(mangled, true)) {
+			return symbol.getAddress();
+		}
+		return 0;
+	}
+private:
+	class NotifyListeners {
+	public:
+		NotifyListeners(std::vector<llvm::JITEventListener*>& listeners) : listeners(&listeners) {}
+
+		template <typename Objects, typename Infos>
+		void operator()(llvm::orc::ObjectLinkingLayerBase::ObjSetHandleT, const Objects& objects, const Infos& infos) {
+			size_t i = 0;
+			for (auto& object : objects) {
+				for (auto listener : *listeners) {
+					listener->NotifyObjectEmitted(*object->getBinary(), *infos[i]);
+				}
+				++i;
+			}
+		}
+	private:
+		std::vector<llvm::JITEventListener*>* listeners;
+	};
+
+	// The function and every function it reaches within its module.
+	static std::set<llvm::Function*> getPartition(llvm::Function& function) {
+		std::set<llvm::Function*> partition{ &function };
+		std::vector<llvm::Function*> worklist{ &function };
+		while (!worklist.empty()) {
+			auto current = worklist.back();
+			worklist.pop_back();
+			for (auto& block : *current) {
+				for (auto& instruction : block) {
+					for (auto& operand : instruction.operands()) {
+						auto callee = llvm::dyn_cast<llvm::Function>(operand);
+						if (callee && !callee->isDeclaration() && partition.insert(callee).second) {
+							worklist.push_back(callee);
+						}
+					}
+				}
+			}
+		}
+		return partition;
+	}
+
+	// Shader modules are self contained once the builtins are linked in,
+	// anything else comes from the host process, like sqrtf.
+	static std::unique_ptr<llvm::RuntimeDyld::SymbolResolver> createResolver() {
+		return llvm::orc::createLambdaResolver(
+			[](const std::string&) {
+				return llvm::RuntimeDyld::SymbolInfo(nullptr);
+			},
+			[](const std::string& name) {
+				if (auto address = llvm::RTDyldMemoryManager::getSymbolAddressInProcess(name)) {
+					return llvm::RuntimeDyld::SymbolInfo(address, llvm::JITSymbolFlags::Exported);
+				}
+				return llvm::RuntimeDyld::SymbolInfo(nullptr);
+			});
+	}
+private:
+	typedef llvm::orc::ObjectLinkingLayer<NotifyListeners> ObjectLayer;
+	typedef llvm::orc::IRCompileLayer<ObjectLayer> CompileLayer;
+	typedef std::function<std::unique_ptr<llvm::Module>(std::unique_ptr<llvm::Module>)> OptimizeFunction;
+	typedef llvm::orc::IRTransformLayer<CompileLayer, OptimizeFunction> OptimizeLayer;
+
+	std::unique_ptr<llvm::TargetMachine> targetMachine;
+	const llvm::DataLayout dataLayout;
+	Optimizer optimizer;
+	std::vector<llvm::JITEventListener*> listeners;
+	std::vector<std::unique_ptr<llvm::LLVMContext>> contexts;
+	ObjectLayer objectLayer;
+	CompileLayer compileLayer;
+	OptimizeLayer optimizeLayer;
+	std::unique_ptr<llvm::orc::JITCompileCallbackManager> callbacks;
+	llvm::orc::CompileOnDemandLayer<OptimizeLayer> lazyLayer;
+};
+
+}
@@ -1,6 +1,15 @@
 #pragma once
 
-#include <fstream>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+
+#include "ErrorHandler.h"
+#include "Symbol.h"
 #include "global.h"
 
 namespace shmoptix {
@@ -11,6 +20,14 @@ namespace shmoptix {
 		// Types
 		tok_surface = -2,
 		tok_normal = -3,
+		tok_network = -9,
+
+		// Statements
+		tok_if = -4,
+		tok_else = -5,
+		tok_for = -6,
+		tok_while = -7,
+		tok_illuminance = -8,
 
 		// Primary
 		tok_identifier = -10,
@@ -26,6 +43,15 @@ namespace shmoptix {
 		tok_slash = -26,
 		tok_semicolon = -27,
 		tok_comma = -28,
+		tok_plus = -29,
+		tok_minus = -30,
+		tok_less = -31,
+		tok_less_equal = -32,
+		tok_greater = -33,
+		tok_greater_equal = -34,
+		tok_equal_equal = -35,
+		tok_not_equal = -36,
+		tok_dot = -37,
 
 	};
 
@@ -35,6 +61,12 @@ std::ostream& operator<<(std::ostream& out, Token token)
 	case tok_eof:			out << "eof";			break;
 	case tok_surface:		out << "surface";		break;
 	case tok_normal:		out << "normal";		break;
+	case tok_network:		out << "network";		break;
+	case tok_if:			out << "if";			break;
+	case tok_else:			out << "else";			break;
+	case tok_for:			out << "for";			break;
+	case tok_while:			out << "while";			break;
+	case tok_illuminance:	out << "illuminance";	break;
 	case tok_identifier:	out << "identifier";	break;
 	case tok_number:		out << "number";		break;
 	case tok_paren_open:	out << "(";				break;
@@ -43,118 +75,204 @@ std::ostream& operator<<(std::ostream& out, Token token)
 	case tok_brace_close:	out << "}";				break;
 	case tok_equals:		out << "=";				break;
 	case tok_star:			out << "*";				break;
+	case tok_slash:			out << "/";				break;
 	case tok_semicolon:		out << ";";				break;
 	case tok_comma:			out << ",";				break;
+	case tok_plus:			out << "+";				break;
+	case tok_minus:			out << "-";				break;
+	case tok_less:			out << "<";				break;
+	case tok_less_equal:	out << "<=";			break;
+	case tok_greater:		out << ">";				break;
+	case tok_greater_equal:	out << ">=";			break;
+	case tok_equal_equal:	out << "==";			break;
+	case tok_not_equal:		out << "!=";			break;
+	case tok_dot:			out << ".";				break;
 	default:				out << "unknown token"; break;
 	}
 	return out;
 }
 
 
+// Splits a shader source into tokens in one pass over the buffer. Token
+// text refers into the source, so the source must outlive the parse.
+// Identifiers are interned as they are lexed, all with one lock.
 class Lexer : public ErrorHandler {
 public:
 	Lexer() {}
 public:
-    void setInput(std::ifstream* i) {
-        input = i;
-    }
+	void setInput(llvm::StringRef source) {
+		auto start = std::chrono::steady_clock::now();
+		current = source.begin();
+		end = source.end();
+		lineStart = current;
+		line = 1;
+		lexemes.clear();
+		next = 0;
+		do {
+			lexemes.push_back(lex());
+		} while (lexemes.back().token != tok_eof);
+		internIdentifiers();
+		tokens += lexemes.size();
+		seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
 
-    int getChar() {
-		lastChar = input->get();
-		return lastChar;
+	Token getToken() {
+		index = std::min(next++, lexemes.size() - 1);
+		return lexemes[index].token;
 	}
 
-    Token getToken() {
-		while (isspace(lastChar))
-			getChar();
-
-		if (isalpha(lastChar)) {
-			identifier = lastChar;
-			while (isalnum((getChar())))
-				identifier += lastChar;
-			if (identifier == "surface")
-				return tok_surface;
-			if (identifier == "normal")
-				return tok_normal;
-			return tok_identifier;
+	double getNumber() { return lexemes[index].number; }
+
+	llvm::StringRef getIdentifier() { return lexemes[index].text; }
+
+	Symbol getSymbol() { return lexemes[index].symbol; }
+
+	size_t getTokenCount() { return tokens; }
+
+	double getSeconds() { return seconds; }
+
+	// Where the current token starts.
+	Location getLocation() { return lexemes[index].location; }
+
+private:
+	struct Lexeme {
+		Token token;
+		llvm::StringRef text;
+		double number;
+		Location location;
+		Symbol symbol;
+	};
+
+	void internIdentifiers() {
+		std::vector<llvm::StringRef> names;
+		for (auto& lexeme : lexemes) {
+			if (lexeme.token == tok_identifier) {
+				names.push_back(lexeme.text);
+			}
 		}
-		if (isdigit(lastChar)) {
-			std::string numString;
-			do {
-				numString += lastChar;
-				getChar();
-			} while (isdigit(lastChar));
-			numVal = strtod(numString.c_str(), 0);
-			return tok_number;
+		auto symbols = Symbol::intern(names);
+		auto symbol = symbols.begin();
+		for (auto& lexeme : lexemes) {
+			if (lexeme.token == tok_identifier) {
+				lexeme.symbol = *symbol++;
+			}
 		}
+	}
 
-		if (lastChar == '/') {
-			getChar();
-			if (lastChar == '/') {
-				do {
-					getChar();
-				} while (lastChar != EOF && lastChar != '\n' && lastChar != '\r');
-
-				if (lastChar != EOF) {
-					return getToken();
+	void skipSpaceAndComments() {
+		while (current != end) {
+			if (*current == '\n') {
+				++line;
+				lineStart = ++current;
+			}
+			else if (isspace(static_cast<unsigned char>(*current))) {
+				++current;
+			}
+			else if (*current == '/' && current + 1 != end && current[1] == '/') {
+				while (current != end && *current != '\n') {
+					++current;
 				}
 			}
 			else {
-				return tok_slash;
+				break;
 			}
 		}
+	}
 
-		if (lastChar == '(') {
-			getChar();
-			return tok_paren_open;
-		}
-		if (lastChar == ')') {
-			getChar();
-			return tok_paren_close;
-		}
-		if (lastChar == '{') {
-			getChar();
-			return tok_brace_open;
-		}
-		if (lastChar == '}') {
-			getChar();
-			return tok_brace_close;
-		}
-		if (lastChar == '=') {
-			getChar();
-			return tok_equals;
-		}
-		if (lastChar == '*') {
-			getChar();
-			return tok_star;
+	Lexeme lex() {
+		skipSpaceAndComments();
+
+		Lexeme lexeme{ tok_eof, llvm::StringRef(), 0, Location(), Symbol() };
+		lexeme.location.line = line;
+		lexeme.location.column = current - lineStart + 1;
+		if (current == end) {
+			return lexeme;
 		}
-		if (lastChar == ';') {
-			getChar();
-			return tok_semicolon;
+
+		auto first = current;
+		auto c = static_cast<unsigned char>(*current);
+		if (isalpha(c)) {
+			while (current != end && isalnum(static_cast<unsigned char>(*current))) {
+				++current;
+			}
+			lexeme.text = llvm::StringRef(first, current - first);
+			if (lexeme.text == "surface")
+				lexeme.token = tok_surface;
+			else if (lexeme.text == "normal")
+				lexeme.token = tok_normal;
+			else if (lexeme.text == "network")
+				lexeme.token = tok_network;
+			else if (lexeme.text == "if")
+				lexeme.token = tok_if;
+			else if (lexeme.text == "else")
+				lexeme.token = tok_else;
+			else if (lexeme.text == "for")
+				lexeme.token = tok_for;
+			else if (lexeme.text == "while")
+				lexeme.token = tok_while;
+			else if (lexeme.text == "illuminance")
+				lexeme.token = tok_illuminance;
+			else
+				lexeme.token = tok_identifier;
+			return lexeme;
 		}
-		if (lastChar == ',') {
-			getChar();
-			return tok_comma;
+		if (isdigit(c) || (c == '.' && current + 1 != end && isdigit(static_cast<unsigned char>(current[1])))) {
+			while (current != end && (isdigit(static_cast<unsigned char>(*current)) || *current == '.')) {
+				++current;
+			}
+			lexeme.text = llvm::StringRef(first, current - first);
+			if (lexeme.text.getAsDouble(lexeme.number)) {
+				error(lexeme.location, "Bad number " + lexeme.text.str());
+			}
+			lexeme.token = tok_number;
+			return lexeme;
 		}
-		if (lastChar == EOF) {
-			getChar();
-			return tok_eof;
+
+		// Two character operators
+		if (current + 1 != end && current[1] == '=' && (c == '<' || c == '>' || c == '=' || c == '!')) {
+			current += 2;
+			lexeme.text = llvm::StringRef(first, 2);
+			lexeme.token = c == '<' ? tok_less_equal : c == '>' ? tok_greater_equal : c == '=' ? tok_equal_equal : tok_not_equal;
+			return lexeme;
 		}
 
-		error("Unknown token");
-		return tok_eof;
+		++current;
+		lexeme.text = llvm::StringRef(first, 1);
+		switch (c) {
+		case '(': lexeme.token = tok_paren_open; break;
+		case ')': lexeme.token = tok_paren_close; break;
+		case '{': lexeme.token = tok_brace_open; break;
+		case '}': lexeme.token = tok_brace_close; break;
+		case '=': lexeme.token = tok_equals; break;
+		case '*': lexeme.token = tok_star; break;
+		case '/': lexeme.token = tok_slash; break;
+		case ';': lexeme.token = tok_semicolon; break;
+		case ',': lexeme.token = tok_comma; break;
+		case '+': lexeme.token = tok_plus; break;
+		case '-': lexeme.token = tok_minus; break;
+		case '<': lexeme.token = tok_less; break;
+		case '>': lexeme.token = tok_greater; break;
+		case '.': lexeme.token = tok_dot; break;
+		default:
+			error(lexeme.location, "Unknown token");
+		}
+		return lexeme;
 	}
 
-	double getNumber() { return numVal; }
-
-	std::string getIdentifier() { return identifier; }
-
+	void error(Location location, const std::string& message) {
+		ErrorHandler::error(std::to_string(location.line) + ":" + std::to_string(location.column) + ": " + message);
+	}
 
 private:
-	int lastChar = ' ';
-	std::ifstream* input;
-	std::string identifier;
-	double numVal;
+	const char* current = nullptr;
+	const char* end = nullptr;
+	const char* lineStart = nullptr;
+	unsigned line = 1;
+	std::vector<Lexeme> lexemes;
+	size_t next = 0;
+	size_t index = 0;
+	size_t tokens = 0;
+	double seconds = 0;
 };
 
 }
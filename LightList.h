@@ -0,0 +1,238 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+#include "Color.h"
+#include "Grid.h"
+#include "global.h"
+
+namespace shmoptix {
+
+// The lights of a scene as structure of arrays, so they are evaluated
+// lanes at a time. Distant lights shine from direction, which points
+// towards the light, at the same color everywhere. Point lights shine from
+// position, their color falling off smoothly to nothing at distance
+// falloff.
+class LightList {
+public:
+	// Floats per light in pack.
+	static const unsigned fields = 7;
+
+	void addDistant(Vector4 direction, Color color) {
+		add(Vector4{}, direction, color, 0.f);
+	}
+
+	void addPoint(Vector4 position, Color color, float falloff) {
+		add(position, Vector4{}, color, falloff);
+	}
+
+	size_t size() const { return falloff.size(); }
+
+	bool isDistant(size_t i) const { return falloff[i] == 0.f; }
+
+	// Of a point light at squared distance d2, 1 at the light.
+	static float attenuation(float d2, float falloff) {
+		float x = std::max(1.f - d2 / (falloff * falloff), 0.f);
+		return x * x;
+	}
+
+	// The box a point light reaches.
+	Bounds getReach(size_t i) const {
+		Bounds bounds;
+		bounds.extend(x[i] - falloff[i], y[i] - falloff[i], z[i] - falloff[i]);
+		bounds.extend(x[i] + falloff[i], y[i] + falloff[i], z[i] + falloff[i]);
+		return bounds;
+	}
+
+	void append(const LightList& lights, size_t i) {
+		add(Vector4{ lights.x[i], lights.y[i], lights.z[i] }, Vector4{ lights.dx[i], lights.dy[i], lights.dz[i] },
+			Color{ lights.red[i], lights.green[i], lights.blue[i] }, lights.falloff[i]);
+	}
+
+	// Appends the lights of indices as shaders see them, structure of
+	// arrays: field f of light l at [f * count + l], the fields being the
+	// position, or the direction of a distant light, the color and the
+	// falloff, 0 for a distant light. L and Cl are evaluated from these for
+	// every point, see builtins/Builtins.cc. Returns count.
+	size_t pack(const std::vector<uint32_t>& indices, std::vector<float>& result) const {
+		auto count = indices.size();
+		auto offset = result.size();
+		result.resize(offset + fields * count);
+		auto out = result.data() + offset;
+		for (size_t l = 0; l < count; ++l) {
+			auto i = indices[l];
+			bool distant = isDistant(i);
+			const float values[fields]{ distant ? dx[i] : x[i], distant ? dy[i] : y[i], distant ? dz[i] : z[i], red[i], green[i], blue[i], falloff[i] };
+			for (unsigned f = 0; f < fields; ++f) {
+				out[f * count + l] = values[f];
+			}
+		}
+		return count;
+	}
+
+	size_t pack(std::vector<float>& result) const {
+		std::vector<uint32_t> indices(size());
+		std::iota(indices.begin(), indices.end(), 0);
+		return pack(indices, result);
+	}
+public:
+	std::vector<float> x, y, z;
+	std::vector<float> dx, dy, dz;
+	std::vector<float> red, green, blue;
+	std::vector<float> falloff;
+private:
+	void add(Vector4 position, Vector4 direction, Color color, float reach) {
+		x.push_back(position.value[0]);
+		y.push_back(position.value[1]);
+		z.push_back(position.value[2]);
+		dx.push_back(direction.value[0]);
+		dy.push_back(direction.value[1]);
+		dz.push_back(direction.value[2]);
+		red.push_back(color[0]);
+		green.push_back(color[1]);
+		blue.push_back(color[2]);
+		falloff.push_back(reach);
+	}
+};
+
+// Bounding volume hierarchy over the point lights of a scene, built once.
+// A grid walks it with its bounds, so only lights that reach the grid are
+// looked at, and gets those whose contribution at the nearest point of its
+// bounds is above threshold: thousands of lights in the scene become a
+// handful per grid, and the builtins and illuminance evaluate those at
+// every point. Lights are reordered so those of a leaf are contiguous and
+// culled together. Read only once built, so grids on any number of
+// threads can gather at once.
+class LightHierarchy {
+public:
+	LightHierarchy(const LightList& scene, float threshold = 1.f / 1024) : threshold(threshold) {
+		std::vector<uint32_t> order;
+		for (size_t i = 0; i < scene.size(); ++i) {
+			if (scene.isDistant(i)) {
+				distant.append(scene, i);
+			}
+			else {
+				order.push_back(i);
+			}
+		}
+		if (!order.empty()) {
+			build(scene, order, 0, order.size());
+		}
+		for (auto i : order) {
+			lights.append(scene, i);
+		}
+		for (size_t i = 0; i < distant.size(); ++i) {
+			packed.append(distant, i);
+		}
+		for (size_t i = 0; i < lights.size(); ++i) {
+			packed.append(lights, i);
+		}
+	}
+public:
+	// The lights of a grid within bounds, packed into result, see
+	// LightList::pack. Returns how many.
+	size_t gather(const Bounds& bounds, std::vector<float>& result) const {
+
+		// Distant lights first, then the point lights, as packed by index
+		std::vector<uint32_t> indices(distant.size());
+		std::iota(indices.begin(), indices.end(), 0);
+		uint32_t stack[64];
+		unsigned top = 0;
+		if (!nodes.empty()) {
+			stack[top++] = 0;
+		}
+		while (top > 0) {
+			auto index = stack[--top];
+			auto& node = nodes[index];
+			if (!node.bounds.overlaps(bounds)) {
+				continue;
+			}
+			if (node.count == 0) {
+				stack[top++] = node.right;
+				stack[top++] = index + 1;
+				continue;
+			}
+			cull(node.first, node.first + node.count, bounds, indices);
+		}
+		return packed.pack(indices, result);
+	}
+
+	// All the lights, unculled, packed into result. Returns how many.
+	size_t pack(std::vector<float>& result) const {
+		return packed.pack(result);
+	}
+
+	size_t size() const { return lights.size() + distant.size(); }
+private:
+	// Interior nodes have count 0, their children follow them and at right.
+	struct Node {
+		Bounds bounds;
+		uint32_t first = 0;
+		uint32_t count = 0;
+		uint32_t right = 0;
+	};
+
+	static const uint32_t leafSize = 8;
+
+	// Nodes for order[begin, end), split at the median of the light
+	// positions along the longest axis.
+	uint32_t build(const LightList& scene, std::vector<uint32_t>& order, uint32_t begin, uint32_t end) {
+		auto index = uint32_t(nodes.size());
+		nodes.emplace_back();
+		Bounds reach, positions;
+		for (auto i = begin; i < end; ++i) {
+			reach.extend(scene.getReach(order[i]));
+			positions.extend(scene.x[order[i]], scene.y[order[i]], scene.z[order[i]]);
+		}
+		nodes[index].bounds = reach;
+		if (end - begin <= leafSize) {
+			nodes[index].first = begin;
+			nodes[index].count = end - begin;
+			return index;
+		}
+		auto axis = positions.getLongestAxis();
+		auto& coordinate = axis == 0 ? scene.x : axis == 1 ? scene.y : scene.z;
+		auto middle = begin + (end - begin) / 2;
+		std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end, [&](uint32_t a, uint32_t b) {
+			return coordinate[a] < coordinate[b];
+		});
+		build(scene, order, begin, middle);
+		auto right = build(scene, order, middle, end);
+		nodes[index].right = right;
+		return index;
+	}
+
+	// Appends the indices in packed of the lights [first, end) whose
+	// contribution at the point of bounds nearest to them, the most they
+	// give any point of the grid, is above threshold. The first loop has no
+	// branches and runs on contiguous arrays, so it vectorizes.
+	void cull(uint32_t first, uint32_t end, const Bounds& bounds, std::vector<uint32_t>& result) const {
+		float weight[leafSize];
+		auto count = end - first;
+		for (uint32_t j = 0; j < count; ++j) {
+			auto i = first + j;
+			auto vx = std::max(bounds.min[0] - lights.x[i], std::max(lights.x[i] - bounds.max[0], 0.f));
+			auto vy = std::max(bounds.min[1] - lights.y[i], std::max(lights.y[i] - bounds.max[1], 0.f));
+			auto vz = std::max(bounds.min[2] - lights.z[i], std::max(lights.z[i] - bounds.max[2], 0.f));
+			weight[j] = LightList::attenuation(vx * vx + vy * vy + vz * vz, lights.falloff[i]);
+		}
+		for (uint32_t j = 0; j < count; ++j) {
+			auto i = first + j;
+			if (weight[j] * std::max(lights.red[i], std::max(lights.green[i], lights.blue[i])) >= threshold) {
+				result.push_back(uint32_t(distant.size() + i));
+			}
+		}
+	}
+private:
+	LightList lights;
+	LightList distant;
+	// The distant lights followed by the point lights, for pack
+	LightList packed;
+	std::vector<Node> nodes;
+	float threshold;
+};
+
+}
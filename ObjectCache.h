@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <initializer_list>
+#include <string>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "global.h"
+
+namespace shmoptix {
+
+// On disk cache of shader objects, keyed by a hash of everything that
+// influences the generated code, so a warm start can skip lexing, parsing,
+// codegen and optimization. As an llvm::ObjectCache for MCJIT the module
+// identifier is the key.
+//
+// Several processes may share one directory: objects are written to a
+// unique temporary file and renamed into place, so readers only ever see
+// complete objects.
+class ShaderObjectCache : public llvm::ObjectCache {
+public:
+	ShaderObjectCache(const std::string& directory) : directory(directory) {
+		llvm::sys::fs::create_directories(directory);
+	}
+	~ShaderObjectCache() {}
+public:
+	// Everything that influences the generated code has to be part of the
+	// key: source, builtins, target CPU and code generation options.
+	std::string getKey(std::initializer_list<llvm::StringRef> inputs) {
+		llvm::MD5 hash;
+		hash.update(compilerVersion);
+		hash.update(LLVM_VERSION_STRING);
+		for (auto input : inputs) {
+			hash.update(input);
+			hash.update(llvm::StringRef("", 1));
+		}
+		llvm::MD5::MD5Result result;
+		hash.final(result);
+		llvm::SmallString<32> key;
+		llvm::MD5::stringifyResult(result, key);
+		return key.str().str();
+	}
+
+	// The cached object for key, or null.
+	std::unique_ptr<llvm::MemoryBuffer> load(const std::string& key) {
+
+		auto buffer = llvm::MemoryBuffer::getFile(getPath(key));
+		if (!buffer) {
+			++misses;
+			return nullptr;
+		}
+		++hits;
+		return std::move(*buffer);
+	}
+
+	void store(const std::string& key, llvm::MemoryBufferRef object) {
+
+		auto path = getPath(key);
+		int fd;
+		llvm::SmallString<128> temporary;
+		if (llvm::sys::fs::createUniqueFile(path + ".%%%%%%.tmp", fd, temporary)) {
+			return;
+		}
+		{
+			llvm::raw_fd_ostream out(fd, true);
+			out.write(object.getBufferStart(), object.getBufferSize());
+			out.close();
+			if (out.has_error()) {
+				out.clear_error();
+				llvm::sys::fs::remove(temporary);
+				return;
+			}
+		}
+		if (llvm::sys::fs::rename(temporary, path)) {
+			llvm::sys::fs::remove(temporary);
+		}
+	}
+
+	void notifyObjectCompiled(const llvm::Module* module, llvm::MemoryBufferRef object) override {
+		store(module->getModuleIdentifier(), object);
+	}
+
+	std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module* module) override {
+		return load(module->getModuleIdentifier());
+	}
+
+	unsigned getHits() { return hits; }
+	unsigned getMisses() { return misses; }
+
+	void printStatistics(llvm::raw_ostream& out) {
+		out << "Object cache: " << getHits() << " hits, " << getMisses() << " misses" << newline;
+	}
+private:
+	std::string getPath(const std::string& key) {
+		llvm::SmallString<128> path(directory);
+		llvm::sys::path::append(path, key + ".o");
+		return path.str().str();
+	}
+private:
+	std::string directory;
+	std::atomic<unsigned> hits{ 0 };
+	std::atomic<unsigned> misses{ 0 };
+};
+
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <memory>
+
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/MC/MCContext.h"
+#include "llvm/Support/CodeGen.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+
+#include "ErrorHandler.h"
+#include "Target.h"
+#include "global.h"
+
+namespace shmoptix {
+
+llvm::CodeGenOpt::Level getCodeGenOptLevel(unsigned level) {
+	switch (level) {
+	case 0: return llvm::CodeGenOpt::None;
+	case 1: return llvm::CodeGenOpt::Less;
+	case 2: return llvm::CodeGenOpt::Default;
+	default: return llvm::CodeGenOpt::Aggressive;
+	}
+}
+
+// IR optimization before the module is handed to the JIT, modelled on
+// clang's -O levels. -O1 and up promote the allocas from AST codegen to
+// registers and run instcombine; -O2 and up add GVN, inlining of the grid
+// builtins and loop and SLP vectorization tuned for the target CPU.
+class Optimizer : public ErrorHandler {
+public:
+	// With pic, code is emitted position independent with the normal code
+	// model, for shared libraries, instead of for the JIT. Functions with
+	// their own target, see CodeTarget::apply, override target.
+	Optimizer(unsigned level, bool pic = false, const CodeTarget& target = getDefaultTarget()) : level(level) {
+		llvm::EngineBuilder builder;
+		builder.setMCPU(target.cpu).setMAttrs(target.features).setOptLevel(getCodeGenOptLevel(level));
+		if (pic) {
+			builder.setRelocationModel(llvm::Reloc::PIC_).setCodeModel(llvm::CodeModel::Default);
+		}
+		targetMachine.reset(builder.selectTarget());
+	}
+	~Optimizer() {}
+public:
+	void run(llvm::Module& module) {
+
+		module.setTargetTriple(targetMachine->getTargetTriple().str());
+		module.setDataLayout(targetMachine->createDataLayout());
+
+		llvm::PassManagerBuilder builder;
+		builder.OptLevel = level;
+		builder.SizeLevel = 0;
+		builder.Inliner = level > 1 ? llvm::createFunctionInliningPass(level, 0) : llvm::createAlwaysInlinerPass();
+		builder.LoopVectorize = level > 1;
+		builder.SLPVectorize = level > 1;
+
+		llvm::legacy::FunctionPassManager functionPasses(&module);
+		llvm::legacy::PassManager modulePasses;
+		functionPasses.add(llvm::createTargetTransformInfoWrapperPass(targetMachine->getTargetIRAnalysis()));
+		modulePasses.add(llvm::createTargetTransformInfoWrapperPass(targetMachine->getTargetIRAnalysis()));
+		builder.populateFunctionPassManager(functionPasses);
+		builder.populateModulePassManager(modulePasses);
+
+		functionPasses.doInitialization();
+		for (auto& function : module) {
+			functionPasses.run(function);
+		}
+		functionPasses.doFinalization();
+		modulePasses.run(module);
+	}
+
+	// Machine code for the optimized module, as the object file MCJIT
+	// would have emitted for it. The target machine is set up like the
+	// JIT's, so the object can be loaded with
+	// ExecutionEnvironment::addObject.
+	std::unique_ptr<llvm::MemoryBuffer> emitObject(llvm::Module& module) {
+
+		llvm::SmallVector<char, 0> buffer;
+		llvm::raw_svector_ostream out(buffer);
+		llvm::legacy::PassManager passes;
+		llvm::MCContext* context;
+		if (targetMachine->addPassesToEmitMC(passes, context, out)) {
+			error("Target can't emit object files");
+		}
+		passes.run(module);
+		return llvm::MemoryBuffer::getMemBufferCopy(llvm::StringRef(buffer.data(), buffer.size()), module.getModuleIdentifier());
+	}
+
+	unsigned getLevel() { return level; }
+private:
+	unsigned level;
+	std::unique_ptr<llvm::TargetMachine> targetMachine;
+};
+
+}
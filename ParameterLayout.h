@@ -0,0 +1,152 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "llvm/Support/raw_ostream.h"
+
+#include "Grid.h"
+#include "Type.h"
+#include "global.h"
+
+namespace shmoptix {
+
+// Memory layout of the parameter block of a shader, in declaration order:
+// a float takes 4 bytes, a color 16 and is 16 byte aligned, and a varying
+// parameter is a pointer to its planes, laid out like those of a Grid.
+// The size is a nonzero multiple of 16, so blocks can be packed into per
+// primitive arrays. Blocks are owned by the caller and read in place by
+// <name>_block and <name>_grid_block, see SurfaceShaderAST::codegenBlock;
+// initialize writes the defaults once per block instead of on every call.
+class ParameterLayout {
+public:
+	struct Parameter {
+		std::string name;
+		Type type;
+		bool varying;
+		float value;
+		size_t offset;
+		size_t size;
+		size_t alignment;
+	};
+
+	static const size_t blockAlignment = 16;
+
+	// Aligned storage for blocks, see allocate.
+	struct alignas(16) Storage {
+		char bytes[16];
+	};
+public:
+	void add(const std::string& name, Type type, bool varying, float value) {
+		size_t size = varying ? sizeof(float*) : type == Type::Color ? 4 * sizeof(float) : sizeof(float);
+		size_t alignment = varying ? alignof(float*) : size;
+		size_t offset = (this->size + alignment - 1) / alignment * alignment;
+		parameters.push_back({ name, type, varying, value, offset, size, alignment });
+		this->size = offset + size;
+	}
+
+	const std::vector<Parameter>& getParameters() const { return parameters; }
+
+	size_t getSize() const {
+		return (std::max(size, size_t(1)) + blockAlignment - 1) / blockAlignment * blockAlignment;
+	}
+
+	const Parameter* find(const std::string& name) const {
+		auto it = std::find_if(parameters.begin(), parameters.end(), [&](const Parameter& p) { return p.name == name; });
+		return it == parameters.end() ? nullptr : &*it;
+	}
+
+	// Defaults of uniform parameters, null planes for varying ones. Colors
+	// are the default in all four channels, as in a constant.
+	void initialize(void* block) const {
+		memset(block, 0, getSize());
+		for (auto& parameter : parameters) {
+			if (!parameter.varying) {
+				auto values = reinterpret_cast<float*>(static_cast<char*>(block) + parameter.offset);
+				std::fill(values, values + parameter.size / sizeof(float), parameter.value);
+			}
+		}
+	}
+
+	// count blocks with the defaults, block i at i * getSize() bytes.
+	std::vector<Storage> allocate(size_t count = 1) const {
+		std::vector<Storage> storage(count * getSize() / sizeof(Storage));
+		for (size_t i = 0; i < count; ++i) {
+			initialize(reinterpret_cast<char*>(storage.data()) + i * getSize());
+		}
+		return storage;
+	}
+
+	// False if the block has no uniform parameter name.
+	bool set(void* block, const std::string& name, const std::vector<float>& values) const {
+		auto parameter = find(name);
+		if (!parameter || parameter->varying || values.empty()) {
+			return false;
+		}
+		auto destination = reinterpret_cast<float*>(static_cast<char*>(block) + parameter->offset);
+		for (size_t c = 0; c < parameter->size / sizeof(float); ++c) {
+			destination[c] = values[c % values.size()];
+		}
+		return true;
+	}
+
+	// False if the block has no varying parameter name.
+	bool setPlanes(void* block, const std::string& name, float* planes) const {
+		auto parameter = find(name);
+		if (!parameter || !parameter->varying) {
+			return false;
+		}
+		memcpy(static_cast<char*>(block) + parameter->offset, &planes, sizeof(planes));
+		return true;
+	}
+
+	void print(llvm::raw_ostream& out) const {
+		out << "Parameter block, " << getSize() << " bytes" << newline;
+		for (auto& parameter : parameters) {
+			out << "  " << parameter.offset << space << parameter.name << space << (parameter.varying ? "varying " : "uniform ")
+				<< (parameter.type == Type::Color ? "color" : "float") << " = " << parameter.value << newline;
+		}
+	}
+private:
+	std::vector<Parameter> parameters;
+	size_t size = 0;
+};
+
+// A parameter block for shading grid through <name>_grid_block: the
+// uniforms and planes of the grid with the names of parameters, the
+// defaults for the others. A varying parameter the grid has only as a
+// uniform, or not at all, reads planes of its own holding that value.
+class GridBlock {
+public:
+	GridBlock(const ParameterLayout& layout, Grid& grid) : block(layout.allocate()), broadcast(grid.getCount(), grid.getLanes()) {
+		auto stride = grid.getStride();
+		for (auto& parameter : layout.getParameters()) {
+			unsigned channels = parameter.type == Type::Color ? 4 : 1;
+			auto uniform = grid.getUniform(parameter.name);
+			if (!parameter.varying) {
+				if (uniform) {
+					layout.set(block.data(), parameter.name, std::vector<float>(uniform, uniform + channels));
+				}
+				continue;
+			}
+			auto planes = grid.get(parameter.name);
+			if (!planes) {
+				planes = broadcast.add(parameter.name, channels);
+				for (unsigned c = 0; c < channels; ++c) {
+					std::fill(planes + c * stride, planes + (c + 1) * stride, uniform ? uniform[c] : parameter.value);
+				}
+			}
+			layout.setPlanes(block.data(), parameter.name, planes);
+		}
+	}
+public:
+	const void* get() const { return block.data(); }
+private:
+	std::vector<ParameterLayout::Storage> block;
+	Grid broadcast;
+};
+
+}
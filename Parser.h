@@ -1,8 +1,14 @@
 #pragma once
 
+#include <algorithm>
 #include <vector>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+
 #include "global.h"
 #include "AST.h"
+#include "Arena.h"
 #include "ErrorHandler.h"
 #include "Lexer.h"
 #include "Type.h"
@@ -19,23 +25,25 @@ public:
 
 	void expect(Token expected, std::string message) {
 		if(token != expected) {
-			error(message);
+			auto location = lexer.getLocation();
+			error(std::to_string(location.line) + ":" + std::to_string(location.column) + ": " + message);
 		}
 	}
 
 	void expect(Token expected) {
-		expect(token, "Error");
+		expect(expected, "Error");
 	}
 
-	std::unique_ptr<ExprAST> parseNumExpr(double value) {
-		auto result = std::make_unique<NumExprAST>(value);
+	ExprAST* parseNumExpr(double value) {
+		auto result = arena->create<NumExprAST>(value);
+		result->setLocation(lexer.getLocation());
 		getNextToken();
-		return std::move(result);
+		return result;
 	}
 
 	Type parseType() {
 		expect(tok_identifier, "Expected argument type");
-		std::string type = lexer.getIdentifier();
+		std::string type = lexer.getIdentifier().str();
 		if (type == "float") {
 			return Type::Float;
 		}
@@ -48,14 +56,23 @@ public:
 		}
 	}
 
+	// [output] [uniform | varying] type name [= number]
 	auto parseArgument() {
 
+		bool output = false;
+		if (token == tok_identifier && lexer.getIdentifier() == "output") {
+			output = true;
+			getNextToken();
+		}
+		bool varying = false;
+		if (token == tok_identifier && (lexer.getIdentifier() == "uniform" || lexer.getIdentifier() == "varying")) {
+			varying = lexer.getIdentifier() == "varying";
+			getNextToken();
+		}
 		Type type = parseType();
 
 		getNextToken();
-		std::string name = lexer.getIdentifier();
-
-		auto argument = std::make_unique<ArgumentAST>(type, name);
+		auto argument = arena->create<ArgumentAST>(type, lexer.getSymbol(), varying, output);
 
 		getNextToken();
 		if(token == tok_equals) {
@@ -69,12 +86,11 @@ public:
 		return argument;
 	}
 
-	auto parseArguments() {
-		auto arguments = std::make_unique<std::vector<std::unique_ptr<ArgumentAST>>>();
+	std::vector<ArgumentAST*> parseArguments() {
+		std::vector<ArgumentAST*> arguments;
 
 		while(token != tok_paren_close) {
-			auto argument = parseArgument();
-			arguments->push_back(std::move(argument));
+			arguments.push_back(parseArgument());
 			if(token == tok_comma) {
 				getNextToken();
 			} else if(token == tok_paren_close) {
@@ -89,169 +105,530 @@ public:
 	std::unique_ptr<ShaderPrototypeAST> parseShaderPrototype() {
 
 		expect(tok_identifier, "Expected shader name!");
-		std::string shaderName = lexer.getIdentifier();
+		std::string shaderName = lexer.getIdentifier().str();
 		getNextToken();
 		expect(tok_paren_open, "Expected '('");
 		getNextToken();
-		auto arguments = parseArguments();
+		std::vector<ArgumentAST*> arguments, outputs;
+		for (auto argument : parseArguments()) {
+			(argument->isOutput() ? outputs : arguments).push_back(argument);
+		}
 		getNextToken();
-		auto prototype = std::make_unique<ShaderPrototypeAST>(shaderName, std::move(arguments));
-		return prototype;
+		return std::make_unique<ShaderPrototypeAST>(shaderName, arena->copy(llvm::makeArrayRef(arguments)), arena->copy(llvm::makeArrayRef(outputs)));
 	}
 
-	std::unique_ptr<ExprAST> parseIdentifier() {
+	ExprAST* parseIdentifier() {
 		expect(tok_identifier, "Error identifier");
-		auto name = lexer.getIdentifier();
+		auto variable = arena->create<VariableExprAST>(lexer.getSymbol());
+		variable->setLocation(lexer.getLocation());
 		getNextToken();
-		return std::make_unique<VariableExprAST>(name);
+		return variable;
 
 	}
 
-	std::unique_ptr<ExprAST> parsePrimaryExpression() {
+	ExprAST* parsePrimaryExpression() {
 		return parseIdentifier();
 	}
 
-	std::unique_ptr<ExprAST> parseRHS() {
-		expect(tok_star);
-		getNextToken();
-		auto expression = parseExpression();
-		return expression;
-	}
-
-	std::unique_ptr<ExprAST> parseBinaryExpression(std::unique_ptr<ExprAST> lhs) {
-		//auto lhs = parsePrimaryExpression();
-		std::unique_ptr<ExprAST> rhs;
-		switch(token) {
-		case tok_semicolon:
-			return lhs;
-			break;
-		case tok_star:
-			rhs = parseRHS();
-			break;
-		default:
-			llvm::outs() << token << ' ' << lexer.getIdentifier() << newline;
-			error("Error in parseBinaryExpression");
-		}
-        std::unique_ptr<ExprAST> binaryExpression = std::make_unique<BinaryExprAST>(std::move(lhs), std::move(rhs));
-		return binaryExpression;
-	}
-
-	std::unique_ptr<ExprAST> parseFunctionCall(const std::string& name) {
+	ExprAST* parseFunctionCall(Symbol name, Location location) {
 		expect(tok_paren_open);
 		getNextToken();
 
-		std::string argument;
-		if (token == tok_identifier) {
-			argument = lexer.getIdentifier();
+		std::vector<Symbol> arguments;
+		while (token == tok_identifier) {
+			arguments.push_back(lexer.getSymbol());
+			getNextToken();
+			if (token != tok_comma) {
+				break;
+			}
 			getNextToken();
 		}
-		expect(tok_paren_close);
+		expect(tok_paren_close, "Expected ')'");
 		getNextToken();
-		//std::unique_ptr<ExprAST> functionCall = std::make_unique<FunctionCallAST>(first, argument);
-		std::unique_ptr<ExprAST> functionCall = std::make_unique<FunctionCallAST>(name, argument);
+		ExprAST* functionCall = arena->create<FunctionCallAST>(name, arena->copy(llvm::makeArrayRef(arguments)));
+		functionCall->setLocation(location);
 		return functionCall;
 	}
 
-	std::unique_ptr<ExprAST> parseExpression() {
+	// Variable, function call, number, -operand or (expression)
+	ExprAST* parseOperand() {
 
+		if (token == tok_number) {
+			return parseNumExpr(lexer.getNumber());
+		}
+		if (token == tok_minus) {
+			auto location = lexer.getLocation();
+			getNextToken();
+			auto zero = arena->create<NumExprAST>(0.);
+			zero->setLocation(location);
+			ExprAST* negation = arena->create<BinaryExprAST>(llvm::Instruction::FSub, zero, parseOperand());
+			negation->setLocation(location);
+			return negation;
+		}
+		if (token == tok_paren_open) {
+			getNextToken();
+			auto expression = parseExpression();
+			expect(tok_paren_close, "Expected ')'");
+			getNextToken();
+			return expression;
+		}
 		expect(tok_identifier, "Error identifier");
-		auto first = lexer.getIdentifier();
+		auto first = lexer.getSymbol();
+		auto location = lexer.getLocation();
 		getNextToken();
 		if (token == tok_paren_open) {
-			return parseFunctionCall(std::move(first));
+			return parseFunctionCall(first, location);
 		}
-		else {
-			auto lhs = std::make_unique<VariableExprAST>(first);
-			return parseBinaryExpression(std::move(lhs));
+		ExprAST* variable = arena->create<VariableExprAST>(first);
+		variable->setLocation(location);
+		return variable;
+	}
+
+	// operand { (* | /) operand }, left associative so Kd * Cs * diffuse(N)
+	// keeps the uniform Kd * Cs together.
+	ExprAST* parseTerm() {
+
+		auto lhs = parseOperand();
+		while (token == tok_star || token == tok_slash) {
+			auto op = token == tok_star ? llvm::Instruction::FMul : llvm::Instruction::FDiv;
+			auto location = lexer.getLocation();
+			getNextToken();
+			auto rhs = parseOperand();
+			lhs = arena->create<BinaryExprAST>(op, lhs, rhs);
+			lhs->setLocation(location);
 		}
+		return lhs;
 	}
 
-	std::unique_ptr<ExprAST> parseAssignmentExpression() {
+	// term { (+ | -) term }
+	ExprAST* parseExpression() {
+
+		auto lhs = parseTerm();
+		while (token == tok_plus || token == tok_minus) {
+			auto op = token == tok_plus ? llvm::Instruction::FAdd : llvm::Instruction::FSub;
+			auto location = lexer.getLocation();
+			getNextToken();
+			auto rhs = parseTerm();
+			lhs = arena->create<BinaryExprAST>(op, lhs, rhs);
+			lhs->setLocation(location);
+		}
+		return lhs;
+	}
 
+	// expression (< | <= | > | >= | == | !=) expression
+	ExprAST* parseCondition() {
+
+		auto lhs = parseExpression();
+		auto location = lexer.getLocation();
+		llvm::CmpInst::Predicate predicate;
+		switch (token) {
+		case tok_less:			predicate = llvm::CmpInst::FCMP_OLT; break;
+		case tok_less_equal:	predicate = llvm::CmpInst::FCMP_OLE; break;
+		case tok_greater:		predicate = llvm::CmpInst::FCMP_OGT; break;
+		case tok_greater_equal:	predicate = llvm::CmpInst::FCMP_OGE; break;
+		case tok_equal_equal:	predicate = llvm::CmpInst::FCMP_OEQ; break;
+		case tok_not_equal:		predicate = llvm::CmpInst::FCMP_UNE; break;
+		default:
+			expect(tok_less, "Expected a comparison");
+			return nullptr;
+		}
+		getNextToken();
+		auto rhs = parseExpression();
+		ExprAST* comparison = arena->create<CompareExprAST>(predicate, lhs, rhs);
+		comparison->setLocation(location);
+		return comparison;
+	}
+
+	// ( condition )
+	ExprAST* parseParenthesizedCondition() {
+		expect(tok_paren_open, "Expected '('");
+		getNextToken();
+		auto condition = parseCondition();
+		expect(tok_paren_close, "Expected ')'");
+		getNextToken();
+		return condition;
+	}
+
+	ExprAST* parseAssignmentExpression() {
+
+		auto location = lexer.getLocation();
 		auto lhs = parsePrimaryExpression();
 		expect(tok_equals, "Error equals");
 		getNextToken();
 		auto rhs = parseExpression();
-		std::unique_ptr<ExprAST> assignmentExpression = std::make_unique<AssignmentExprAST>(std::move(lhs), std::move(rhs));
+		ExprAST* assignmentExpression = arena->create<AssignmentExprAST>(lhs, rhs);
+		assignmentExpression->setLocation(location);
 		return assignmentExpression;
 	}
 
-	std::unique_ptr<AST> parseDeclaration() {
+	bool isDeclaration() {
+		return token == tok_normal || (token == tok_identifier && (lexer.getIdentifier() == "float" || lexer.getIdentifier() == "color"));
+	}
+
+	// (normal | float | color) name [= expression]
+	AST* parseDeclaration() {
 
-		expect(tok_normal);
+		auto location = lexer.getLocation();
+		auto type = token == tok_normal ? Type::Color : parseType();
 		getNextToken();
-		auto name = lexer.getIdentifier();
-		auto decl = new llvm::GlobalVariable(*module, CodeGen.normalType, false, llvm::GlobalValue::ExternalLinkage, nullptr, name);
-		CodeGen.insertNameValue(name, decl);
+		expect(tok_identifier, "Expected variable name");
+		auto name = lexer.getSymbol();
+		getNextToken();
+		ExprAST* initializer = nullptr;
+		if (token == tok_equals) {
+			getNextToken();
+			initializer = parseExpression();
+		}
 
-		std::unique_ptr<AST> declaration = std::make_unique<DeclarationAST>(name, decl);
+		AST* declaration = arena->create<DeclarationAST>(type, name, initializer);
+		declaration->setLocation(location);
 		return declaration;
 	}
 
+	// if (condition) statement [else statement]
+	AST* parseIf() {
 
-	auto parseStatement() {
-		// parse first token
-		// parse postfix expression suffix
+		auto location = lexer.getLocation();
+		getNextToken();
+		auto condition = parseParenthesizedCondition();
+		auto then = parseStatement();
+		AST* otherwise = nullptr;
+		if (token == tok_else) {
+			getNextToken();
+			otherwise = parseStatement();
+		}
+		AST* statement = arena->create<IfAST>(condition, then, otherwise);
+		statement->setLocation(location);
+		return statement;
+	}
 
-		std::unique_ptr<AST> statement;
+	// while (condition) statement
+	AST* parseWhile() {
 
-		if (token == tok_normal) {
-			statement = parseDeclaration();
-		}
-		else {
-			statement = parseAssignmentExpression();
-		}
-		expect(tok_semicolon);
+		auto location = lexer.getLocation();
 		getNextToken();
+		auto condition = parseParenthesizedCondition();
+		AST* loop = arena->create<LoopAST>(condition, parseStatement());
+		loop->setLocation(location);
+		return loop;
+	}
 
-		return statement;
+	// for (assignment; condition; assignment) statement, the
+	// initialization followed by a loop.
+	AST* parseFor() {
+
+		auto location = lexer.getLocation();
+		getNextToken();
+		expect(tok_paren_open, "Expected '('");
+		getNextToken();
+		auto initialization = parseAssignmentExpression();
+		expect(tok_semicolon, "Expected ';'");
+		getNextToken();
+		auto condition = parseCondition();
+		expect(tok_semicolon, "Expected ';'");
+		getNextToken();
+		auto step = parseAssignmentExpression();
+		expect(tok_paren_close, "Expected ')'");
+		getNextToken();
+		AST* loop = arena->create<LoopAST>(condition, parseStatement(), step);
+		loop->setLocation(location);
+		AST* statements[] = { initialization, loop };
+		AST* block = arena->create<BlockAST>(arena->copy(llvm::makeArrayRef(statements)));
+		block->setLocation(location);
+		return block;
 	}
 
-	auto parseStatements() {
-		return parseStatement();
+	// illuminance (axis) statement
+	AST* parseIlluminance() {
+
+		auto location = lexer.getLocation();
+		getNextToken();
+		expect(tok_paren_open, "Expected '('");
+		getNextToken();
+		expect(tok_identifier, "Expected the axis");
+		auto axis = lexer.getSymbol();
+		getNextToken();
+		expect(tok_paren_close, "Expected ')'");
+		getNextToken();
+		AST* illuminance = arena->create<IlluminanceAST>(axis, parseStatement());
+		illuminance->setLocation(location);
+		return illuminance;
 	}
 
-	auto parseShaderBody() {
+	AST* parseStatement() {
+
+		AST* statement;
+		switch (token) {
+		case tok_brace_open:
+			return parseBlock();
+		case tok_if:
+			return parseIf();
+		case tok_while:
+			return parseWhile();
+		case tok_for:
+			return parseFor();
+		case tok_illuminance:
+			return parseIlluminance();
+		default:
+			statement = isDeclaration() ? parseDeclaration() : parseAssignmentExpression();
+		}
+		expect(tok_semicolon, "Expected ';'");
+		getNextToken();
+
+		return statement;
+	}
 
+	// { statement }
+	AST* parseBlock() {
+
+		auto location = lexer.getLocation();
 		expect(tok_brace_open, "Expect open brace");
 		getNextToken();
-		std::unique_ptr<AST> body;
-		if(token != tok_brace_close) {
-			body = parseStatements();
+		std::vector<AST*> statements;
+		while (token != tok_brace_close) {
+			if (token == tok_eof) {
+				expect(tok_brace_close, "Expected '}'");
+			}
+			statements.push_back(parseStatement());
 		}
-		expect(tok_brace_close);
 		getNextToken();
-		return body;
+		AST* block = arena->create<BlockAST>(arena->copy(llvm::makeArrayRef(statements)));
+		block->setLocation(location);
+		return block;
 	}
 
-	auto parseSurfaceShader() {
+	auto parseShaderBody() {
+		return parseBlock();
+	}
+
+	// A block without nodes for it.
+	AST* skipBlock() {
+		expect(tok_brace_open, "Expect open brace");
+		unsigned depth = 0;
+		do {
+			if (token == tok_brace_open) {
+				++depth;
+			}
+			else if (token == tok_brace_close) {
+				--depth;
+			}
+			else if (token == tok_eof) {
+				expect(tok_brace_close, "Expected '}'");
+			}
+			getNextToken();
+		} while (depth > 0);
+		return nullptr;
+	}
+
+	std::unique_ptr<SurfaceShaderAST> parseSurfaceShader(bool withBody) {
+		auto location = lexer.getLocation();
 		getNextToken();
 		auto prototype = parseShaderPrototype();
-		auto body = parseShaderBody();
-		auto surfaceShader = std::make_unique<SurfaceShaderAST>(std::move(prototype), std::move(body));
+		auto body = withBody ? parseShaderBody() : skipBlock();
+		auto surfaceShader = std::make_unique<SurfaceShaderAST>(nullptr, std::move(prototype), body);
+		surfaceShader->setLocation(location);
 		return surfaceShader;
 	}
 
-    std::unique_ptr<SurfaceShaderAST> parse(std::ifstream& shader) {
+	// network name { shader layer [(parameter = layer.output, ...)]; ... }
+	//
+	// The layers are instances of shaders defined before, and their
+	// parameters can be connected to Ci or an output parameter of an
+	// earlier layer, see ShaderNetworkAST. The network is a shader whose
+	// parameters are those left unconnected in the layers that feed the
+	// last one.
+	std::unique_ptr<SurfaceShaderAST> parseNetwork(const std::vector<SurfaceShaderAST*>& shaders) {
 
-        lexer.setInput(&shader);
-		token = getNextToken();
-		switch(token) {
-		case tok_eof:
-			return nullptr;
-		case tok_surface:
-			surfaceShader = parseSurfaceShader();
-			break;
-		default:
-			error("Parse error");
+		auto location = lexer.getLocation();
+		getNextToken();
+		expect(tok_identifier, "Expected network name");
+		std::string networkName = lexer.getIdentifier().str();
+		getNextToken();
+		expect(tok_brace_open, "Expected '{'");
+		getNextToken();
+
+		std::vector<ShaderLayer> layers;
+		std::vector<ShaderConnection> connections;
+		auto findLayer = [&](Symbol name) {
+			auto layer = std::find_if(layers.begin(), layers.end(), [&](const ShaderLayer& l) { return l.name == name; });
+			return uint32_t(layer - layers.begin());
+		};
+		while (token != tok_brace_close) {
+			expect(tok_identifier, "Expected shader name");
+			auto shader = std::find_if(shaders.begin(), shaders.end(), [&](SurfaceShaderAST* s) { return s->getName() == lexer.getIdentifier(); });
+			if (shader == shaders.end()) {
+				error("Unknown shader " + lexer.getIdentifier().str() + " in network " + networkName);
+			}
+			getNextToken();
+			expect(tok_identifier, "Expected layer name");
+			ShaderLayer layer{ lexer.getSymbol(), *shader };
+			if (findLayer(layer.name) < layers.size()) {
+				error("Duplicate layer " + layer.name.str() + " in network " + networkName);
+			}
+			getNextToken();
+			if (token == tok_paren_open) {
+				getNextToken();
+				while (token != tok_paren_close) {
+					expect(tok_identifier, "Expected parameter name");
+					auto parameter = layer.shader->getPrototype().getArgument(lexer.getSymbol());
+					if (!parameter) {
+						error("Layer " + layer.name.str() + " has no parameter " + lexer.getIdentifier().str());
+					}
+					getNextToken();
+					expect(tok_equals, "Expected '='");
+					getNextToken();
+					expect(tok_identifier, "Expected layer name");
+					auto from = findLayer(lexer.getSymbol());
+					if (from == layers.size()) {
+						error("Unknown layer " + lexer.getIdentifier().str() + ", connections go to later layers");
+					}
+					getNextToken();
+					expect(tok_dot, "Expected '.'");
+					getNextToken();
+					expect(tok_identifier, "Expected output name");
+					auto output = lexer.getSymbol();
+					auto type = Type::Color;
+					if (output != names::Ci) {
+						auto argument = layers[from].shader->getPrototype().getOutput(output);
+						if (!argument) {
+							error("Layer " + layers[from].name.str() + " has no output " + output.str());
+						}
+						type = argument->getType();
+					}
+					if (type == Type::Color && parameter->getType() == Type::Float) {
+						error("Can't connect color " + output.str() + " to float " + parameter->getName().str());
+					}
+					for (auto& connection : connections) {
+						if (connection.to == layers.size() && connection.parameter == parameter->getName()) {
+							error("Parameter " + parameter->getName().str() + " of layer " + layer.name.str() + " is connected twice");
+						}
+					}
+					connections.push_back({ from, output, uint32_t(layers.size()), parameter->getName() });
+					getNextToken();
+					if (token == tok_comma) {
+						getNextToken();
+					}
+					else {
+						expect(tok_paren_close, "Expected ')'");
+					}
+				}
+				getNextToken();
+			}
+			expect(tok_semicolon, "Expected ';'");
+			getNextToken();
+			layers.push_back(layer);
+		}
+		getNextToken();
+		if (layers.empty()) {
+			error("Network " + networkName + " has no layers");
+		}
+
+		auto body = arena->create<ShaderNetworkAST>(arena->copy(llvm::makeArrayRef(layers)), arena->copy(llvm::makeArrayRef(connections)));
+		body->setLocation(location);
+
+		// Layers share the network parameter of a name, varying if any of
+		// them declares it varying.
+		std::vector<ArgumentAST*> arguments;
+		auto used = body->getUsedLayers();
+		for (uint32_t i = 0; i < layers.size(); ++i) {
+			if (!used[i]) {
+				continue;
+			}
+			for (auto argument : layers[i].shader->getArguments()) {
+				auto name = argument->getName();
+				if (std::any_of(connections.begin(), connections.end(), [&](const ShaderConnection& c) { return c.to == i && c.parameter == name; })) {
+					continue;
+				}
+				auto existing = std::find_if(arguments.begin(), arguments.end(), [&](ArgumentAST* a) { return a->getName() == name; });
+				if (existing == arguments.end()) {
+					auto copy = arena->create<ArgumentAST>(argument->getType(), name, argument->isVarying());
+					copy->addValue(argument->getValue());
+					arguments.push_back(copy);
+				}
+				else if ((*existing)->getType() != argument->getType()) {
+					error("Parameter " + name.str() + " has different types in the layers of network " + networkName);
+				}
+				else if (argument->isVarying()) {
+					(*existing)->setVarying();
+				}
+			}
+		}
+		auto prototype = std::make_unique<ShaderPrototypeAST>(networkName, arena->copy(llvm::makeArrayRef(arguments)));
+		auto network = std::make_unique<SurfaceShaderAST>(nullptr, std::move(prototype), body);
+		network->setLocation(location);
+		return network;
+	}
+
+	// Parse a shader held in memory, for example generated source. A source
+	// holds one or more surface shaders and at most one network of them.
+	// The result is the network if there is one, else the first shader. The
+	// nodes are allocated in an arena owned by the result, which also owns
+	// the other shaders.
+	std::unique_ptr<SurfaceShaderAST> parse(llvm::StringRef source) {
+		return parseShaders(source, true);
+	}
+
+	// Parse a shader file; large files are memory mapped rather than read.
+	std::unique_ptr<SurfaceShaderAST> parseFile(const std::string& fileName) {
+		auto file = llvm::MemoryBuffer::getFile(fileName);
+		if (!file) {
+			error("Couldn't open " + fileName);
+		}
+		return parse((*file)->getBuffer());
+	}
+
+	// Only read "surface <name>(<parameters>)" and networks, enough to
+	// find the entry points and the parameter layout of a shader whose
+	// object is already cached. Shader bodies are skipped.
+	std::unique_ptr<SurfaceShaderAST> parsePrototype(llvm::StringRef source) {
+		return parseShaders(source, false);
+	}
+
+private:
+	std::unique_ptr<SurfaceShaderAST> parseShaders(llvm::StringRef source, bool withBodies) {
+
+		arena = std::make_unique<Arena>();
+		lexer.setInput(source);
+		getNextToken();
+		std::vector<SurfaceShaderAST*> shaders;
+		std::unique_ptr<SurfaceShaderAST> result, network;
+		while (token != tok_eof) {
+			switch (token) {
+			case tok_surface: {
+				auto shader = parseSurfaceShader(withBodies);
+				shaders.push_back(shader.get());
+				if (result) {
+					arena->own(std::move(shader));
+				}
+				else {
+					result = std::move(shader);
+				}
+				break;
+			}
+			case tok_network:
+				if (network) {
+					error("More than one network");
+				}
+				network = parseNetwork(shaders);
+				break;
+			default:
+				error("Parse error");
+			}
+		}
+		if (network) {
+			arena->own(std::move(result));
+			result = std::move(network);
+		}
+		if (result) {
+			result->setArena(std::move(arena));
 		}
-		return std::move(surfaceShader);
+		return result;
 	}
 
 private:
 	Lexer& lexer;
 	Token token;
-	std::unique_ptr<SurfaceShaderAST> surfaceShader;
+	std::unique_ptr<Arena> arena;
 };
 
 }
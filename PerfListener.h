@@ -0,0 +1,199 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "llvm/DebugInfo/DIContext.h"
+#include "llvm/DebugInfo/DWARF/DWARFContext.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Object/SymbolSize.h"
+
+#include "global.h"
+
+#if defined(__linux__)
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+namespace shmoptix {
+
+#if defined(__linux__)
+
+// Tells perf about JIT compiled shaders. Every function is written to
+// /tmp/perf-<pid>.map, which perf report uses for symbol names directly,
+// and to jit-<pid>.dump with its code and DWARF line table. After
+//
+//   perf record -k 1 shmoptix -perf shader.sl
+//   perf inject --jit -i perf.data -o perf.jit.data
+//
+// perf report and perf annotate attribute samples to .sl lines. The dump
+// is written to $JITDUMPDIR, or the current directory.
+class PerfListener : public llvm::JITEventListener {
+public:
+	PerfListener() {
+
+		auto pid = getpid();
+		map = fopen(("/tmp/perf-" + std::to_string(pid) + ".map").c_str(), "a");
+
+		auto directory = getenv("JITDUMPDIR");
+		auto path = std::string(directory ? directory : ".") + "/jit-" + std::to_string(pid) + ".dump";
+		auto fd = open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0666);
+		if (fd < 0) {
+			return;
+		}
+		// perf finds the dump through this executable mapping of it
+		marker = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+		if (marker == MAP_FAILED) {
+			marker = nullptr;
+			close(fd);
+			return;
+		}
+		dump = fdopen(fd, "w+");
+
+		Header header;
+		header.pid = pid;
+		header.timestamp = getTimestamp();
+		fwrite(&header, sizeof(header), 1, dump);
+		fflush(dump);
+	}
+
+	~PerfListener() {
+		if (map) {
+			fclose(map);
+		}
+		if (dump) {
+			Prefix record{ JitCodeClose, sizeof(Prefix), getTimestamp() };
+			fwrite(&record, sizeof(record), 1, dump);
+			fclose(dump);
+		}
+		if (marker) {
+			munmap(marker, sysconf(_SC_PAGESIZE));
+		}
+	}
+public:
+	void NotifyObjectEmitted(const llvm::object::ObjectFile& object, const llvm::RuntimeDyld::LoadedObjectInfo& info) override {
+
+		// The debug object has its sections at their load addresses
+		auto debugObject = info.getObjectForDebug(object);
+		if (!debugObject.getBinary()) {
+			return;
+		}
+		auto& loaded = *debugObject.getBinary();
+		llvm::DWARFContextInMemory context(loaded);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto& symbolSize : llvm::object::computeSymbolSizes(loaded)) {
+			auto symbol = symbolSize.first;
+			auto type = symbol.getType();
+			auto name = symbol.getName();
+			auto address = symbol.getAddress();
+			if (!type || *type != llvm::object::SymbolRef::ST_Function || !name || !address || !symbolSize.second) {
+				continue;
+			}
+			auto lines = context.getLineInfoForAddressRange(*address, symbolSize.second,
+				llvm::DILineInfoSpecifier(llvm::DILineInfoSpecifier::FileLineInfoKind::AbsoluteFilePath));
+			writeFunction(name->str(), *address, symbolSize.second, lines);
+		}
+	}
+private:
+	enum RecordType : uint32_t {
+		JitCodeLoad = 0,
+		JitCodeDebugInfo = 2,
+		JitCodeClose = 3,
+	};
+
+	struct Header {
+		uint32_t magic = 0x4A695444;
+		uint32_t version = 1;
+		uint32_t size = sizeof(Header);
+#if defined(__aarch64__)
+		uint32_t machine = EM_AARCH64;
+#else
+		uint32_t machine = EM_X86_64;
+#endif
+		uint32_t padding = 0;
+		uint32_t pid = 0;
+		uint64_t timestamp = 0;
+		uint64_t flags = 0;
+	};
+
+	struct Prefix {
+		uint32_t type;
+		uint32_t size;
+		uint64_t timestamp;
+	};
+
+	static uint64_t getTimestamp() {
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+	}
+
+	void writeFunction(const std::string& name, uint64_t address, uint64_t size, const llvm::DILineInfoTable& lines) {
+
+		if (map) {
+			fprintf(map, "%llx %llx %s\n", (unsigned long long)address, (unsigned long long)size, name.c_str());
+			fflush(map);
+		}
+		if (!dump) {
+			return;
+		}
+
+		auto timestamp = getTimestamp();
+		if (!lines.empty()) {
+			uint32_t recordSize = sizeof(Prefix) + 2 * sizeof(uint64_t);
+			for (auto& line : lines) {
+				recordSize += sizeof(uint64_t) + 2 * sizeof(uint32_t) + line.second.FileName.size() + 1;
+			}
+			Prefix prefix{ JitCodeDebugInfo, recordSize, timestamp };
+			uint64_t count = lines.size();
+			fwrite(&prefix, sizeof(prefix), 1, dump);
+			fwrite(&address, sizeof(address), 1, dump);
+			fwrite(&count, sizeof(count), 1, dump);
+			for (auto& line : lines) {
+				uint64_t lineAddress = line.first;
+				uint32_t lineNumber = line.second.Line;
+				uint32_t discriminator = line.second.Discriminator;
+				fwrite(&lineAddress, sizeof(lineAddress), 1, dump);
+				fwrite(&lineNumber, sizeof(lineNumber), 1, dump);
+				fwrite(&discriminator, sizeof(discriminator), 1, dump);
+				fwrite(line.second.FileName.c_str(), line.second.FileName.size() + 1, 1, dump);
+			}
+		}
+
+		Prefix prefix{ JitCodeLoad, uint32_t(sizeof(Prefix) + 2 * sizeof(uint32_t) + 4 * sizeof(uint64_t) + name.size() + 1 + size), timestamp };
+		uint32_t pid = getpid();
+		uint32_t tid = syscall(SYS_gettid);
+		uint64_t index = codeIndex++;
+		fwrite(&prefix, sizeof(prefix), 1, dump);
+		fwrite(&pid, sizeof(pid), 1, dump);
+		fwrite(&tid, sizeof(tid), 1, dump);
+		fwrite(&address, sizeof(address), 1, dump);
+		fwrite(&address, sizeof(address), 1, dump);
+		fwrite(&size, sizeof(size), 1, dump);
+		fwrite(&index, sizeof(index), 1, dump);
+		fwrite(name.c_str(), name.size() + 1, 1, dump);
+		// Relocations are applied later, at finalization, so calls in this
+		// copy may not point at their final targets yet.
+		fwrite(reinterpret_cast<const void*>(address), size, 1, dump);
+		fflush(dump);
+	}
+private:
+	std::mutex mutex;
+	FILE* map = nullptr;
+	FILE* dump = nullptr;
+	void* marker = nullptr;
+	uint64_t codeIndex = 0;
+};
+
+#endif
+
+}
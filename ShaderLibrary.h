@@ -0,0 +1,266 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalIFunc.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "AST.h"
+#include "BuiltinLibrary.h"
+#include "Compiler.h"
+#include "ErrorHandler.h"
+#include "Optimizer.h"
+#include "ParameterLayout.h"
+#include "Target.h"
+#include "ThreadPool.h"
+#include "global.h"
+
+namespace shmoptix {
+
+// Ahead of time compilation of a set of shaders into one relocatable
+// object (.o) or shared library (.so), so render nodes can dlopen
+// precompiled shaders without LLVM. Every shader exports its entry points,
+// <name> and <name>_grid, with the signatures of the JIT ones. The null
+// terminated JSON string shmoptix_manifest describes the parameters of
+// each shader, the ABI and the target the code was compiled for; it is
+// also written next to the output as <output>.json.
+//
+// On x86-64 every entry point is an ifunc that picks, when the library is
+// loaded, the variant for the newest of the dispatch targets the machine
+// supports, see getDispatchTargets, so one library serves a mixed farm.
+class ShaderLibrary : public ErrorHandler {
+public:
+	ShaderLibrary(BuiltinLibrary& builtins, unsigned lanes, unsigned optLevel)
+		: builtins(builtins), lanes(lanes), optLevel(optLevel), targets(getDispatchTargets()) {
+		for (auto& target : targets) {
+			this->lanes = std::max(this->lanes, target.getLanes());
+		}
+	}
+public:
+	void add(const std::string& fileName) {
+		auto file = llvm::MemoryBuffer::getFile(fileName);
+		if (!file) {
+			error("Couldn't open " + fileName);
+		}
+		shaders.push_back({ fileName, std::move(*file) });
+	}
+
+	// Compile all shaders in parallel and link them into outputFileName,
+	// a shared library unless it ends in .o.
+	void write(const std::string& outputFileName) {
+
+		ThreadPool pool;
+		pool.parallelFor(shaders.size(), 1, [&](size_t begin, size_t end) {
+			for (auto i = begin; i < end; ++i) {
+				compile(shaders[i]);
+			}
+		});
+
+		auto manifest = getManifest();
+		std::vector<std::string> objects;
+		for (auto& shader : shaders) {
+			objects.push_back(writeTemporary(*shader.object));
+		}
+		objects.push_back(writeTemporary(*emitManifest(manifest)));
+
+		bool shared = !llvm::StringRef(outputFileName).endswith(".o");
+		auto program = llvm::sys::findProgramByName(shared ? "cc" : "ld");
+		if (!program) {
+			error(std::string("Couldn't find ") + (shared ? "cc" : "ld") + " to link " + outputFileName);
+		}
+		std::vector<const char*> arguments{ program->c_str(), shared ? "-shared" : "-r", "-o", outputFileName.c_str() };
+		for (auto& object : objects) {
+			arguments.push_back(object.c_str());
+		}
+		if (shared) {
+			arguments.push_back("-lm");
+		}
+		arguments.push_back(nullptr);
+		std::string message;
+		auto result = llvm::sys::ExecuteAndWait(*program, arguments.data(), nullptr, nullptr, 0, 0, &message);
+		for (auto& object : objects) {
+			llvm::sys::fs::remove(object);
+		}
+		if (result != 0) {
+			error("Linking " + outputFileName + " failed " + message);
+		}
+
+		std::error_code errorCode;
+		llvm::raw_fd_ostream out(outputFileName + ".json", errorCode, llvm::sys::fs::F_Text);
+		if (errorCode) {
+			error("Couldn't write " + outputFileName + ".json: " + errorCode.message());
+		}
+		out << manifest;
+	}
+private:
+	struct Shader {
+		std::string fileName;
+		std::unique_ptr<llvm::MemoryBuffer> source;
+		std::string name;
+		ParameterLayout layout;
+		std::unique_ptr<llvm::MemoryBuffer> object;
+	};
+
+	void compile(Shader& shader) {
+		Compiler compiler(shader.fileName, builtins, optLevel, true, targets.empty() ? getDefaultTarget() : targets.front());
+		auto ast = compiler.parse(shader.source->getBuffer());
+		shader.name = ast->getName();
+		shader.layout = ast->getParameterLayout();
+		if (targets.empty()) {
+			compiler.codegen(*ast, lanes);
+		}
+		else {
+			compiler.codegen(*ast, targets);
+		}
+		compiler.link();
+		compiler.optimize();
+		shader.object = compiler.emitObject();
+	}
+
+	std::string getManifest() {
+		std::string manifest;
+		llvm::raw_string_ostream out(manifest);
+		out << "{\n";
+		out << "  \"version\": \"" << compilerVersion << "\",\n";
+		out << "  \"targets\": [\n";
+		auto manifestTargets = targets.empty() ? std::vector<CodeTarget>{ getDefaultTarget() } : targets;
+		for (size_t i = 0; i < manifestTargets.size(); ++i) {
+			auto& target = manifestTargets[i];
+			out << "    { \"name\": \"" << target.name << "\", \"cpu\": \"" << target.cpu << "\", \"features\": \"" << target.getFeatureString()
+				<< "\", \"lanes\": " << target.getLanes() << " }" << (i + 1 < manifestTargets.size() ? ",\n" : "\n");
+		}
+		out << "  ],\n";
+		out << "  \"lanes\": " << lanes << ",\n";
+		out << "  \"abi\": {\n";
+		out << "    \"entry\": \"void <name>(ShadingContext*, parameters...), float by value, color as float[4]*\",\n";
+		out << "    \"grid\": \"void <name>_grid(ShadingContext*, parameters..., float* P, float* N, float* Ci, int begin, int end, int stride), "
+			"uniform float by value, uniform color as float[4]*, varying as float* planes\",\n";
+		out << "    \"block\": \"void <name>_block(ShadingContext*, const char* block, int index, int stride), void <name>_grid_block(ShadingContext*, const char* block, "
+			"float* P, float* N, float* Ci, int begin, int end, int stride), block " << ParameterLayout::blockAlignment << " byte aligned with parameters at their offsets, "
+			"float 4 bytes, color 16, varying a float* to its planes; defaults in const char <name>_defaults[block_size]\",\n";
+		out << "    \"dispatch\": \"" << (targets.empty() ? "none" : "entry points are ifuncs resolved to <name>__<target>, <name>__<target>_grid, ... "
+			"for the newest target the CPU supports; grid strides must be a multiple of lanes") << "\"\n";
+		out << "  },\n";
+		out << "  \"shaders\": [\n";
+		for (size_t i = 0; i < shaders.size(); ++i) {
+			auto& shader = shaders[i];
+			out << "    { \"name\": \"" << shader.name << "\", \"entry\": \"" << shader.name << "\", \"grid\": \"" << shader.name << "_grid\", \"block\": \""
+				<< shader.name << "_block\", \"grid_block\": \"" << shader.name << "_grid_block\", \"defaults\": \"" << shader.name
+				<< "_defaults\", \"block_size\": " << shader.layout.getSize() << ", \"parameters\": [";
+			auto& parameters = shader.layout.getParameters();
+			for (size_t j = 0; j < parameters.size(); ++j) {
+				auto& parameter = parameters[j];
+				out << (j ? ", " : " ") << "{ \"name\": \"" << parameter.name << "\", \"type\": \""
+					<< (parameter.type == Type::Color ? "color" : "float") << "\", \"storage\": \""
+					<< (parameter.varying ? "varying" : "uniform") << "\", \"offset\": " << parameter.offset << ", \"default\": " << llvm::format("%g", parameter.value) << " }";
+			}
+			out << " ] }" << (i + 1 < shaders.size() ? ",\n" : "\n");
+		}
+		out << "  ]\n}\n";
+		return out.str();
+	}
+
+	// The manifest string and, with dispatch targets, the entry points of
+	// the shaders.
+	std::unique_ptr<llvm::MemoryBuffer> emitManifest(const std::string& manifest) {
+		llvm::LLVMContext context;
+		llvm::Module module("shmoptix_manifest", context);
+		auto initializer = llvm::ConstantDataArray::getString(context, manifest, true);
+		new llvm::GlobalVariable(module, initializer->getType(), true, llvm::GlobalValue::ExternalLinkage, initializer, "shmoptix_manifest");
+		if (!targets.empty()) {
+			emitDispatch(module);
+		}
+		Optimizer optimizer(optLevel, true, targets.empty() ? getDefaultTarget() : targets.front());
+		optimizer.run(module);
+		return optimizer.emitObject(module);
+	}
+
+	// An ifunc for every entry point of every shader, resolved through a
+	// table of its variants indexed by the target selected with the
+	// __cpu_model of libgcc or compiler-rt. The defaults are the same for
+	// all variants and defined here once.
+	void emitDispatch(llvm::Module& module) {
+		auto& context = module.getContext();
+		auto int32Type = llvm::Type::getInt32Ty(context);
+		auto entryType = llvm::FunctionType::get(llvm::Type::getVoidTy(context), false);
+		auto entryPointerType = entryType->getPointerTo();
+
+		// struct { unsigned vendor, type, subtype; unsigned features[1]; }
+		auto cpuModelType = llvm::StructType::get(int32Type, int32Type, int32Type, llvm::ArrayType::get(int32Type, 1), nullptr);
+		auto cpuModel = new llvm::GlobalVariable(module, cpuModelType, false, llvm::GlobalValue::ExternalLinkage, nullptr, "__cpu_model");
+		auto cpuInit = llvm::Function::Create(entryType, llvm::GlobalValue::ExternalLinkage, "__cpu_indicator_init", &module);
+
+		// Index of the newest target whose features are all there, the
+		// first runs everywhere.
+		auto select = llvm::Function::Create(llvm::FunctionType::get(int32Type, false), llvm::GlobalValue::InternalLinkage, "shmoptix_select_target", &module);
+		llvm::IRBuilder<> builder(llvm::BasicBlock::Create(context, "entry", select));
+		builder.CreateCall(cpuInit);
+		llvm::Value* indices[] = { builder.getInt32(0), builder.getInt32(3), builder.getInt32(0) };
+		auto features = builder.CreateLoad(builder.CreateInBoundsGEP(cpuModelType, cpuModel, indices), "features");
+		llvm::Value* index = builder.getInt32(0);
+		for (size_t i = 1; i < targets.size(); ++i) {
+			auto mask = builder.getInt32(targets[i].cpuModelFeatures);
+			index = builder.CreateSelect(builder.CreateICmpEQ(builder.CreateAnd(features, mask), mask), builder.getInt32(i), index);
+		}
+		builder.CreateRet(index);
+
+		auto tableType = llvm::ArrayType::get(entryPointerType, targets.size());
+		for (auto& shader : shaders) {
+			for (auto kind : { "", "_grid", "_block", "_grid_block" }) {
+				std::vector<llvm::Constant*> variants;
+				for (auto& target : targets) {
+					auto name = target.getEntryName(shader.name) + kind;
+					variants.push_back(llvm::Function::Create(entryType, llvm::GlobalValue::ExternalLinkage, name, &module));
+				}
+				auto table = new llvm::GlobalVariable(module, tableType, true, llvm::GlobalValue::PrivateLinkage,
+					llvm::ConstantArray::get(tableType, variants), shader.name + kind + "_variants");
+
+				auto resolver = llvm::Function::Create(llvm::FunctionType::get(entryPointerType, false), llvm::GlobalValue::InternalLinkage,
+					shader.name + kind + "_resolver", &module);
+				builder.SetInsertPoint(llvm::BasicBlock::Create(context, "entry", resolver));
+				llvm::Value* variant[] = { builder.getInt32(0), builder.CreateCall(select) };
+				builder.CreateRet(builder.CreateLoad(builder.CreateInBoundsGEP(tableType, table, variant)));
+
+				llvm::GlobalIFunc::create(entryType, 0, llvm::GlobalValue::ExternalLinkage, shader.name + kind, resolver, &module);
+			}
+
+			auto block = shader.layout.allocate();
+			auto defaults = llvm::ConstantDataArray::get(context,
+				llvm::ArrayRef<uint8_t>(reinterpret_cast<const uint8_t*>(block.data()), shader.layout.getSize()));
+			auto global = new llvm::GlobalVariable(module, defaults->getType(), true, llvm::GlobalValue::ExternalLinkage, defaults, shader.name + "_defaults");
+			global->setAlignment(ParameterLayout::blockAlignment);
+		}
+	}
+
+	std::string writeTemporary(llvm::MemoryBuffer& object) {
+		int fd;
+		llvm::SmallString<128> path;
+		if (llvm::sys::fs::createTemporaryFile("shmoptix", "o", fd, path)) {
+			error("Couldn't create a temporary object file");
+		}
+		llvm::raw_fd_ostream out(fd, true);
+		out.write(object.getBufferStart(), object.getBufferSize());
+		return path.str().str();
+	}
+private:
+	BuiltinLibrary& builtins;
+	unsigned lanes;
+	unsigned optLevel;
+	std::vector<CodeTarget> targets;
+	std::vector<Shader> shaders;
+};
+
+}
@@ -0,0 +1,327 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+#include <thread>
+
+#include "ErrorHandler.h"
+#include "global.h"
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace shmoptix {
+
+#if defined(__linux__)
+
+// POSIX shared memory segment through which renderer processes hand grids
+// to the shading service, see ShadingService.h:
+//
+//   Header | ring of slot indices | slot 0 | P, N and Ci planes | slot 1 ...
+//
+// A renderer claims a free slot, writes the shader name, the parameter
+// block, P and N into it and pushes its index onto the ring, a bounded lock
+// free multi producer, multi consumer queue (Vyukov). A service worker pops
+// the index, shades the points in place and marks the slot done. Both sides
+// sleep on futexes in the segment, so no request is copied and nobody
+// spins. Everything shared is plain data or an address free atomic.
+class ShadingSegment : public ErrorHandler {
+public:
+	static const uint32_t magic = 0x6f6d6873;
+	static const uint32_t version = 3;
+	static const uint32_t maxParameterBytes = 256;
+
+	struct Header {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t slots;
+		uint32_t maxPoints;
+		// Of the service, for clients to notice it died
+		int32_t pid;
+		// Bumped for every queued request, workers sleep on it
+		std::atomic<uint32_t> posted;
+		std::atomic<uint32_t> stopping;
+		alignas(64) std::atomic<uint64_t> enqueuePosition;
+		alignas(64) std::atomic<uint64_t> dequeuePosition;
+	};
+
+	struct Cell {
+		std::atomic<uint64_t> sequence;
+		uint32_t slot;
+	};
+
+	// A request. P, N and Ci are SoA planes after it, channel c of point i
+	// at [c * maxPoints + i]. The parameter block is laid out by the
+	// ParameterLayout of the shader, without one the shader's defaults are
+	// used.
+	struct Slot {
+		enum State : uint32_t { Free, Writing, Queued, Shading, Done, Failed };
+
+		std::atomic<uint32_t> state;
+		uint32_t count;
+		uint32_t parameterBytes;
+		char shader[64];
+		alignas(16) char parameters[maxParameterBytes];
+	};
+
+	// Create the segment /name for a service. Fails if it exists, the
+	// segment of a running service or a stale one of a killed service,
+	// which has to be removed, e.g. from /dev/shm. maxPoints is rounded up
+	// to a multiple of 16, the widest grid.
+	ShadingSegment(const std::string& name, unsigned slots, unsigned maxPoints) : name(getName(name)), owner(true) {
+
+		unsigned ring = 1;
+		while (ring < slots) {
+			ring *= 2;
+		}
+		maxPoints = (maxPoints + 15) / 16 * 16;
+		size = getSize(ring, maxPoints);
+
+		auto fd = shm_open(this->name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+		if (fd < 0 || ftruncate(fd, size) != 0) {
+			error("Couldn't create shared memory " + this->name + ": " + strerror(errno));
+		}
+		map(fd);
+
+		auto header = new (base) Header();
+		header->slots = ring;
+		header->maxPoints = maxPoints;
+		header->pid = getpid();
+		for (uint32_t i = 0; i < ring; ++i) {
+			new (&getCell(i)) Cell();
+			getCell(i).sequence.store(i);
+			new (&getSlot(i)) Slot();
+		}
+		header->version = version;
+		std::atomic_thread_fence(std::memory_order_release);
+		reinterpret_cast<std::atomic<uint32_t>*>(&header->magic)->store(magic);
+	}
+
+	// Attach to the segment of a running service.
+	ShadingSegment(const std::string& name) : name(getName(name)), owner(false) {
+
+		auto fd = shm_open(this->name.c_str(), O_RDWR, 0);
+		struct stat status;
+		if (fd < 0 || fstat(fd, &status) != 0) {
+			error("Couldn't open shared memory " + this->name + ", is the service running? " + strerror(errno));
+		}
+		size = status.st_size;
+		map(fd);
+		auto& header = getHeader();
+		if (reinterpret_cast<std::atomic<uint32_t>*>(&header.magic)->load() != magic || header.version != version ||
+			size != getSize(header.slots, header.maxPoints)) {
+			error(this->name + " is not a shmoptix " + std::to_string(version) + " shading segment");
+		}
+	}
+
+	~ShadingSegment() {
+		munmap(base, size);
+		if (owner) {
+			shm_unlink(name.c_str());
+		}
+	}
+
+	ShadingSegment(const ShadingSegment&) = delete;
+	ShadingSegment& operator=(const ShadingSegment&) = delete;
+public:
+	Header& getHeader() { return *reinterpret_cast<Header*>(base); }
+	Slot& getSlot(uint32_t i) { return *reinterpret_cast<Slot*>(base + getSlotsOffset(getHeader().slots) + i * getSlotBytes(getHeader().maxPoints)); }
+	float* getP(uint32_t i) { return reinterpret_cast<float*>(reinterpret_cast<char*>(&getSlot(i)) + align(sizeof(Slot))); }
+	float* getN(uint32_t i) { return getP(i) + 4 * getStride(); }
+	float* getCi(uint32_t i) { return getN(i) + 4 * getStride(); }
+	uint32_t getSlotCount() { return getHeader().slots; }
+	size_t getStride() { return getHeader().maxPoints; }
+
+	// Fails only if the ring is full, which can't happen while every slot
+	// is queued at most once.
+	bool push(uint32_t slot) {
+		auto& header = getHeader();
+		auto mask = header.slots - 1;
+		auto position = header.enqueuePosition.load(std::memory_order_relaxed);
+		for (;;) {
+			auto& cell = getCell(position & mask);
+			auto difference = int64_t(cell.sequence.load(std::memory_order_acquire) - position);
+			if (difference == 0) {
+				if (header.enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+					cell.slot = slot;
+					cell.sequence.store(position + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (difference < 0) {
+				return false;
+			}
+			else {
+				position = header.enqueuePosition.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	bool pop(uint32_t& slot) {
+		auto& header = getHeader();
+		auto mask = header.slots - 1;
+		auto position = header.dequeuePosition.load(std::memory_order_relaxed);
+		for (;;) {
+			auto& cell = getCell(position & mask);
+			auto difference = int64_t(cell.sequence.load(std::memory_order_acquire) - (position + 1));
+			if (difference == 0) {
+				if (header.dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+					slot = cell.slot;
+					cell.sequence.store(position + mask + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (difference < 0) {
+				return false;
+			}
+			else {
+				position = header.dequeuePosition.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// Whether the process that created the segment is still running.
+	bool isServiceAlive() {
+		return kill(getHeader().pid, 0) == 0 || errno != ESRCH;
+	}
+
+	// Sleep while word is expected, for at most milliseconds if given.
+	// Shared futexes, so processes can wake each other.
+	static void wait(std::atomic<uint32_t>& word, uint32_t expected, unsigned milliseconds = 0) {
+		timespec timeout{ time_t(milliseconds / 1000), long(milliseconds % 1000) * 1000000 };
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, expected, milliseconds ? &timeout : nullptr, nullptr, 0);
+	}
+
+	static void wake(std::atomic<uint32_t>& word, int count = INT_MAX) {
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, count, nullptr, nullptr, 0);
+	}
+private:
+	static std::string getName(const std::string& name) {
+		return name.empty() || name[0] != '/' ? "/" + name : name;
+	}
+
+	static size_t align(size_t offset) {
+		return (offset + 63) / 64 * 64;
+	}
+
+	static size_t getSlotsOffset(uint32_t slots) {
+		return align(align(sizeof(Header)) + slots * sizeof(Cell));
+	}
+
+	static size_t getSlotBytes(uint32_t maxPoints) {
+		return align(sizeof(Slot)) + 12 * maxPoints * sizeof(float);
+	}
+
+	static size_t getSize(uint32_t slots, uint32_t maxPoints) {
+		return getSlotsOffset(slots) + slots * getSlotBytes(maxPoints);
+	}
+
+	Cell& getCell(uint32_t i) { return reinterpret_cast<Cell*>(base + align(sizeof(Header)))[i]; }
+
+	void map(int fd) {
+		auto address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (address == MAP_FAILED) {
+			error("Couldn't map shared memory " + name + ": " + strerror(errno));
+		}
+		base = static_cast<char*>(address);
+	}
+private:
+	std::string name;
+	bool owner;
+	size_t size = 0;
+	char* base = nullptr;
+};
+
+// Renderer side of the shading service. Thread safe; a request is shaded
+// by
+//
+//   auto slot = client.acquire();
+//   ... write up to getMaxPoints() points to client.getP(slot) and getN(slot) ...
+//   client.submit(slot, "plastic", count, block, layout.getSize());
+//   if (client.wait(slot)) ... read client.getCi(slot) ...
+//   client.release(slot);
+class ShadingClient {
+public:
+	ShadingClient(const std::string& name) : segment(name) {}
+public:
+	// A free request slot, waits for one if all are in use.
+	uint32_t acquire() {
+		auto slots = segment.getSlotCount();
+		for (;;) {
+			for (uint32_t i = 0; i < slots; ++i) {
+				auto index = next.fetch_add(1, std::memory_order_relaxed) & (slots - 1);
+				auto expected = uint32_t(ShadingSegment::Slot::Free);
+				if (segment.getSlot(index).state.compare_exchange_strong(expected, ShadingSegment::Slot::Writing)) {
+					return index;
+				}
+			}
+			std::this_thread::yield();
+		}
+	}
+
+	float* getP(uint32_t slot) { return segment.getP(slot); }
+	float* getN(uint32_t slot) { return segment.getN(slot); }
+	float* getCi(uint32_t slot) { return segment.getCi(slot); }
+	size_t getStride() { return segment.getStride(); }
+	size_t getMaxPoints() { return segment.getStride(); }
+
+	// block is bytes long, the request fails if that isn't the size of the
+	// parameter blocks of shader. Without a block the defaults are used.
+	void submit(uint32_t index, const std::string& shader, uint32_t count, const void* block = nullptr, size_t bytes = 0) {
+		auto& slot = segment.getSlot(index);
+		strncpy(slot.shader, shader.c_str(), sizeof(slot.shader));
+		slot.count = std::min<size_t>(count, getMaxPoints());
+		slot.parameterBytes = block ? bytes : 0;
+		if (block) {
+			memcpy(slot.parameters, block, std::min<size_t>(bytes, sizeof(slot.parameters)));
+		}
+		slot.state.store(ShadingSegment::Slot::Queued, std::memory_order_release);
+
+		segment.push(index);
+		auto& header = segment.getHeader();
+		header.posted.fetch_add(1);
+		ShadingSegment::wake(header.posted, 1);
+	}
+
+	// Wait for the request in slot, false if the service doesn't know its
+	// shader, is stopping or died. Sleeps are timed, so a service that dies
+	// without waking the client is noticed.
+	bool wait(uint32_t index) {
+		auto& slot = segment.getSlot(index);
+		for (;;) {
+			auto state = slot.state.load(std::memory_order_acquire);
+			if (state == ShadingSegment::Slot::Done || state == ShadingSegment::Slot::Failed) {
+				return state == ShadingSegment::Slot::Done;
+			}
+			if (segment.getHeader().stopping.load() || !segment.isServiceAlive()) {
+				return false;
+			}
+			ShadingSegment::wait(slot.state, state, 100);
+		}
+	}
+
+	void release(uint32_t index) {
+		segment.getSlot(index).state.store(ShadingSegment::Slot::Free, std::memory_order_release);
+	}
+private:
+	ShadingSegment segment;
+	std::atomic<uint32_t> next{ 0 };
+};
+
+#endif
+
+}
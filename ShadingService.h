@@ -0,0 +1,142 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ErrorHandler.h"
+#include "ExecutionEnvironment.h"
+#include "ParameterLayout.h"
+#include "ShadingClient.h"
+#include "global.h"
+
+namespace shmoptix {
+
+#if defined(__linux__)
+
+// Long running shading daemon. Renderer processes on the node submit
+// grids through the shared memory segment /name, see ShadingClient.h;
+// worker threads shade each request in place with the grid entry point of
+// its shader and the parameter block of the request, so one warm process
+// serves them all without any of them paying for JIT startup. Blocks are
+// copied into the segment, so shaders with varying parameters, which are
+// pointers to planes, can't be served. Every request is shaded by one worker, requests
+// run in parallel.
+//
+// Shaders have to be added before start.
+class ShadingService : public ErrorHandler {
+public:
+	ShadingService(const std::string& name, ExecutionEnvironment& executionEnvironment, unsigned lanes, unsigned slots = 64, unsigned maxPoints = 4096)
+		: segment(name, slots, maxPoints), executionEnvironment(executionEnvironment), lanes(lanes) {}
+
+	~ShadingService() {
+		stop();
+	}
+public:
+	// Serve requests for shader, compiled into the execution environment,
+	// whose parameter blocks are laid out by layout.
+	void add(const std::string& shaderName, const ParameterLayout& layout) {
+		for (auto& parameter : layout.getParameters()) {
+			if (parameter.varying) {
+				error("Can't serve " + shaderName + " with varying parameter " + parameter.name);
+			}
+		}
+		if (layout.getSize() > ShadingSegment::maxParameterBytes) {
+			error("Parameters of " + shaderName + " don't fit a request");
+		}
+		shaders[shaderName] = Shader{ executionEnvironment.getGridFunction(shaderName), executionEnvironment.getDefaults(shaderName), layout.getSize() };
+	}
+
+	void start(unsigned threads) {
+		for (unsigned i = 0; i < threads; ++i) {
+			workers.emplace_back([this] { work(); });
+		}
+	}
+
+	// Block until the service is stopped.
+	void join() {
+		for (auto& worker : workers) {
+			worker.join();
+		}
+		workers.clear();
+	}
+
+	// Finish the requests being shaded and fail the queued ones, waking
+	// their clients.
+	void stop() {
+		auto& header = segment.getHeader();
+		header.stopping = 1;
+		header.posted.fetch_add(1);
+		ShadingSegment::wake(header.posted);
+		join();
+		for (uint32_t i = 0; i < segment.getSlotCount(); ++i) {
+			auto& slot = segment.getSlot(i);
+			auto expected = uint32_t(ShadingSegment::Slot::Queued);
+			slot.state.compare_exchange_strong(expected, ShadingSegment::Slot::Failed, std::memory_order_release);
+			ShadingSegment::wake(slot.state);
+		}
+	}
+
+	uint64_t getRequestCount() { return requests; }
+	uint64_t getPointCount() { return points; }
+private:
+	void work() {
+		auto context = executionEnvironment.createShadingContext();
+		auto& header = segment.getHeader();
+		while (!header.stopping.load()) {
+			auto posted = header.posted.load();
+			uint32_t index;
+			if (segment.pop(index)) {
+				shade(index, context);
+			}
+			else {
+				ShadingSegment::wait(header.posted, posted);
+			}
+		}
+	}
+
+	void shade(uint32_t index, ShadingContext& context) {
+		auto& slot = segment.getSlot(index);
+		slot.state.store(ShadingSegment::Slot::Shading, std::memory_order_relaxed);
+		auto it = shaders.find(std::string(slot.shader, strnlen(slot.shader, sizeof(slot.shader))));
+		const void* block = nullptr;
+		if (it != shaders.end()) {
+			block = !slot.parameterBytes ? it->second.defaults : slot.parameterBytes == it->second.parameterBytes ? slot.parameters : nullptr;
+		}
+		if (!block) {
+			slot.state.store(ShadingSegment::Slot::Failed, std::memory_order_release);
+		}
+		else {
+			// Planes are padded to 16 points, so whole blocks of lanes fit
+			size_t count = std::min<size_t>(slot.count, segment.getStride());
+			auto end = (count + lanes - 1) / lanes * lanes;
+			it->second.function(&context, block, segment.getP(index), segment.getN(index), segment.getCi(index), 0, end, segment.getStride());
+			++requests;
+			points += count;
+			slot.state.store(ShadingSegment::Slot::Done, std::memory_order_release);
+		}
+		ShadingSegment::wake(slot.state);
+	}
+private:
+	ShadingSegment segment;
+	ExecutionEnvironment& executionEnvironment;
+	unsigned lanes;
+	struct Shader {
+		ExecutionEnvironment::GridBlockFunction function;
+		const void* defaults;
+		size_t parameterBytes;
+	};
+
+	std::map<std::string, Shader> shaders;
+	std::vector<std::thread> workers;
+	std::atomic<uint64_t> requests{ 0 };
+	std::atomic<uint64_t> points{ 0 };
+};
+
+#endif
+
+}
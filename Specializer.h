@@ -0,0 +1,208 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "AST.h"
+#include "BuiltinLibrary.h"
+#include "CodeCache.h"
+#include "Compiler.h"
+#include "ExecutionEnvironment.h"
+#include "Grid.h"
+#include "ObjectCache.h"
+#include "ThreadPool.h"
+#include "global.h"
+
+namespace shmoptix {
+
+// Compiles variants of a shader with some parameters baked in as
+// constants, so LLVM can fold them. A variant has the same signature as the
+// generic entry points, so callers can switch between the two freely.
+//
+// Variants are compiled on a background thread; until one is ready the
+// generic entry points are called instead. The code of at most budget bytes
+// of variants is kept, see CodeCache: the least recently used ones are
+// freed and compiled again, or loaded from the object cache, when they are
+// asked for again. With the lazy backend variants can't be freed and are
+// kept. With a cache, variants of the shader with cache key moduleKey are
+// shared across runs.
+class Specializer {
+public:
+	Specializer(SurfaceShaderAST& shader, BuiltinLibrary& builtins, ExecutionEnvironment& executionEnvironment,
+		unsigned lanes, unsigned optLevel, ShaderObjectCache* cache = nullptr, const std::string& moduleKey = "", uint64_t budget = 64 << 20)
+		: shader(shader), builtins(builtins), executionEnvironment(executionEnvironment),
+		  lanes(lanes), optLevel(optLevel), cache(cache), moduleKey(moduleKey), codeCache(budget) {}
+
+	~Specializer() {
+		// Finish pending compiles before the shader goes away
+		compiler.reset();
+	}
+public:
+	// Run the scalar entry point of the variant for values if it is
+	// compiled, the generic one otherwise, and request the variant. Both
+	// read the parameter block, the variant ignores the baked in values.
+	// Returns whether the variant ran.
+	bool run(const ParameterValues& values, ShadingContext& context, const void* block) {
+		CodeCache::Guard guard(codeCache.getEpochs());
+		auto variant = getVariant(values);
+		if (variant && executionEnvironment.isLazy()) {
+			executionEnvironment.runFunction(variant->name, context, block);
+			return true;
+		}
+		if (auto function = variant ? codeCache.lookup(variant->key, variant->name + "_block") : 0) {
+			executionEnvironment.runFunction(reinterpret_cast<ExecutionEnvironment::BlockFunction>(function), context, block);
+			return true;
+		}
+		executionEnvironment.runFunction(shader.getName(), context, block);
+		return false;
+	}
+
+	// The same for the grid entry point, on all cores, with a block for
+	// the grid, e.g. a GridBlock.
+	bool shade(const ParameterValues& values, Grid& grid, const void* block) {
+		CodeCache::Guard guard(codeCache.getEpochs());
+		auto variant = getVariant(values);
+		if (variant && executionEnvironment.isLazy()) {
+			executionEnvironment.shade(variant->name, grid, block);
+			return true;
+		}
+		if (auto function = variant ? codeCache.lookup(variant->key, variant->name + "_grid_block") : 0) {
+			executionEnvironment.shade(reinterpret_cast<ExecutionEnvironment::GridBlockFunction>(function), grid, block);
+			return true;
+		}
+		executionEnvironment.shade(shader.getName(), grid, block);
+		return false;
+	}
+
+	// Block until every requested variant is compiled.
+	void wait() {
+		std::unique_lock<std::mutex> lock(mutex);
+		compiled.wait(lock, [this] { return pending == 0; });
+	}
+
+	void printStatistics(llvm::raw_ostream& out) {
+		std::lock_guard<std::mutex> lock(mutex);
+		out << "Specializer: " << variants.size() << " variants, " << compiles << " compiled" << newline;
+		codeCache.printStatistics(out);
+	}
+private:
+	struct Variant {
+		std::string key;
+		std::string name;
+		std::atomic<bool> ready{ false };
+	};
+
+	// The variant for values if it is compiled, null otherwise.
+	std::shared_ptr<Variant> getVariant(const ParameterValues& values) {
+		auto key = getKey(values);
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = variants.find(key);
+		if (it == variants.end()) {
+			request(key, values);
+			return nullptr;
+		}
+		return it->second->ready ? it->second : nullptr;
+	}
+
+	void request(const std::string& key, const ParameterValues& values) {
+		auto variant = std::make_shared<Variant>();
+		variant->key = key;
+		variant->name = shader.getName() + "_" + key.substr(0, 12);
+		variants[key] = variant;
+		++pending;
+		compiler->submit([this, variant, values] { compile(*variant, values); });
+	}
+
+	std::string getKey(const ParameterValues& values) {
+		llvm::MD5 hash;
+		hash.update(shader.getName());
+		for (auto& value : values) {
+			hash.update(value.first);
+			hash.update(llvm::ArrayRef<uint8_t>(reinterpret_cast<const uint8_t*>(value.second.data()), value.second.size() * sizeof(float)));
+		}
+		llvm::MD5::MD5Result result;
+		hash.final(result);
+		llvm::SmallString<32> key;
+		llvm::MD5::stringifyResult(result, key);
+		return key.str().str();
+	}
+
+	void compile(Variant& variant, const ParameterValues& values) {
+
+		std::string key;
+		std::unique_ptr<llvm::MemoryBuffer> object;
+		if (cache && !moduleKey.empty()) {
+			key = cache->getKey({ moduleKey, getDefaultTarget().getKey(), variant.key });
+			object = cache->load(key);
+		}
+		if (!object) {
+			Compiler compiler(variant.name, builtins, optLevel);
+			compiler.codegen(shader, lanes, values, variant.name);
+			compiler.link();
+			if (executionEnvironment.isLazy()) {
+				executionEnvironment.addModule(compiler.takeModule());
+			}
+			else {
+				compiler.optimize();
+				object = compiler.emitObject();
+				if (!key.empty()) {
+					cache->store(key, object->getMemBufferRef());
+				}
+			}
+		}
+
+		std::vector<std::string> evicted;
+		if (executionEnvironment.isLazy()) {
+			if (object) {
+				executionEnvironment.addObject(std::move(object));
+			}
+			executionEnvironment.getFunctionAddress(variant.name + "_block");
+			executionEnvironment.getFunctionAddress(variant.name + "_grid_block");
+		}
+		else {
+			auto code = executionEnvironment.addReplaceableObject(std::move(object));
+			if (!code->engine->getFunctionAddress(variant.name + "_grid_block")) {
+				llvm::outs() << "Unknown function: " << variant.name << "_grid_block" << newline;
+				exit(EXIT_FAILURE);
+			}
+			evicted = codeCache.insert(variant.key, std::move(code));
+		}
+		variant.ready = true;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto& key : evicted) {
+			variants.erase(key);
+		}
+		++compiles;
+		if (--pending == 0) {
+			compiled.notify_all();
+		}
+	}
+private:
+	SurfaceShaderAST& shader;
+	BuiltinLibrary& builtins;
+	ExecutionEnvironment& executionEnvironment;
+	unsigned lanes;
+	unsigned optLevel;
+	ShaderObjectCache* cache;
+	std::string moduleKey;
+	CodeCache codeCache;
+
+	std::mutex mutex;
+	std::condition_variable compiled;
+	std::unordered_map<std::string, std::shared_ptr<Variant>> variants;
+	unsigned pending = 0;
+	unsigned compiles = 0;
+	std::unique_ptr<ThreadPool> compiler = std::make_unique<ThreadPool>(1);
+};
+
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "global.h"
+
+namespace shmoptix {
+
+// Wall time of each compile phase and counters (tokens, AST nodes, IR
+// instructions, code bytes) for one shader. Phases run one after the
+// other: begin() ends the running phase and starts the next one.
+class Statistics {
+public:
+	struct Phase {
+		std::string name;
+		double seconds;
+	};
+	struct Counter {
+		std::string name;
+		uint64_t value;
+	};
+public:
+	Statistics(const std::string& shader = "") : shader(shader) {}
+public:
+	void begin(const std::string& phase) {
+		end();
+		running = phase;
+		start = std::chrono::steady_clock::now();
+	}
+
+	void end() {
+		if (!running.empty()) {
+			addTime(running, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+			running.clear();
+		}
+	}
+
+	void addTime(const std::string& phase, double seconds) {
+		for (auto& p : phases) {
+			if (p.name == phase) {
+				p.seconds += seconds;
+				return;
+			}
+		}
+		phases.push_back({ phase, seconds });
+	}
+
+	// Move seconds of phase into part, listed right before it. Used where
+	// one phase drives another, like the parser pulling tokens from the
+	// lexer.
+	void split(const std::string& phase, const std::string& part, double seconds) {
+		for (auto it = phases.begin(); it != phases.end(); ++it) {
+			if (it->name == phase) {
+				it->seconds -= seconds;
+				phases.insert(it, { part, seconds });
+				return;
+			}
+		}
+	}
+
+	double getTime(const std::string& phase) {
+		for (auto& p : phases) {
+			if (p.name == phase) {
+				return p.seconds;
+			}
+		}
+		return 0;
+	}
+
+	double getTotalTime() {
+		double total = 0;
+		for (auto& p : phases) {
+			total += p.seconds;
+		}
+		return total;
+	}
+
+	void setCounter(const std::string& name, uint64_t value) {
+		for (auto& c : counters) {
+			if (c.name == name) {
+				c.value = value;
+				return;
+			}
+		}
+		counters.push_back({ name, value });
+	}
+
+	uint64_t getCounter(const std::string& name) {
+		for (auto& c : counters) {
+			if (c.name == name) {
+				return c.value;
+			}
+		}
+		return 0;
+	}
+
+	const std::vector<Phase>& getPhases() { return phases; }
+	const std::vector<Counter>& getCounters() { return counters; }
+
+	void setShader(const std::string& name) { shader = name; }
+	const std::string& getShader() { return shader; }
+
+	void print(llvm::raw_ostream& out) {
+		out << "Compile statistics for " << shader << newline;
+		for (auto& p : phases) {
+			out << llvm::format("  %-26s %10.3f ms", p.name.c_str(), p.seconds * 1e3) << newline;
+		}
+		const char* total = "total";
+		out << llvm::format("  %-26s %10.3f ms", total, getTotalTime() * 1e3) << newline;
+		for (auto& c : counters) {
+			out << llvm::format("  %-26s %10llu", c.name.c_str(), (unsigned long long)c.value) << newline;
+		}
+	}
+
+	void printJSON(llvm::raw_ostream& out) {
+		out << "{ \"shader\": \"" << shader << "\", \"phases\": {";
+		for (size_t i = 0; i < phases.size(); ++i) {
+			out << (i ? ", " : " ") << '"' << phases[i].name << "\": " << llvm::format("%.9f", phases[i].seconds);
+		}
+		out << " }, \"counters\": {";
+		for (size_t i = 0; i < counters.size(); ++i) {
+			out << (i ? ", " : " ") << '"' << counters[i].name << "\": " << counters[i].value;
+		}
+		out << " } }" << newline;
+	}
+private:
+	std::string shader;
+	std::vector<Phase> phases;
+	std::vector<Counter> counters;
+	std::string running;
+	std::chrono::steady_clock::time_point start;
+};
+
+uint64_t getInstructionCount(const llvm::Module& module) {
+	uint64_t count = 0;
+	for (auto& function : module) {
+		for (auto& block : function) {
+			count += block.size();
+		}
+	}
+	return count;
+}
+
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseMapInfo.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace shmoptix {
+
+// An identifier interned once, by the Lexer: symbols with the same name
+// are the same pointer, so symbol tables hash and compare them without
+// looking at the characters. Interned names are shared by all threads and
+// live until the process exits.
+class Symbol {
+public:
+	Symbol() {}
+	explicit Symbol(llvm::StringRef name) {
+		std::lock_guard<std::mutex> lock(getMutex());
+		entry = insert(name);
+	}
+public:
+	// Many names under one lock.
+	static std::vector<Symbol> intern(llvm::ArrayRef<llvm::StringRef> names) {
+		std::vector<Symbol> symbols(names.size());
+		std::lock_guard<std::mutex> lock(getMutex());
+		for (size_t i = 0; i < names.size(); ++i) {
+			symbols[i].entry = insert(names[i]);
+		}
+		return symbols;
+	}
+
+	llvm::StringRef getString() const { return entry ? entry->getKey() : llvm::StringRef(); }
+	std::string str() const { return getString().str(); }
+
+	bool operator==(Symbol other) const { return entry == other.entry; }
+	bool operator!=(Symbol other) const { return entry != other.entry; }
+	bool operator<(Symbol other) const { return entry < other.entry; }
+
+	const void* getOpaqueValue() const { return entry; }
+	static Symbol getFromOpaqueValue(const void* value) {
+		Symbol symbol;
+		symbol.entry = static_cast<const Entry*>(value);
+		return symbol;
+	}
+private:
+	typedef llvm::StringMapEntry<char> Entry;
+
+	static std::mutex& getMutex() {
+		static std::mutex mutex;
+		return mutex;
+	}
+
+	static const Entry* insert(llvm::StringRef name) {
+		static llvm::StringMap<char, llvm::BumpPtrAllocator> names;
+		return &*names.insert(std::make_pair(name, char())).first;
+	}
+private:
+	const Entry* entry = nullptr;
+};
+
+llvm::raw_ostream& operator<<(llvm::raw_ostream& out, Symbol symbol) {
+	return out << symbol.getString();
+}
+
+// Names the compiler itself refers to, interned once at startup so
+// analysis and codegen compare them without taking the lock.
+namespace names {
+const Symbol P("P"), N("N"), Ci("Ci"), L("L"), Cl("Cl"), dot("dot");
+}
+
+}
+
+namespace llvm {
+
+template <> struct DenseMapInfo<shmoptix::Symbol> {
+	static shmoptix::Symbol getEmptyKey() {
+		return shmoptix::Symbol::getFromOpaqueValue(DenseMapInfo<const void*>::getEmptyKey());
+	}
+	static shmoptix::Symbol getTombstoneKey() {
+		return shmoptix::Symbol::getFromOpaqueValue(DenseMapInfo<const void*>::getTombstoneKey());
+	}
+	static unsigned getHashValue(shmoptix::Symbol symbol) {
+		return DenseMapInfo<const void*>::getHashValue(symbol.getOpaqueValue());
+	}
+	static bool isEqual(shmoptix::Symbol a, shmoptix::Symbol b) {
+		return a == b;
+	}
+};
+
+}
+
+namespace shmoptix {
+
+// Values of symbols in nested lexical scopes, kept in one flat hash table:
+// a definition records the value it shadows, and leaving its scope puts
+// that back. Values are pointers, null for undefined symbols. Definitions
+// outside any scope are permanent.
+template <typename T>
+class SymbolTable {
+public:
+	void enterScope() {
+		scopes.push_back(shadowed.size());
+	}
+
+	void exitScope() {
+		for (auto i = shadowed.size(); i-- > scopes.back();) {
+			auto& definition = shadowed[i];
+			if (definition.second) {
+				values[definition.first] = definition.second;
+			}
+			else {
+				values.erase(definition.first);
+			}
+		}
+		shadowed.resize(scopes.back());
+		scopes.pop_back();
+	}
+
+	void insert(Symbol symbol, T value) {
+		auto& slot = values[symbol];
+		if (!scopes.empty()) {
+			shadowed.emplace_back(symbol, slot);
+		}
+		slot = value;
+	}
+
+	T lookup(Symbol symbol) const {
+		return values.lookup(symbol);
+	}
+private:
+	llvm::DenseMap<Symbol, T> values;
+	std::vector<std::pair<Symbol, T>> shadowed;
+	std::vector<size_t> scopes;
+};
+
+}
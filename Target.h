@@ -0,0 +1,135 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/Host.h"
+
+namespace shmoptix {
+
+// A CPU and feature set to generate code for, e.g. "+avx2" or "-avx512f".
+// Grid code is as wide as the widest vector unit of the features.
+struct CodeTarget {
+	std::string name;
+	std::string cpu;
+	std::vector<std::string> features;
+	// Bits of the feature word of __cpu_model, the CPU detection of libgcc
+	// and compiler-rt behind __builtin_cpu_supports, that code for the
+	// target needs, see ShaderLibrary.
+	uint32_t cpuModelFeatures = 0;
+
+	bool has(const std::string& feature) const {
+		return std::find(features.begin(), features.end(), "+" + feature) != features.end();
+	}
+
+	// Whether code for target runs here.
+	bool supports(const CodeTarget& target) const {
+		return std::all_of(target.features.begin(), target.features.end(), [&](const std::string& feature) {
+			return feature[0] != '+' || has(feature.substr(1));
+		});
+	}
+
+	unsigned getLanes() const {
+		if (has("avx512f"))
+			return 16;
+		if (has("avx"))
+			return 8;
+		return 4;
+	}
+
+	std::string getFeatureString() const {
+		std::string string;
+		for (auto& feature : features) {
+			string += (string.empty() ? "" : ",") + feature;
+		}
+		return string;
+	}
+
+	// For cache keys.
+	std::string getKey() const {
+		return cpu + " " + getFeatureString();
+	}
+
+	// The entry points of a variant of shader name for this target.
+	std::string getEntryName(const std::string& shaderName) const {
+		return shaderName + "__" + name;
+	}
+
+	// Compile function for this target instead of the one of the module.
+	void apply(llvm::Function& function) const {
+		function.addFnAttr("target-cpu", cpu);
+		function.addFnAttr("target-features", getFeatureString());
+	}
+};
+
+CodeTarget getHostTarget() {
+	CodeTarget target{ "host", llvm::sys::getHostCPUName().str() };
+	llvm::StringMap<bool> features;
+	if (llvm::sys::getHostCPUFeatures(features)) {
+		for (auto& feature : features) {
+			target.features.push_back((feature.getValue() ? "+" : "-") + feature.getKey().str());
+		}
+		std::sort(target.features.begin(), target.features.end());
+	}
+	return target;
+}
+
+// The target of JIT compiled code, the host unless overridden with
+// setDefaultTarget.
+CodeTarget& getDefaultTarget() {
+	static CodeTarget target = getHostTarget();
+	return target;
+}
+
+// Set before anything is compiled. An empty cpu keeps the host's; with a
+// cpu but no features LLVM picks the features of the cpu, and grid code
+// is 4 lanes wide.
+void setDefaultTarget(const std::string& cpu, const std::string& featureString) {
+	auto& target = getDefaultTarget();
+	if (!cpu.empty()) {
+		target.cpu = cpu;
+		target.features.clear();
+	}
+	llvm::SmallVector<llvm::StringRef, 8> features;
+	llvm::StringRef(featureString).split(features, ',', -1, false);
+	for (auto feature : features) {
+		target.features.erase(std::remove_if(target.features.begin(), target.features.end(), [&](const std::string& f) {
+			return llvm::StringRef(f).drop_front() == feature.drop_front();
+		}), target.features.end());
+		target.features.push_back(feature.str());
+	}
+}
+
+// Targets of multi-versioned code, oldest first, each a superset of the
+// one before: every x86-64 machine of a farm runs the first, and picks the
+// newest it supports. Empty on other architectures.
+std::vector<CodeTarget> getDispatchTargets() {
+	if (llvm::Triple(llvm::sys::getProcessTriple()).getArch() != llvm::Triple::x86_64) {
+		return {};
+	}
+	const uint32_t popcnt = 1 << 2, sse4_2 = 1 << 8, avx2 = 1 << 10, fma = 1 << 14, avx512f = 1 << 15;
+	return {
+		{ "sse42", "x86-64", { "+popcnt", "+sse4.2" }, popcnt | sse4_2 },
+		{ "avx2", "x86-64", { "+avx", "+avx2", "+fma", "+popcnt", "+sse4.2" }, popcnt | sse4_2 | avx2 | fma },
+		{ "avx512", "x86-64", { "+avx", "+avx2", "+avx512f", "+fma", "+popcnt", "+sse4.2" }, popcnt | sse4_2 | avx2 | fma | avx512f },
+	};
+}
+
+// The newest of targets the default target runs, null if none.
+const CodeTarget* selectDispatchTarget(const std::vector<CodeTarget>& targets) {
+	const CodeTarget* selected = nullptr;
+	for (auto& target : targets) {
+		if (getDefaultTarget().supports(target)) {
+			selected = &target;
+		}
+	}
+	return selected;
+}
+
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace shmoptix {
+
+// Fixed set of worker threads, one per core by default.
+class ThreadPool {
+public:
+	ThreadPool(unsigned threads = std::max(1u, std::thread::hardware_concurrency())) {
+		for (unsigned i = 0; i < threads; ++i) {
+			workers.emplace_back([this] { work(); });
+		}
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wakeup.notify_all();
+		for (auto& worker : workers) {
+			worker.join();
+		}
+	}
+public:
+	void submit(std::function<void()> task) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			tasks.push_back(std::move(task));
+		}
+		wakeup.notify_one();
+	}
+
+	// Call function(begin, end) for consecutive chunks of [0, count) on all
+	// workers and the calling thread, and return when every chunk is done.
+	// Chunks are handed out through an atomic counter, so threads that run
+	// ahead simply take more of them.
+	void parallelFor(size_t count, size_t chunk, const std::function<void(size_t, size_t)>& function) {
+
+		std::atomic<size_t> next{ 0 };
+		auto run = [&] {
+			for (size_t begin = next.fetch_add(chunk); begin < count; begin = next.fetch_add(chunk)) {
+				function(begin, std::min(begin + chunk, count));
+			}
+		};
+
+		size_t helpers = std::min(workers.size(), (count + chunk - 1) / chunk);
+		std::mutex doneMutex;
+		std::condition_variable doneCondition;
+		size_t remaining = helpers;
+		for (size_t i = 0; i < helpers; ++i) {
+			submit([&] {
+				run();
+				std::lock_guard<std::mutex> lock(doneMutex);
+				if (--remaining == 0) {
+					doneCondition.notify_one();
+				}
+			});
+		}
+		run();
+		std::unique_lock<std::mutex> lock(doneMutex);
+		doneCondition.wait(lock, [&] { return remaining == 0; });
+	}
+
+	unsigned getThreadCount() {
+		return workers.size();
+	}
+private:
+	void work() {
+		for (;;) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wakeup.wait(lock, [this] { return stopping || !tasks.empty(); });
+				if (stopping && tasks.empty()) {
+					return;
+				}
+				task = std::move(tasks.front());
+				tasks.pop_front();
+			}
+			task();
+		}
+	}
+private:
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	bool stopping = false;
+};
+
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "llvm/IR/LLVMContext.h"
+
+#include "AST.h"
+#include "BuiltinLibrary.h"
+#include "Bytecode.h"
+#include "Compiler.h"
+#include "ErrorHandler.h"
+#include "ExecutionEnvironment.h"
+#include "Grid.h"
+#include "Optimizer.h"
+#include "ParameterLayout.h"
+#include "ThreadPool.h"
+#include "global.h"
+
+namespace shmoptix {
+
+// Tiered execution for interactive use. A shader starts out in the
+// bytecode interpreter, which is ready as soon as it is parsed, and counts
+// the points it shades. Past threshold points it is compiled on a
+// background thread and its grid function is swapped in atomically;
+// chunks of a grid being shaded pick it up as soon as it lands. Shaders
+// the interpreter can't run, e.g. with control flow, start out compiled.
+//
+// Shaders have to be added before shading starts.
+class TieredShaders : public ErrorHandler {
+public:
+	TieredShaders(ExecutionEnvironment& executionEnvironment, BuiltinLibrary& builtins, unsigned lanes, unsigned optLevel, uint64_t threshold)
+		: executionEnvironment(executionEnvironment), builtins(builtins), lanes(lanes), optLevel(optLevel), threshold(threshold) {
+
+		// The interpreter calls the builtins, compiled once for all shaders
+		llvm::LLVMContext context;
+		auto library = builtins.load(context);
+		Optimizer optimizer(optLevel);
+		optimizer.run(*library);
+		executionEnvironment.addObject(optimizer.emitObject(*library));
+	}
+
+	~TieredShaders() {
+		// Finish pending compiles before the shaders go away
+		background.reset();
+	}
+public:
+	void add(std::unique_ptr<SurfaceShaderAST> shader) {
+		auto tiered = std::make_unique<Shader>();
+		tiered->bytecode = std::make_unique<Bytecode>(lanes, [this](const std::string& name) {
+			return executionEnvironment.getFunctionAddress(name);
+		});
+		shader->compileBytecode(*tiered->bytecode);
+		tiered->layout = shader->getParameterLayout();
+		tiered->shader = std::move(shader);
+		if (!tiered->bytecode->isSupported()) {
+			tiered->bytecode.reset();
+			tiered->compiling = true;
+			compileNow(*tiered);
+		}
+		shaders[tiered->shader->getName()] = std::move(tiered);
+	}
+
+	void shade(const std::string& name, Grid& grid, ThreadPool& pool, size_t chunk = 4096) {
+
+		auto& shader = getShader(name);
+		std::vector<float> lights;
+		auto context = executionEnvironment.createShadingContext(grid, lights);
+		GridBlock block(shader.layout, grid);
+		chunk = (chunk + lanes - 1) / lanes * lanes;
+		pool.parallelFor(grid.getCount(), chunk, [&](size_t begin, size_t end) {
+			if (auto function = shader.function.load(std::memory_order_acquire)) {
+				executionEnvironment.runGrid(function, grid, context, block.get(), begin, end);
+				return;
+			}
+			shader.bytecode->run(&context, grid, block.get(), begin, end);
+			if ((shader.points += end - begin) >= threshold && !shader.compiling.exchange(true)) {
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					++pending;
+				}
+				background->submit([this, &shader] { compile(shader); });
+			}
+		});
+	}
+
+	bool isCompiled(const std::string& name) {
+		return getShader(name).function.load() != nullptr;
+	}
+
+	// Block until every requested compile is done.
+	void wait() {
+		std::unique_lock<std::mutex> lock(mutex);
+		compiled.wait(lock, [this] { return pending == 0; });
+	}
+private:
+	struct Shader {
+		std::unique_ptr<SurfaceShaderAST> shader;
+		std::unique_ptr<Bytecode> bytecode;
+		ParameterLayout layout;
+		std::atomic<uint64_t> points{ 0 };
+		std::atomic<bool> compiling{ false };
+		std::atomic<ExecutionEnvironment::GridBlockFunction> function{ nullptr };
+	};
+
+	Shader& getShader(const std::string& name) {
+		auto it = shaders.find(name);
+		if (it == shaders.end()) {
+			error("Unknown shader: " + name);
+		}
+		return *it->second;
+	}
+
+	void compileNow(Shader& shader) {
+		auto& name = shader.shader->getName();
+		Compiler compiler(name, builtins, optLevel);
+		compiler.codegen(*shader.shader, lanes);
+		compiler.link();
+		compiler.optimize();
+		executionEnvironment.addObject(compiler.emitObject());
+		shader.function.store(executionEnvironment.getGridFunction(name), std::memory_order_release);
+	}
+
+	// On the background thread.
+	void compile(Shader& shader) {
+		compileNow(shader);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--pending == 0) {
+			compiled.notify_all();
+		}
+	}
+private:
+	ExecutionEnvironment& executionEnvironment;
+	BuiltinLibrary& builtins;
+	unsigned lanes;
+	unsigned optLevel;
+	uint64_t threshold;
+	std::map<std::string, std::unique_ptr<Shader>> shaders;
+	std::mutex mutex;
+	std::condition_variable compiled;
+	unsigned pending = 0;
+	std::unique_ptr<ThreadPool> background = std::make_unique<ThreadPool>(1);
+};
+
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <initializer_list>
+
+#include "llvm/ADT/DenseSet.h"
+
+#include "Symbol.h"
+
+namespace shmoptix {
+
+// Uniform/varying state of the variables of a shader. As in RenderMan SL,
+// shader parameters are uniform unless declared varying, the globals (P,
+// N, Ci) are always varying, and so is every variable the shader
+// assigns: uniform expressions are hoisted out of the point loop, where
+// they would read the variable before the assignment. The analysis is flow
+// insensitive: it is rerun until no variable changes.
+class UniformAnalysis {
+public:
+	UniformAnalysis(std::initializer_list<Symbol> globals) {
+		for (auto global : globals) {
+			varyings.insert(global);
+		}
+	}
+public:
+	bool isVarying(Symbol name) {
+		return varyings.count(name) > 0;
+	}
+
+	void setVarying(Symbol name) {
+		if (varyings.insert(name).second) {
+			changed = true;
+		}
+	}
+
+	// Returns whether anything became varying since the last call.
+	bool hasChanged() {
+		bool result = changed;
+		changed = false;
+		return result;
+	}
+private:
+	llvm::DenseSet<Symbol> varyings;
+	bool changed = false;
+};
+
+}
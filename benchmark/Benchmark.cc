@@ -0,0 +1,217 @@
+// Shading throughput benchmark: compiles all shaders in parallel, one
+// Compiler per shader, then shades grids of increasing size with
+// increasing thread counts and reports points/s, ns/point and the speedup
+// over the first thread count.
+//
+//   shmoptix-benchmark [-points=1000,1000000] [-threads=1,8] [-generated=3]
+//                      [-json=results.json] shader.sl...
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/TargetSelect.h"
+
+#include "../BuiltinLibrary.h"
+#include "../CodeGen.h"
+#include "../Compiler.h"
+#include "../ExecutionEnvironment.h"
+#include "../Grid.h"
+#include "../ParameterLayout.h"
+#include "../ThreadPool.h"
+
+using namespace shmoptix;
+
+static llvm::cl::list<std::string> shaderFileNames(llvm::cl::Positional, llvm::cl::desc("<shader.sl>..."));
+static llvm::cl::list<unsigned> pointCounts("points", llvm::cl::desc("Grid sizes to shade, up to 100000000 (default 1K to 10M)"), llvm::cl::CommaSeparated);
+static llvm::cl::list<unsigned> threadCounts("threads", llvm::cl::desc("Thread counts to shade with (default 1, 2, 4, ... up to all cores)"), llvm::cl::CommaSeparated);
+static llvm::cl::opt<unsigned> generated("generated", llvm::cl::desc("Number of generated shaders of increasing size"), llvm::cl::init(3));
+static llvm::cl::opt<unsigned> repeat("repeat", llvm::cl::desc("Runs per measurement, the fastest counts"), llvm::cl::init(3));
+static llvm::cl::opt<unsigned> optLevel("O", llvm::cl::desc("Optimization level (default -O2)"), llvm::cl::Prefix, llvm::cl::init(2));
+static llvm::cl::opt<bool> lazy("lazy", llvm::cl::desc("Compile each shader on its first call"));
+static llvm::cl::opt<std::string> builtinsFileName("builtins", llvm::cl::desc("Builtin library bitcode"), llvm::cl::value_desc("filename"), llvm::cl::init(SHMOPTIX_BUILTINS));
+static llvm::cl::opt<std::string> jsonFileName("json", llvm::cl::desc("Also write the results as JSON"), llvm::cl::value_desc("filename"));
+
+struct Result {
+	std::string shader;
+	size_t points;
+	unsigned threads;
+	double seconds;
+	double speedup;
+};
+
+// A heavier shader: Kd * Cs times a chain of builtin calls.
+std::string generateShader(const std::string& name, unsigned terms) {
+	const char* calls[] = { "diffuse(N)", "normalize(N)", "specular(N, N, Kd)", "faceforward(N, N)" };
+	std::string source = "surface " + name + "(float Kd = 1, color Cs = 1)\n{\n\tCi = Kd * Cs";
+	for (unsigned i = 0; i < terms; ++i) {
+		source += std::string(" * ") + calls[i % 4];
+	}
+	return source + ";\n}\n";
+}
+
+void writeJSON(const std::string& fileName, const std::vector<Result>& results, unsigned lanes) {
+
+	std::error_code error;
+	llvm::raw_fd_ostream out(fileName, error, llvm::sys::fs::F_Text);
+	if (error) {
+		llvm::errs() << "Couldn't write " << fileName << ": " << error.message() << newline;
+		exit(EXIT_FAILURE);
+	}
+	out << "{\n";
+	out << "  \"version\": \"" << compilerVersion << "\",\n";
+	out << "  \"cpu\": \"" << llvm::sys::getHostCPUName() << "\",\n";
+	out << "  \"lanes\": " << lanes << ",\n";
+	out << "  \"optLevel\": " << optLevel << ",\n";
+	out << "  \"lazy\": " << (lazy ? "true" : "false") << ",\n";
+	out << "  \"results\": [\n";
+	for (size_t i = 0; i < results.size(); ++i) {
+		auto& result = results[i];
+		out << "    { \"shader\": \"" << result.shader << "\", \"points\": " << result.points
+			<< ", \"threads\": " << result.threads
+			<< ", \"seconds\": " << llvm::format("%.9f", result.seconds)
+			<< ", \"pointsPerSecond\": " << llvm::format("%.0f", result.points / result.seconds)
+			<< ", \"nsPerPoint\": " << llvm::format("%.4f", result.seconds * 1e9 / result.points)
+			<< ", \"speedup\": " << llvm::format("%.3f", result.speedup) << " }"
+			<< (i + 1 < results.size() ? ",\n" : "\n");
+	}
+	out << "  ]\n}\n";
+}
+
+int main(int argc, char** argv) {
+
+	llvm::InitializeNativeTarget();
+	llvm::InitializeNativeTargetAsmPrinter();
+
+	llvm::cl::ParseCommandLineOptions(argc, argv, "shmoptix shading throughput benchmark\n");
+	if (optLevel > 3) {
+		llvm::errs() << "Unknown optimization level -O" << optLevel << newline;
+		exit(EXIT_FAILURE);
+	}
+
+	std::vector<unsigned> points(pointCounts.begin(), pointCounts.end());
+	if (points.empty()) {
+		points = { 1000, 10000, 100000, 1000000, 10000000 };
+	}
+	std::vector<unsigned> threads(threadCounts.begin(), threadCounts.end());
+	if (threads.empty()) {
+		unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+		for (unsigned n = 1; n < cores; n *= 2) {
+			threads.push_back(n);
+		}
+		threads.push_back(cores);
+	}
+
+	// (name, source) of every shader, generated ones are compiled from memory
+	std::vector<std::pair<std::string, std::string>> shaders;
+	for (auto& fileName : shaderFileNames) {
+		auto file = llvm::MemoryBuffer::getFile(fileName);
+		if (!file) {
+			llvm::errs() << "Couldn't open " << fileName << newline;
+			exit(EXIT_FAILURE);
+		}
+		shaders.emplace_back(fileName, (*file)->getBuffer().str());
+	}
+	for (unsigned i = 0; i < generated; ++i) {
+		auto terms = 4u << i;
+		auto name = "generated" + std::to_string(terms);
+		shaders.emplace_back(name, generateShader(name, terms));
+	}
+
+	auto lanes = defaultGridLanes();
+	BuiltinLibrary builtins(builtinsFileName);
+	std::vector<Result> results;
+
+	llvm::outs() << compilerVersion << ", " << llvm::sys::getHostCPUName() << ", " << lanes << " lanes, -O" << optLevel << newline;
+
+	// With -lazy only parsing and codegen happen up front, the rest on
+	// the first shade of each shader.
+	std::vector<std::unique_ptr<llvm::MemoryBuffer>> objects(shaders.size());
+	std::vector<ShaderModule> modules(shaders.size());
+	std::vector<std::string> shaderNames(shaders.size());
+	std::vector<ParameterLayout> layouts(shaders.size());
+	auto start = std::chrono::steady_clock::now();
+	ThreadPool compilePool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+	compilePool.parallelFor(shaders.size(), 1, [&](size_t begin, size_t end) {
+		for (auto i = begin; i < end; ++i) {
+			Compiler compiler(shaders[i].first, builtins, optLevel);
+			if (lazy) {
+				auto shader = compiler.parse(shaders[i].second);
+				shaderNames[i] = shader->getName();
+				layouts[i] = shader->getParameterLayout();
+				compiler.codegen(*shader, lanes);
+				compiler.link();
+				modules[i] = compiler.takeModule();
+			}
+			else {
+				objects[i] = compiler.compile(shaders[i].second, lanes, shaderNames[i], layouts[i]);
+			}
+		}
+	});
+	ExecutionEnvironment executionEnvironment(optLevel, false, lazy);
+	for (size_t i = 0; i < shaders.size(); ++i) {
+		if (lazy) {
+			executionEnvironment.addModule(std::move(modules[i]));
+		}
+		else {
+			executionEnvironment.addObject(std::move(objects[i]));
+		}
+	}
+	executionEnvironment.finalize();
+	std::chrono::duration<double> compileSeconds = std::chrono::steady_clock::now() - start;
+	llvm::outs() << "Compiled " << shaders.size() << " shaders in " << llvm::format("%.3f", compileSeconds.count() * 1e3)
+		<< " ms on " << compilePool.getThreadCount() + 1 << " threads" << newline;
+
+	llvm::outs() << "shader                     points  threads       points/s   ns/point  speedup" << newline;
+
+	for (size_t s = 0; s < shaderNames.size(); ++s) {
+		auto& shaderName = shaderNames[s];
+		for (auto count : points) {
+			Grid grid(count, lanes);
+			grid.setUniform("Kd", { 1.f });
+			grid.setUniform("Cs", { 0.5f, 0.5f, 0.5f, 1.f });
+			grid.add("P", 4);
+			grid.add("N", 4);
+			grid.add("Ci", 4);
+			for (size_t i = 0; i < grid.getCount(); ++i) {
+				grid.set("P", i, shmoptix::Color{ 0.f, 0.f, 0.f, 1.f });
+				grid.set("N", i, shmoptix::Color{ 0.f, 0.f, 1.f, 0.f });
+			}
+			GridBlock block(layouts[s], grid);
+
+			double single = 0;
+			for (auto n : threads) {
+				ThreadPool pool(n - 1);
+				double best = 0;
+				for (unsigned run = 0; run < std::max(1u, unsigned(repeat)); ++run) {
+					auto start = std::chrono::steady_clock::now();
+					executionEnvironment.shade(shaderName, grid, block.get(), pool);
+					std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+					if (run == 0 || seconds.count() < best) {
+						best = seconds.count();
+					}
+				}
+				if (n == threads.front()) {
+					single = best;
+				}
+				Result result{ shaderName, count, n, best, single / best };
+				results.push_back(result);
+				llvm::outs() << llvm::format("%-20s %12u %8u %14.0f %10.3f %8.2f", shaderName.c_str(), count, n,
+					count / best, best * 1e9 / count, result.speedup) << newline;
+			}
+		}
+	}
+
+	if (!jsonFileName.empty()) {
+		writeJSON(jsonFileName, results, lanes);
+	}
+}
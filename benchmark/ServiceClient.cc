@@ -0,0 +1,179 @@
+// Stand-in renderer for the shading service: client threads submit grids
+// through shared memory and wait for them, and the request latency
+// percentiles and the throughput are reported.
+//
+//   shmoptix -serve=shmoptix shader.sl &
+//   shmoptix-service-client -service=shmoptix -shader=plastic
+//
+// With -local the shaders given are compiled and served in process, for
+// testing without a daemon:
+//
+//   shmoptix-service-client -local -points=256 -clients=4 shader.sl
+//
+// Requests to a daemon use the defaults of the shader, local ones its Kd
+// and Cs, if it has them, set as a renderer would.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/TargetSelect.h"
+
+#include "../BuiltinLibrary.h"
+#include "../CodeGen.h"
+#include "../Compiler.h"
+#include "../ExecutionEnvironment.h"
+#include "../ParameterLayout.h"
+#include "../ShadingClient.h"
+#include "../ShadingService.h"
+
+using namespace shmoptix;
+
+static llvm::cl::list<std::string> shaderFileNames(llvm::cl::Positional, llvm::cl::desc("<shader.sl>..."));
+static llvm::cl::opt<std::string> serviceName("service", llvm::cl::desc("Shared memory name of the service (default shmoptix)"), llvm::cl::init("shmoptix"));
+static llvm::cl::opt<bool> local("local", llvm::cl::desc("Serve the shaders given in this process"));
+static llvm::cl::opt<std::string> shaderName("shader", llvm::cl::desc("Shader to request (default the first local one)"));
+static llvm::cl::opt<unsigned> pointCount("points", llvm::cl::desc("Points per request (default 1024)"), llvm::cl::init(1024));
+static llvm::cl::opt<unsigned> requestCount("requests", llvm::cl::desc("Requests per client thread (default 10000)"), llvm::cl::init(10000));
+static llvm::cl::opt<unsigned> clientCount("clients", llvm::cl::desc("Client threads (default 4)"), llvm::cl::init(4));
+static llvm::cl::opt<unsigned> serviceThreads("service-threads", llvm::cl::desc("Worker threads of a -local service (default all cores)"));
+static llvm::cl::opt<unsigned> optLevel("O", llvm::cl::desc("Optimization level of -local (default -O2)"), llvm::cl::Prefix, llvm::cl::init(2));
+static llvm::cl::opt<std::string> builtinsFileName("builtins", llvm::cl::desc("Builtin library bitcode"), llvm::cl::value_desc("filename"), llvm::cl::init(SHMOPTIX_BUILTINS));
+
+#if defined(__linux__)
+
+int main(int argc, char** argv) {
+
+	llvm::InitializeNativeTarget();
+	llvm::InitializeNativeTargetAsmPrinter();
+
+	llvm::cl::ParseCommandLineOptions(argc, argv, "shmoptix shading service client\n");
+	if (optLevel > 3) {
+		llvm::errs() << "Unknown optimization level -O" << optLevel << newline;
+		exit(EXIT_FAILURE);
+	}
+
+	std::unique_ptr<BuiltinLibrary> builtins;
+	std::unique_ptr<ExecutionEnvironment> executionEnvironment;
+	std::unique_ptr<ShadingService> service;
+	std::vector<ParameterLayout::Storage> block;
+	size_t blockBytes = 0;
+	if (local) {
+		auto lanes = defaultGridLanes();
+		builtins = std::make_unique<BuiltinLibrary>(builtinsFileName);
+		executionEnvironment = std::make_unique<ExecutionEnvironment>(optLevel);
+		std::vector<std::string> names;
+		std::vector<ParameterLayout> layouts;
+		for (auto& fileName : shaderFileNames) {
+			auto file = llvm::MemoryBuffer::getFile(fileName);
+			if (!file) {
+				llvm::errs() << "Couldn't open " << fileName << newline;
+				exit(EXIT_FAILURE);
+			}
+			std::string name;
+			ParameterLayout layout;
+			Compiler compiler(fileName, *builtins, optLevel);
+			executionEnvironment->addObject(compiler.compile((*file)->getBuffer(), lanes, name, layout));
+			names.push_back(name);
+			layouts.push_back(layout);
+		}
+		executionEnvironment->finalize();
+		if (shaderName.empty() && !names.empty()) {
+			shaderName = names.front();
+		}
+		serviceName = serviceName + "-" + std::to_string(getpid());
+		service = std::make_unique<ShadingService>(serviceName, *executionEnvironment, lanes, 2 * clientCount, pointCount);
+		for (size_t i = 0; i < names.size(); ++i) {
+			service->add(names[i], layouts[i]);
+			if (names[i] == shaderName) {
+				block = layouts[i].allocate();
+				blockBytes = layouts[i].getSize();
+				layouts[i].set(block.data(), "Kd", { 1.f });
+				layouts[i].set(block.data(), "Cs", { 0.5f, 0.5f, 0.5f, 1.f });
+			}
+		}
+		service->start(serviceThreads ? unsigned(serviceThreads) : std::max(1u, std::thread::hardware_concurrency()));
+	}
+	if (shaderName.empty()) {
+		llvm::errs() << "No shader to request, see -shader" << newline;
+		exit(EXIT_FAILURE);
+	}
+
+	ShadingClient client(serviceName);
+	unsigned count = std::min<size_t>(pointCount, client.getMaxPoints());
+	std::vector<std::vector<double>> latencies(clientCount);
+	std::vector<shmoptix::Color> results(clientCount);
+	std::vector<unsigned> failures(clientCount);
+	std::vector<std::thread> clients;
+
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned c = 0; c < clientCount; ++c) {
+		clients.emplace_back([&, c] {
+			auto stride = client.getStride();
+			for (unsigned r = 0; r < requestCount; ++r) {
+				auto begin = std::chrono::steady_clock::now();
+				auto slot = client.acquire();
+				auto P = client.getP(slot);
+				auto N = client.getN(slot);
+				for (unsigned i = 0; i < count; ++i) {
+					P[i] = 0.f;
+					P[stride + i] = 0.f;
+					P[2 * stride + i] = 0.f;
+					P[3 * stride + i] = 1.f;
+					N[i] = 0.f;
+					N[stride + i] = 0.f;
+					N[2 * stride + i] = 1.f;
+					N[3 * stride + i] = 0.f;
+				}
+				client.submit(slot, shaderName, count, blockBytes ? block.data() : nullptr, blockBytes);
+				if (client.wait(slot)) {
+					auto Ci = client.getCi(slot);
+					results[c] = shmoptix::Color{ Ci[0], Ci[stride], Ci[2 * stride], Ci[3 * stride] };
+				}
+				else {
+					++failures[c];
+				}
+				client.release(slot);
+				std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - begin;
+				latencies[c].push_back(seconds.count());
+			}
+		});
+	}
+	for (auto& thread : clients) {
+		thread.join();
+	}
+	std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+
+	if (!requestCount || !clientCount) {
+		return EXIT_SUCCESS;
+	}
+	std::vector<double> all;
+	unsigned failed = 0;
+	for (unsigned c = 0; c < clientCount; ++c) {
+		all.insert(all.end(), latencies[c].begin(), latencies[c].end());
+		failed += failures[c];
+	}
+	std::sort(all.begin(), all.end());
+	auto percentile = [&](double p) { return all[std::min(all.size() - 1, size_t(p * all.size()))] * 1e6; };
+
+	llvm::outs() << all.size() << " requests of " << count << " points from " << clientCount << " clients, " << failed << " failed" << newline;
+	llvm::outs() << llvm::format("%.0f requests/s, %.0f points/s", all.size() / seconds.count(), all.size() * count / seconds.count()) << newline;
+	llvm::outs() << llvm::format("latency us: p50 %.1f, p90 %.1f, p99 %.1f, max %.1f", percentile(0.5), percentile(0.9), percentile(0.99), all.back() * 1e6) << newline;
+	llvm::outs() << "Ci: " << results.front() << newline;
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#else
+
+int main() {
+	llvm::errs() << "The shading service needs Linux" << newline;
+	return EXIT_FAILURE;
+}
+
+#endif
@@ -0,0 +1,242 @@
+// Shading language builtins, compiled to LLVM bitcode with clang and
+// linked into every shader module before optimization so they inline
+// into the shader body.
+//
+// Two flavours of each builtin:
+//   <name>(context, args...)                  single point, colors by pointer
+//   <name>_grid<W>(context, result, args...)  W points, structure of arrays:
+//                                             channel c of lane i at [c * W + i]
+//
+// Those that loop over the lights take the shading position P before the
+// other arguments, and illuminate evaluates one light for illuminance.
+// Signatures must match the builtin table in CodeGen.h, and the struct
+// below must match ExecutionEnvironment.h.
+
+typedef float float4 __attribute__((ext_vector_type(4)));
+
+// The lights are packed by LightList::pack: field f of light l at
+// lights[f * lightCount + l], the position, or the direction of a distant
+// light, the color and the falloff, 0 for a distant light.
+struct ShadingContext {
+	float4 Ci;
+	float4 N;
+	float4 P;
+	const float* lights;
+	int lightCount;
+};
+
+namespace {
+
+inline float dot3(float4 a, float4 b) {
+	return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+inline float4 normalize3(float4 v) {
+	return v / __builtin_sqrtf(dot3(v, v));
+}
+
+// L, normalized, and Cl of light l at P. Must match LightList.
+inline void illuminate3(const ShadingContext* context, int l, float4 P, float4& L, float4& Cl) {
+	const float* light = context->lights + l;
+	int n = context->lightCount;
+	float4 position{ light[0], light[n], light[2 * n], 0.f };
+	float falloff = light[6 * n];
+	Cl = float4{ light[3 * n], light[4 * n], light[5 * n], 1.f };
+	if (falloff == 0.f) {
+		L = normalize3(position);
+		return;
+	}
+	L = position - P;
+	float d2 = dot3(L, L);
+	float x = __builtin_fmaxf(1.f - d2 / (falloff * falloff), 0.f);
+	L = d2 > 0.f ? L / __builtin_sqrtf(d2) : float4{ 0.f, 0.f, 0.f, 0.f };
+	Cl.x *= x * x;
+	Cl.y *= x * x;
+	Cl.z *= x * x;
+}
+
+// L and Cl of light l at the W points of P, colors structure of arrays.
+template <int W>
+void illuminateGrid(const ShadingContext* context, int l, const float* __restrict P, float* __restrict L, float* __restrict Cl) {
+	const float* light = context->lights + l;
+	int n = context->lightCount;
+	float px = light[0], py = light[n], pz = light[2 * n];
+	float red = light[3 * n], green = light[4 * n], blue = light[5 * n];
+	float falloff = light[6 * n];
+	bool distant = falloff == 0.f;
+	float inverse = distant ? 0.f : 1.f / (falloff * falloff);
+	for (int i = 0; i < W; ++i) {
+		float x = distant ? px : px - P[i];
+		float y = distant ? py : py - P[W + i];
+		float z = distant ? pz : pz - P[2 * W + i];
+		float d2 = x * x + y * y + z * z;
+		float scale = d2 > 0.f ? 1.f / __builtin_sqrtf(d2) : 0.f;
+		float a = __builtin_fmaxf(1.f - d2 * inverse, 0.f);
+		a = distant ? 1.f : a * a;
+		L[i] = x * scale;
+		L[W + i] = y * scale;
+		L[2 * W + i] = z * scale;
+		L[3 * W + i] = 0.f;
+		Cl[i] = red * a;
+		Cl[W + i] = green * a;
+		Cl[2 * W + i] = blue * a;
+		Cl[3 * W + i] = 1.f;
+	}
+}
+
+template <int W>
+void dotGrid(float* __restrict result, const float* __restrict a, const float* __restrict b) {
+	for (int i = 0; i < W; ++i) {
+		result[i] = a[i] * b[i] + a[W + i] * b[W + i] + a[2 * W + i] * b[2 * W + i];
+	}
+}
+
+template <int W>
+void lengthGrid(float* __restrict result, const float* __restrict v) {
+	dotGrid<W>(result, v, v);
+	for (int i = 0; i < W; ++i) {
+		result[i] = __builtin_sqrtf(result[i]);
+	}
+}
+
+template <int W>
+void normalizeGrid(float* __restrict result, const float* __restrict v) {
+	float length[W];
+	lengthGrid<W>(length, v);
+	for (int c = 0; c < 4; ++c) {
+		for (int i = 0; i < W; ++i) {
+			result[c * W + i] = c == 3 ? v[c * W + i] : v[c * W + i] / length[i];
+		}
+	}
+}
+
+template <int W>
+void faceforwardGrid(float* __restrict result, const float* __restrict N, const float* __restrict I) {
+	float d[W];
+	dotGrid<W>(d, I, N);
+	for (int c = 0; c < 4; ++c) {
+		for (int i = 0; i < W; ++i) {
+			result[c * W + i] = d[i] < 0.f || c == 3 ? N[c * W + i] : -N[c * W + i];
+		}
+	}
+}
+
+template <int W>
+void ambientGrid(float* __restrict result) {
+	for (int i = 0; i < 4 * W; ++i) {
+		result[i] = i < 3 * W ? 0.f : 1.f;
+	}
+}
+
+// C = 1 + sum over lights of Cl * dot(L, N)
+template <int W>
+void diffuseGrid(ShadingContext* context, float* __restrict C, const float* __restrict P, const float* __restrict N) {
+	for (int i = 0; i < 4 * W; ++i) {
+		C[i] = 1.f;
+	}
+	float L[4 * W], Cl[4 * W];
+	for (int l = 0; l < context->lightCount; ++l) {
+		illuminateGrid<W>(context, l, P, L, Cl);
+		for (int i = 0; i < W; ++i) {
+			float d = N[i] * L[i] + N[W + i] * L[W + i] + N[2 * W + i] * L[2 * W + i];
+			C[i] += Cl[i] * d;
+			C[W + i] += Cl[W + i] * d;
+			C[2 * W + i] += Cl[2 * W + i] * d;
+		}
+	}
+}
+
+// Blinn specular, C = sum over lights of Cl * max(0, dot(N, H))^(1/roughness)
+template <int W>
+void specularGrid(ShadingContext* context, float* __restrict C, const float* __restrict P, const float* __restrict N, const float* __restrict V,
+	const float* __restrict roughness) {
+	ambientGrid<W>(C);
+	float L[4 * W], Cl[4 * W];
+	for (int l = 0; l < context->lightCount; ++l) {
+		illuminateGrid<W>(context, l, P, L, Cl);
+		for (int i = 0; i < W; ++i) {
+			float4 H = normalize3(float4{ L[i] + V[i], L[W + i] + V[W + i], L[2 * W + i] + V[2 * W + i], 0.f });
+			float d = N[i] * H.x + N[W + i] * H.y + N[2 * W + i] * H.z;
+			float s = d > 0.f ? __builtin_powf(d, 1.f / roughness[i]) : 0.f;
+			C[i] += Cl[i] * s;
+			C[W + i] += Cl[W + i] * s;
+			C[2 * W + i] += Cl[2 * W + i] * s;
+		}
+	}
+}
+
+}
+
+extern "C" {
+
+float dot(ShadingContext*, const float4* a, const float4* b) {
+	return dot3(*a, *b);
+}
+
+float length(ShadingContext*, const float4* v) {
+	return __builtin_sqrtf(dot3(*v, *v));
+}
+
+float4 normalize(ShadingContext*, const float4* v) {
+	float4 n = normalize3(*v);
+	n.w = v->w;
+	return n;
+}
+
+float4 faceforward(ShadingContext*, const float4* N, const float4* I) {
+	float4 n = dot3(*I, *N) < 0.f ? *N : -*N;
+	n.w = N->w;
+	return n;
+}
+
+float4 ambient(ShadingContext*) {
+	return float4{ 0.f, 0.f, 0.f, 1.f };
+}
+
+void illuminate(ShadingContext* context, int light, const float4* P, float4* L, float4* Cl) {
+	illuminate3(context, light, *P, *L, *Cl);
+}
+
+float4 diffuse(ShadingContext* context, const float4* P, const float4* N) {
+	float4 C{ 1.f, 1.f, 1.f, 1.f };
+	for (int l = 0; l < context->lightCount; ++l) {
+		float4 L, Cl;
+		illuminate3(context, l, *P, L, Cl);
+		float d = dot3(L, *N);
+		C.x += Cl.x * d;
+		C.y += Cl.y * d;
+		C.z += Cl.z * d;
+	}
+	return C;
+}
+
+float4 specular(ShadingContext* context, const float4* P, const float4* N, const float4* V, float roughness) {
+	float4 C = ambient(context);
+	for (int l = 0; l < context->lightCount; ++l) {
+		float4 L, Cl;
+		illuminate3(context, l, *P, L, Cl);
+		float4 H = normalize3(L + *V);
+		float d = dot3(*N, H);
+		float s = d > 0.f ? __builtin_powf(d, 1.f / roughness) : 0.f;
+		C.x += Cl.x * s;
+		C.y += Cl.y * s;
+		C.z += Cl.z * s;
+	}
+	return C;
+}
+
+#define SHMOPTIX_GRID_BUILTINS(W) \
+	void dot_grid##W(ShadingContext*, float* r, const float* a, const float* b) { dotGrid<W>(r, a, b); } \
+	void length_grid##W(ShadingContext*, float* r, const float* v) { lengthGrid<W>(r, v); } \
+	void normalize_grid##W(ShadingContext*, float* r, const float* v) { normalizeGrid<W>(r, v); } \
+	void faceforward_grid##W(ShadingContext*, float* r, const float* N, const float* I) { faceforwardGrid<W>(r, N, I); } \
+	void ambient_grid##W(ShadingContext*, float* r) { ambientGrid<W>(r); } \
+	void diffuse_grid##W(ShadingContext* c, float* r, const float* P, const float* N) { diffuseGrid<W>(c, r, P, N); } \
+	void specular_grid##W(ShadingContext* c, float* r, const float* P, const float* N, const float* V, const float* roughness) { specularGrid<W>(c, r, P, N, V, roughness); } \
+	void illuminate_grid##W(ShadingContext* c, int l, const float* P, float* L, float* Cl) { illuminateGrid<W>(c, l, P, L, Cl); }
+
+SHMOPTIX_GRID_BUILTINS(4)
+SHMOPTIX_GRID_BUILTINS(8)
+SHMOPTIX_GRID_BUILTINS(16)
+
+}
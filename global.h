@@ -2,20 +2,28 @@
 
 #include <iostream>
 
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
 namespace shmoptix {
 
 const char space = ' ';
 const char newline = '\n';
 
+const char* compilerVersion = "shmoptix 0.4";
+
 #ifdef LEADING_UNDERSCORE
 std::string leading_underscore{"_"};
 #else
 std::string leading_underscore{""};
 #endif
 
-static llvm::LLVMContext Context;
-std::unique_ptr<llvm::Module> module = std::make_unique<llvm::Module>("Shmoptix", Context);
-llvm::IRBuilder<>& getBuilder();
+// Line and column in the shader source, both starting at 1. Zero means
+// unknown.
+struct Location {
+	unsigned line = 0;
+	unsigned column = 0;
+};
 
 llvm::raw_ostream& operator<<(llvm::raw_ostream& out, float v) {
 	return out << llvm::format("%0.1f", v);
@@ -1,9 +1,12 @@
+#include <chrono>
+#include <cmath>
 #include <cstdlib>
-#include <fstream>
 #include <iostream>
 #include <memory>
+#include <random>
 #include <string>
 #include <utility>
+#include <vector>
 
 #ifndef __STDC_LIMIT_MACROS
 #define __STDC_LIMIT_MACROS     // bogus error in XCode
@@ -15,66 +18,454 @@
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/GenericValue.h"
 #include "llvm/ExecutionEngine/MCJIT.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/TargetSelect.h"
 
+#include "BatchShading.h"
+#include "BuiltinLibrary.h"
 #include "CodeGen.h"
+#include "Compiler.h"
+#include "HotReload.h"
 #include "ErrorHandler.h"
 #include "ExecutionEnvironment.h"
 #include "Lexer.h"
+#include "ObjectCache.h"
+#include "Optimizer.h"
+#include "ParameterLayout.h"
 #include "Parser.h"
+#include "ShaderLibrary.h"
+#include "ShadingService.h"
+#include "Specializer.h"
+#include "Statistics.h"
+#include "ThreadPool.h"
+#include "Tiered.h"
 
 
-namespace shmoptix {
+using namespace shmoptix;
+
+static llvm::cl::list<std::string> inputFileNames(llvm::cl::Positional, llvm::cl::desc("<shader.sl>..."), llvm::cl::OneOrMore);
+static llvm::cl::opt<std::string> cacheDirectory("cache-dir", llvm::cl::desc("Directory for cached shader objects"), llvm::cl::value_desc("directory"));
+static llvm::cl::opt<unsigned> optLevel("O", llvm::cl::desc("Optimization level: -O0, -O1, -O2 or -O3 (default -O2)"), llvm::cl::Prefix, llvm::cl::init(2));
+static llvm::cl::opt<std::string> builtinsFileName("builtins", llvm::cl::desc("Builtin library bitcode"), llvm::cl::value_desc("filename"), llvm::cl::init(SHMOPTIX_BUILTINS));
+static llvm::cl::opt<bool> specialize("specialize", llvm::cl::desc("Also shade with a variant that has the parameters baked in"));
+static llvm::cl::opt<unsigned> codeBudget("code-budget", llvm::cl::desc("Megabytes of specialized shader code to keep (default 64)"), llvm::cl::init(64));
+static llvm::cl::opt<bool> lazy("lazy", llvm::cl::desc("Compile each shader function on its first call"));
+static llvm::cl::opt<bool> tiered("tiered", llvm::cl::desc("Start shading in the interpreter, compile once the shader is hot"));
+static llvm::cl::opt<unsigned> tierThreshold("tier-threshold", llvm::cl::desc("Points a shader shades in the interpreter before it is compiled"), llvm::cl::init(4096));
+static llvm::cl::opt<bool> watch("watch", llvm::cl::desc("Keep shading, recompile shaders whose files change"));
+static llvm::cl::opt<unsigned> watchInterval("watch-interval", llvm::cl::desc("Milliseconds between checks for changed shader files"), llvm::cl::init(250));
+static llvm::cl::opt<std::string> serveName("serve", llvm::cl::desc("Shade grids that renderer processes submit through shared memory /name"), llvm::cl::value_desc("name"));
+static llvm::cl::opt<unsigned> serviceThreads("service-threads", llvm::cl::desc("Worker threads of -serve (default all cores)"));
+static llvm::cl::opt<unsigned> serviceSlots("service-slots", llvm::cl::desc("Requests -serve can hold at once (default 64)"), llvm::cl::init(64));
+static llvm::cl::opt<unsigned> servicePoints("service-points", llvm::cl::desc("Points per request of -serve (default 4096)"), llvm::cl::init(4096));
+static llvm::cl::opt<std::string> batchFileName("batch", llvm::cl::desc("Shade the points of a point file, see BatchShading.h"), llvm::cl::value_desc("filename"));
+static llvm::cl::opt<std::string> batchOutputFileName("batch-output", llvm::cl::desc("Ci and Oi of -batch (default <point file>.ci)"), llvm::cl::value_desc("filename"));
+static llvm::cl::opt<unsigned> makePoints("make-points", llvm::cl::desc("Write a test point file with this many points to -batch and shade it"));
+static llvm::cl::opt<bool> aot("aot", llvm::cl::desc("Compile the shaders ahead of time into a shared library or object, see -o"));
+static llvm::cl::opt<std::string> outputFileName("o", llvm::cl::desc("Output of -aot, an object if it ends in .o (default shaders.so)"), llvm::cl::value_desc("filename"), llvm::cl::init("shaders.so"));
+static llvm::cl::opt<unsigned> lightCount("lights", llvm::cl::desc("Shade with a scene of this many point lights, culled per grid"));
+static llvm::cl::opt<std::string> targetCPU("target-cpu", llvm::cl::desc("CPU to compile for (default the host's)"), llvm::cl::value_desc("cpu"));
+static llvm::cl::opt<std::string> targetFeatures("target-features", llvm::cl::desc("Features to add or remove, e.g. -avx512f"), llvm::cl::value_desc("+feature,-feature"));
+static llvm::cl::opt<bool> verify("verify", llvm::cl::desc("Check the grid Ci of every point against the scalar entry point"));
+static llvm::cl::opt<bool> dumpIR("dump-ir", llvm::cl::desc("Print the optimized IR"));
+static llvm::cl::opt<bool> debugInfo("g", llvm::cl::desc("Emit DWARF line info for the shader source"));
+static llvm::cl::opt<bool> profile("perf", llvm::cl::desc("Write perf map and jitdump files for the compiled shaders, implies -g"));
+static llvm::cl::opt<bool> printStatistics("stats", llvm::cl::desc("Print compile phase times and counters"));
+static llvm::cl::opt<bool> printStatisticsJSON("stats-json", llvm::cl::desc("Print compile phase times and counters as JSON"));
 
-llvm::IRBuilder<> Builder(Context);
-llvm::IRBuilder<>& getBuilder() {
-	return Builder;
+void initializeGrid(Grid& grid) {
+	Bounds bounds;
+	bounds.extend(0.f, 0.f, 0.f);
+	bounds.extend(0.1f, 0.1f, 0.1f);
+	grid.setBounds(bounds);
+	grid.setUniform("Kd", { 3.f });
+	grid.setUniform("Cs", { 23.f, 26.f, 29.f, 32.f });
+	grid.add("P", 4);
+	grid.add("N", 4);
+	grid.add("Ci", 4);
+	for (size_t i = 0; i < grid.getCount(); ++i) {
+		auto t = 0.1f * i / grid.getCount();
+		grid.set("P", i, shmoptix::Color{ t, t, 0.05f, 1.f });
+		grid.set("N", i, shmoptix::Color{ 7.f, 77.f, 777.f, 0.f });
+	}
 }
 
+// Shade every point of the grid again with the scalar entry point, from
+// the Ci the grid had before shading, and exit unless both agree.
+void verifyGrid(ExecutionEnvironment& executionEnvironment, const std::string& shaderName, Grid& grid, const void* block,
+	const std::vector<float>& initialCi) {
+
+	std::vector<float> gridLights;
+	auto context = executionEnvironment.createShadingContext(grid, gridLights);
+	auto P = grid.get("P");
+	auto N = grid.get("N");
+	auto Ci = grid.get("Ci");
+	auto stride = grid.getStride();
+	for (size_t i = 0; i < grid.getCount(); ++i) {
+		for (unsigned c = 0; c < 4; ++c) {
+			context.P.value[c] = P[c * stride + i];
+			context.N.value[c] = N[c * stride + i];
+			context.Ci[c] = initialCi[c * stride + i];
+		}
+		executionEnvironment.runFunction(shaderName, context, block, i, stride);
+		for (unsigned c = 0; c < 4; ++c) {
+			auto expected = context.Ci[c];
+			if (std::abs(Ci[c * stride + i] - expected) > 1e-4f * std::max(1.f, std::abs(expected))) {
+				llvm::outs() << "Point " << i << ": grid Ci " << grid.getColor("Ci", i) << ", scalar Ci " << context.Ci << newline;
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	llvm::outs() << "Grid matches scalar at " << grid.getCount() << " points" << newline;
 }
 
-using namespace shmoptix;
+// With -lights, a scene of that many point lights scattered around the
+// grids and the points of -make-points, and one distant light.
+void initializeLights(ExecutionEnvironment& executionEnvironment) {
+	if (!lightCount) {
+		return;
+	}
+	LightList scene;
+	scene.addDistant(Vector4{ 1.f, 0.f, 0.f }, shmoptix::Color{ 1.f });
+	std::mt19937 random(lightCount);
+	std::uniform_real_distribution<float> position(-1.f, 2.f), color(0.f, 1.f), falloff(0.1f, 0.5f);
+	for (unsigned i = 0; i < lightCount; ++i) {
+		scene.addPoint(Vector4{ position(random), position(random), position(random) },
+			shmoptix::Color{ color(random), color(random), color(random) }, falloff(random));
+	}
+	executionEnvironment.setLights(scene);
+}
 
+// Shade a few frames the way interactive relighting would: the first ones
+// in the interpreter, the later ones with the compiled shader.
+void shadeTiered(llvm::StringRef source, BuiltinLibrary& builtins, unsigned lanes) {
 
+	ExecutionEnvironment executionEnvironment(optLevel, profile);
+	initializeLights(executionEnvironment);
+	TieredShaders shaders(executionEnvironment, builtins, lanes, optLevel, tierThreshold);
+	Compiler compiler(inputFileNames.front(), builtins, optLevel);
+	auto shader = compiler.parse(source);
+	auto shaderName = shader->getName();
+	shaders.add(std::move(shader));
 
-int main(int argc, char** argv) {
+	ThreadPool pool;
+	Grid grid(1024, lanes);
+	initializeGrid(grid);
+	for (unsigned frame = 0; frame < 8; ++frame) {
+		auto compiled = shaders.isCompiled(shaderName);
+		auto start = std::chrono::steady_clock::now();
+		shaders.shade(shaderName, grid, pool);
+		std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+		llvm::outs() << "Frame " << frame << (compiled ? " compiled" : " interpreted") << llvm::format(" %.3f ms", seconds.count() * 1e3)
+			<< " Grid Ci: " << grid.getColor("Ci", 0) << newline;
+		if (frame == 3) {
+			shaders.wait();
+		}
+	}
+}
+
+// Shade the grid with every shader over and over, the way an interactive
+// render would, until interrupted. Edited shaders are swapped in between
+// grids.
+void shadeWatched(BuiltinLibrary& builtins, unsigned lanes) {
 
+	ExecutionEnvironment executionEnvironment(optLevel, profile);
+	initializeLights(executionEnvironment);
+	HotReloadShaders shaders(executionEnvironment, builtins, lanes, optLevel);
+	std::vector<std::string> shaderNames;
+	for (auto& fileName : inputFileNames) {
+		shaderNames.push_back(shaders.add(fileName));
+	}
+	shaders.watch(std::chrono::milliseconds(watchInterval));
+
+	ThreadPool pool;
+	Grid grid(1024, lanes);
+	initializeGrid(grid);
+	std::vector<unsigned> generations(shaderNames.size(), ~0u);
+	for (;;) {
+		for (size_t i = 0; i < shaderNames.size(); ++i) {
+			shaders.shade(shaderNames[i], grid, pool);
+			auto generation = shaders.getGeneration(shaderNames[i]);
+			if (generation != generations[i]) {
+				generations[i] = generation;
+				llvm::outs() << shaderNames[i] << " version " << generation << " Grid Ci: " << grid.getColor("Ci", 0)
+					<< " code " << executionEnvironment.getCodeBytes() << " bytes" << newline;
+			}
+		}
+	}
+}
 
+#if defined(__linux__)
+// Compile the shaders and shade the requests of renderer processes until
+// killed, see ShadingService.h.
+void serve(BuiltinLibrary& builtins, unsigned lanes) {
+
+	ExecutionEnvironment executionEnvironment(optLevel, profile);
+	std::vector<std::string> shaderNames;
+	std::vector<ParameterLayout> layouts;
+	for (auto& fileName : inputFileNames) {
+		auto file = llvm::MemoryBuffer::getFile(fileName);
+		if (!file) {
+			std::cerr << "Couldn't open " << fileName << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		std::string shaderName;
+		ParameterLayout layout;
+		Compiler compiler(fileName, builtins, optLevel);
+		executionEnvironment.addObject(compiler.compile((*file)->getBuffer(), lanes, shaderName, layout));
+		shaderNames.push_back(shaderName);
+		layouts.push_back(layout);
+	}
+	executionEnvironment.finalize();
+
+	ShadingService service(serveName, executionEnvironment, lanes, serviceSlots, servicePoints);
+	for (size_t i = 0; i < shaderNames.size(); ++i) {
+		service.add(shaderNames[i], layouts[i]);
+	}
+	auto threads = serviceThreads ? unsigned(serviceThreads) : std::max(1u, std::thread::hardware_concurrency());
+	service.start(threads);
+	llvm::outs() << "Serving " << shaderNames.size() << " shaders on /" << serveName << " with " << threads << " threads" << newline;
+	llvm::outs().flush();
+	service.join();
+}
+#endif
+
+int main(int argc, char** argv) {
 
 	llvm::InitializeNativeTarget();
 	llvm::InitializeNativeTargetAsmPrinter();
 
-	if (argc != 2) {
-		llvm::outs() << "Usage: " << argv[0] << " <shader.sl>" << newline;
+	llvm::cl::ParseCommandLineOptions(argc, argv, "shmoptix shading language compiler\n");
+	if (optLevel > 3) {
+		std::cerr << "Unknown optimization level -O" << optLevel << std::endl;
 		exit(EXIT_FAILURE);
 	}
-	std::string fileName(argv[1]);
-	std::ifstream shaderStream(fileName);
-	if(!shaderStream) {
+	if (profile) {
+		debugInfo = true;
+	}
+
+	if (!targetCPU.empty() || !targetFeatures.empty()) {
+		setDefaultTarget(targetCPU, targetFeatures);
+	}
+
+	BuiltinLibrary builtins(builtinsFileName);
+	auto lanes = defaultGridLanes();
+
+	if (aot) {
+		ShaderLibrary library(builtins, lanes, optLevel);
+		for (auto& fileName : inputFileNames) {
+			library.add(fileName);
+		}
+		library.write(outputFileName);
+		llvm::outs() << "Wrote " << outputFileName << newline;
+		return 0;
+	}
+
+	if (!batchFileName.empty()) {
+#if !defined(_WIN32)
+		if (makePoints) {
+			BatchShader::writeTestPoints(batchFileName, makePoints);
+		}
+		ExecutionEnvironment executionEnvironment(optLevel, profile);
+		initializeLights(executionEnvironment);
+		BatchShader batch(executionEnvironment, builtins, lanes, optLevel);
+		ThreadPool pool;
+		batch.shade(inputFileNames.front(), batchFileName, batchOutputFileName.empty() ? batchFileName + ".ci" : std::string(batchOutputFileName), pool);
+		return 0;
+#else
+		std::cerr << "-batch needs mmap" << std::endl;
+		exit(EXIT_FAILURE);
+#endif
+	}
+
+	if (!serveName.empty()) {
+#if defined(__linux__)
+		serve(builtins, lanes);
+		return 0;
+#else
+		std::cerr << "-serve needs Linux" << std::endl;
+		exit(EXIT_FAILURE);
+#endif
+	}
+
+	if (watch) {
+		shadeWatched(builtins, lanes);
+		return 0;
+	}
+
+	// Cached objects hold a variant for each dispatch target, so a cache
+	// shared by a farm serves every machine of it. The rest of the object
+	// is for the oldest.
+	auto dispatchTargets = getDispatchTargets();
+	auto dispatchTarget = !cacheDirectory.empty() && !lazy ? selectDispatchTarget(dispatchTargets) : nullptr;
+	if (dispatchTarget) {
+		lanes = dispatchTarget->getLanes();
+	}
+
+	std::string fileName(inputFileNames.front());
+	Compiler compiler(fileName, builtins, optLevel, false, dispatchTarget ? dispatchTargets.front() : getDefaultTarget());
+	auto& statistics = compiler.getStatistics();
+	statistics.begin("read");
+
+	auto file = llvm::MemoryBuffer::getFile(fileName);
+	if (!file) {
 		std::cerr << "Couldn't open " << fileName << std::endl;
 		exit(EXIT_FAILURE);
 	}
-	llvm::outs() << "Parsing" << newline;
+	auto source = (*file)->getBuffer();
+
+	if (tiered) {
+		shadeTiered(source, builtins, lanes);
+		llvm::outs() << "Done" << newline;
+		return 0;
+	}
+
+	std::unique_ptr<ShaderObjectCache> cache;
+	std::string key;
+	std::unique_ptr<llvm::MemoryBuffer> object;
+	if (!cacheDirectory.empty()) {
+		statistics.begin("cache lookup");
+		cache = std::make_unique<ShaderObjectCache>(cacheDirectory);
+		std::string targetKey;
+		if (dispatchTarget) {
+			for (auto& target : dispatchTargets) {
+				targetKey += target.name + " " + target.getKey() + ";";
+			}
+		}
+		else {
+			targetKey = getDefaultTarget().getKey() + " " + std::to_string(lanes);
+		}
+		key = cache->getKey({ source, builtins.getHash(), targetKey, std::to_string(optLevel), debugInfo ? "-g" : "" });
+		object = cache->load(key);
+	}
+	statistics.end();
 
-	Lexer lexer;
-	Parser parser(lexer);
+	std::unique_ptr<SurfaceShaderAST> shader;
+	std::string shaderName;
+	ParameterLayout layout;
 
-	auto shader = parser.parse(shaderStream);
-	auto function = shader->codegen();
+	if (object) {
+		llvm::outs() << "Using cached object" << newline;
+		if (specialize) {
+			shader = compiler.parse(source);
+			shaderName = shader->getName();
+			layout = shader->getParameterLayout();
+		}
+		else {
+			Lexer lexer;
+			Parser parser(lexer);
+			auto prototype = parser.parsePrototype(source);
+			shaderName = prototype->getName();
+			layout = prototype->getParameterLayout();
+			statistics.setShader(shaderName);
+		}
+	}
+	else {
+		llvm::outs() << "Parsing" << newline;
+		shader = compiler.parse(source);
+		shaderName = shader->getName();
+		layout = shader->getParameterLayout();
+
+		if (debugInfo) {
+			compiler.enableDebugInfo(fileName);
+		}
+		if (dispatchTarget) {
+			compiler.codegen(*shader, dispatchTargets);
+		}
+		else {
+			compiler.codegen(*shader, lanes);
+		}
+		compiler.link();
+
+		if (lazy) {
+			llvm::outs() << "Compiling lazily -O" << optLevel << newline;
+			if (dumpIR) {
+				compiler.getModule().print(llvm::outs(), nullptr);
+			}
+		}
+		else {
+			llvm::outs() << "Optimizing -O" << optLevel << newline;
+			compiler.optimize();
+			if (dumpIR) {
+				compiler.getModule().print(llvm::outs(), nullptr);
+			}
+
+			object = compiler.emitObject();
+			if (cache) {
+				cache->store(key, object->getMemBufferRef());
+			}
+		}
+	}
+
+	statistics.begin("load object");
+	ExecutionEnvironment executionEnvironment(optLevel, profile, lazy);
+	initializeLights(executionEnvironment);
+	if (object) {
+		executionEnvironment.addObject(std::move(object));
+		if (dispatchTarget) {
+			llvm::outs() << "Dispatching " << dispatchTarget->name << newline;
+			executionEnvironment.dispatch(shaderName, *dispatchTarget);
+		}
+	}
+	else {
+		executionEnvironment.addModule(compiler.takeModule());
+	}
+	executionEnvironment.finalize();
+	statistics.end();
+	statistics.setCounter("code bytes", executionEnvironment.getCodeBytes());
+	if (printStatistics) {
+		statistics.print(llvm::outs());
+	}
+	if (printStatisticsJSON) {
+		statistics.printJSON(llvm::outs());
+	}
+
+	auto context = executionEnvironment.createShadingContext();
+	context.Ci = shmoptix::Color{ 13.f, 66.f, 33.f };
+	context.N = Vector4{ 7.f, 77.f, 777.f };
+	auto block = layout.allocate();
+	layout.set(block.data(), "Kd", { 3.f });
+	layout.set(block.data(), "Cs", { 23.f, 26.f, 29.f, 32.f });
+	if (dumpIR) {
+		layout.print(llvm::outs());
+	}
+	llvm::outs() << "Ci: " << context.Ci << newline;
+	executionEnvironment.runFunction(shaderName, context, block.data());
+	llvm::outs() << "Ci: " << context.Ci << newline;
 
-	//module->dump();
+	Grid grid(1024, lanes);
+	initializeGrid(grid);
+	GridBlock gridBlock(layout, grid);
+	std::vector<float> initialCi(grid.get("Ci"), grid.get("Ci") + 4 * grid.getStride());
+	executionEnvironment.shade(shaderName, grid, gridBlock.get());
+	llvm::outs() << "Grid Ci (" << lanes << " lanes): " << grid.getColor("Ci", 0) << newline;
+	if (verify) {
+		verifyGrid(executionEnvironment, shaderName, grid, gridBlock.get(), initialCi);
+	}
+	if (lightCount) {
+		std::vector<float> gridLights;
+		auto gridContext = executionEnvironment.createShadingContext(grid, gridLights);
+		llvm::outs() << "Grid lights: " << gridContext.lightCount << " of " << executionEnvironment.getLightCount() << newline;
+	}
 
-	llvm::outs() << "Verifying" << newline;
-	if (llvm::verifyModule(*module, &llvm::dbgs())) {
-		llvm::outs() << "Error verifying module" << newline;
-		exit(0);
+	if (specialize) {
+		Specializer specializer(*shader, builtins, executionEnvironment, lanes, optLevel, cache.get(), key, uint64_t(codeBudget) << 20);
+		ParameterValues values{ { "Kd", { 3.f } }, { "Cs", { 23.f, 26.f, 29.f, 32.f } } };
+		specializer.shade(values, grid, gridBlock.get());
+		specializer.wait();
+
+		context.Ci = shmoptix::Color{ 13.f, 66.f, 33.f };
+		auto specialized = specializer.run(values, context, block.data());
+		llvm::outs() << (specialized ? "Specialized" : "Generic") << " Ci: " << context.Ci << newline;
+		specializer.shade(values, grid, gridBlock.get());
+		llvm::outs() << "Specialized grid Ci: " << grid.getColor("Ci", 0) << newline;
+		specializer.printStatistics(llvm::outs());
 	}
-	llvm::outs() << "Verification ok." << newline;
 
-	ExecutionEnvironment executionEnvironment(std::move(module));
-	executionEnvironment.dump();
-	executionEnvironment.runFunction(function->getName().str());
-	executionEnvironment.dump();
+	if (cache) {
+		cache->printStatistics(llvm::outs());
+	}
 
 	llvm::outs() << "Done" << newline;
 }